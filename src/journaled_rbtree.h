@@ -0,0 +1,453 @@
+#ifndef JOURNALED_RBTREE_H_
+#define JOURNALED_RBTREE_H_
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <utility>
+
+#include "rbtree.h"
+
+namespace trilib {
+
+namespace {
+
+constexpr uint32_t kJournalMagic = 0x4a4c5254;     // "TRLJ"
+constexpr uint32_t kCheckpointMagic = 0x434c5254;  // "TRLC"
+constexpr uint32_t kJournalVersion = 1;
+
+enum JournalOp : char {
+  kJournalInsert = 1,
+  kJournalDelete = 2,
+};
+
+// Streambuf appending everything written to a string.
+class StringAppendBuf : public std::streambuf {
+ public:
+  explicit StringAppendBuf(std::string* out) : out_(out) {}
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      out_->push_back(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char* s, std::streamsize n) override {
+    out_->append(s, n);
+    return n;
+  }
+
+ private:
+  std::string* out_;
+};
+
+// Makes a rename or a new file in the directory of path durable.
+inline bool SyncParentDir(const std::string& path) {
+  const size_t slash = path.rfind('/');
+  const std::string dir = slash == std::string::npos
+                              ? std::string(".")
+                              : slash == 0 ? std::string("/")
+                                           : path.substr(0, slash);
+  const int fd = ::open(dir.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  const bool ok = ::fsync(fd) == 0;
+  ::close(fd);
+  return ok;
+}
+
+}  // namespace
+
+struct JournalOptions {
+  JournalOptions()
+      : commit_records(64),
+        commit_interval_us(0),
+        checkpoint_bytes(64 << 20),
+        sync_log(::fdatasync) {}
+
+  // Pending records are written and fsynced together once there are this
+  // many of them, 1 makes every change durable before it returns. 0 leaves
+  // commits to Commit, the interval and checkpoints.
+  size_t commit_records;
+  // Also commits once the oldest pending record is this old. It's checked
+  // only when a record is added, there is no background thread. 0 disables.
+  uint64_t commit_interval_us;
+  // Takes a checkpoint and truncates the log once it grows over this many
+  // bytes. 0 leaves checkpoints to Checkpoint.
+  uint64_t checkpoint_bytes;
+  // Makes written records durable, returns 0 on success like fdatasync.
+  // Tests replace it to inject failures.
+  int (*sync_log)(int fd);
+};
+
+struct JournalStats {
+  uint64_t records;      // appended since Recover
+  uint64_t commits;      // fsyncs of the log
+  uint64_t checkpoints;
+  uint64_t failed_checkpoints;  // automatic ones, the log keeps growing
+  uint64_t replayed;     // log records applied by Recover
+};
+
+// RBTree whose changes are appended to a log file, so it can be rebuilt
+// after a crash. Records are buffered and made durable in groups, one write
+// and one fsync per commit, at the cadence set by JournalOptions; whatever
+// wasn't committed is lost on a crash. A checkpoint writes the whole tree in
+// linear time with SaveTo next to the log and truncates the log, so recovery
+// is a linear bulk load of the checkpoint plus replay of the log tail.
+//
+//   trilib::JournaledRBTree<int64_t, std::less<int64_t>> tree;
+//   tree.Recover("/data/set.ckpt", "/data/set.log");
+//   tree.Insert(42);
+//   tree.Commit();  // 42 survives a crash from now on
+//
+// Each record carries a sequence number and a checksum chained over the log.
+// Recovery stops at the first torn or corrupted record and cuts it off, and
+// skips records already contained in the checkpoint, so a crash between
+// writing a checkpoint and truncating the log doesn't apply them twice.
+// Values are encoded with CodecT like in RBTree::SaveTo. Reads go to tree(),
+// changes must go through this class.
+template <typename ValueT, typename CompT,
+          typename CodecT = PodCodec<ValueT>>
+class JournaledRBTree {
+ public:
+  using TreeT = RBTree<ValueT, CompT>;
+
+  JournaledRBTree()
+      : pending_buf_(&pending_),
+        pending_out_(&pending_buf_),
+        log_fd_(-1),
+        lsn_(0),
+        log_bytes_(0),
+        hash_(0),
+        pending_records_(0),
+        stats_() {}
+
+  ~JournaledRBTree() { Close(); }
+
+  JournaledRBTree(const JournaledRBTree&) = delete;
+  JournaledRBTree& operator=(const JournaledRBTree&) = delete;
+
+  // Rebuilds the tree from the checkpoint, if there is one, and the records
+  // of the log newer than it, then opens the log for appending. Missing
+  // files are created empty. Returns false if a file can't be opened or the
+  // checkpoint is damaged, then the journal stays closed.
+  bool Recover(const std::string& checkpoint_path, const std::string& log_path,
+               const JournalOptions& options = JournalOptions()) {
+    Close();
+    checkpoint_path_ = checkpoint_path;
+    options_ = options;
+    stats_ = JournalStats();
+    tree_.Clear();
+    uint64_t checkpoint_lsn = 0;
+    if (!LoadCheckpoint(&checkpoint_lsn)) {
+      return false;
+    }
+    lsn_ = checkpoint_lsn;
+    log_fd_ = ::open(log_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (log_fd_ < 0) {
+      return false;
+    }
+    if (!ReplayLog(log_path, checkpoint_lsn)) {
+      ::close(log_fd_);
+      log_fd_ = -1;
+      tree_.Clear();
+      return false;
+    }
+    return true;
+  }
+
+  bool IsOpen() const { return log_fd_ >= 0; }
+
+  // Returns false if the journal isn't open, then the tree isn't changed, or
+  // if a commit this record triggered failed. A failed checkpoint after a
+  // good commit doesn't count, see JournalStats::failed_checkpoints.
+  bool Insert(ValueT value) {
+    if (log_fd_ < 0) {
+      return false;
+    }
+    Append(kJournalInsert, value);
+    tree_.Insert(std::move(value));
+    return MaybeCommit();
+  }
+
+  // Deletes one element equal to value. Returns false if there is none or
+  // like Insert.
+  bool Delete(const ValueT& value) {
+    typename TreeT::iterator iter = tree_.Search(value);
+    if (log_fd_ < 0 || iter == tree_.end()) {
+      return false;
+    }
+    Append(kJournalDelete, value);
+    tree_.Delete(iter);
+    return MaybeCommit();
+  }
+
+  // Writes and fsyncs all pending records. On failure whatever got written
+  // of them is cut off the log, they stay pending and the next commit
+  // retries them. If the log can't be cut the journal closes. Returns true
+  // once the records are durable, even if the checkpoint this triggers fails.
+  bool Commit() {
+    if (!WriteLog()) {
+      return false;
+    }
+    if (options_.checkpoint_bytes > 0 &&
+        log_bytes_ >= options_.checkpoint_bytes && !Checkpoint()) {
+      ++stats_.failed_checkpoints;
+    }
+    return true;
+  }
+
+  // Commits, writes the tree to a temporary file renamed over the
+  // checkpoint once it's durable, then truncates the log. Takes O(n).
+  bool Checkpoint() {
+    if (!WriteLog()) {
+      return false;
+    }
+    const std::string tmp_path = checkpoint_path_ + ".tmp";
+    const int fd =
+        ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    bool ok;
+    {
+      FdStreamBuf fd_buf(fd);
+      std::ostream out(&fd_buf);
+      ok = WriteU64(out,
+                    (uint64_t(kJournalVersion) << 32) | kCheckpointMagic) &&
+           WriteU64(out, lsn_) && tree_.template SaveTo<CodecT>(out);
+    }
+    ok = ok && ::fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || std::rename(tmp_path.c_str(), checkpoint_path_.c_str()) != 0 ||
+        !SyncParentDir(checkpoint_path_)) {
+      ::unlink(tmp_path.c_str());
+      return false;
+    }
+    // The checkpoint covers the whole log now. If truncating fails the log
+    // is still valid, its records are skipped by recovery.
+    if (ftruncate(log_fd_, kLogHeaderBytes) != 0) {
+      return false;
+    }
+    log_bytes_ = kLogHeaderBytes;
+    hash_ = kFnvBasis;
+    // Unsynced, the cut may or may not survive a crash, and records
+    // appended now could follow stale ones, so the journal stops.
+    if (options_.sync_log(log_fd_) != 0) {
+      ::close(log_fd_);
+      log_fd_ = -1;
+      return false;
+    }
+    ++stats_.checkpoints;
+    return true;
+  }
+
+  // Commits pending records and closes the log.
+  void Close() {
+    if (log_fd_ >= 0) {
+      Commit();
+      ::close(log_fd_);
+      log_fd_ = -1;
+    }
+    pending_.clear();
+    pending_records_ = 0;
+  }
+
+  const TreeT& tree() const { return tree_; }
+
+  // Sequence number of the last change.
+  uint64_t lsn() const { return lsn_; }
+  const JournalStats& stats() const { return stats_; }
+
+ private:
+  static constexpr uint64_t kLogHeaderBytes = 8;
+  static constexpr uint64_t kFnvBasis = 14695981039346656037ULL;
+
+  // Writes pending records with a single write and fsync.
+  bool WriteLog() {
+    if (log_fd_ < 0) {
+      return false;
+    }
+    if (pending_.empty()) {
+      return true;
+    }
+    const char* ptr = pending_.data();
+    const char* const end = ptr + pending_.size();
+    while (ptr < end) {
+      const ssize_t n = ::write(log_fd_, ptr, end - ptr);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        CutUncommitted();
+        return false;
+      }
+      ptr += n;
+    }
+    if (options_.sync_log(log_fd_) != 0) {
+      // The group may be on disk or not. Left in the log it would be
+      // written again by the retry, with the same sequence numbers.
+      CutUncommitted();
+      return false;
+    }
+    log_bytes_ += pending_.size();
+    pending_.clear();
+    pending_records_ = 0;
+    ++stats_.commits;
+    return true;
+  }
+
+  // Cuts off a group that wasn't committed, the next commit writes it
+  // again. If that fails later records would follow a torn one and be lost
+  // by recovery, so the journal stops taking changes.
+  void CutUncommitted() {
+    if (ftruncate(log_fd_, log_bytes_) != 0) {
+      ::close(log_fd_);
+      log_fd_ = -1;
+    }
+  }
+
+  bool LoadCheckpoint(uint64_t* lsn) {
+    const int fd = ::open(checkpoint_path_.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return errno == ENOENT;
+    }
+    bool ok;
+    {
+      FdStreamBuf fd_buf(fd);
+      std::istream in(&fd_buf);
+      uint64_t magic = 0;
+      ok = ReadU64(in, &magic) &&
+           magic == ((uint64_t(kJournalVersion) << 32) | kCheckpointMagic) &&
+           ReadU64(in, lsn) && tree_.template LoadFrom<CodecT>(in);
+    }
+    ::close(fd);
+    return ok;
+  }
+
+  // Applies valid records newer than checkpoint_lsn and cuts the log after
+  // the last valid one.
+  bool ReplayLog(const std::string& log_path, uint64_t checkpoint_lsn) {
+    struct stat st;
+    if (fstat(log_fd_, &st) != 0) {
+      return false;
+    }
+    hash_ = kFnvBasis;
+    if (static_cast<uint64_t>(st.st_size) < kLogHeaderBytes) {
+      // New log or one torn while being created.
+      std::string header;
+      StringAppendBuf header_buf(&header);
+      std::ostream header_out(&header_buf);
+      WriteU64(header_out, (uint64_t(kJournalVersion) << 32) | kJournalMagic);
+      log_bytes_ = kLogHeaderBytes;
+      return ftruncate(log_fd_, 0) == 0 &&
+             ::write(log_fd_, header.data(), header.size()) ==
+                 static_cast<ssize_t>(header.size()) &&
+             ::fsync(log_fd_) == 0 && SyncParentDir(log_path);
+    }
+    if (lseek(log_fd_, 0, SEEK_SET) != 0) {
+      return false;
+    }
+    uint64_t valid_bytes = kLogHeaderBytes;
+    {
+      FdStreamBuf fd_buf(log_fd_);
+      std::istream in(&fd_buf);
+      uint64_t magic = 0;
+      if (!ReadU64(in, &magic) ||
+          magic != ((uint64_t(kJournalVersion) << 32) | kJournalMagic)) {
+        return false;
+      }
+      ChecksumStreamBuf checksum_buf(in.rdbuf());
+      std::istream sum_in(&checksum_buf);
+      ValueT value;
+      uint64_t records = 0;
+      for (;;) {
+        uint64_t lsn = 0;
+        char op = 0;
+        uint64_t checksum = 0;
+        if (!ReadU64(sum_in, &lsn) || !sum_in.get(op) ||
+            (op != kJournalInsert && op != kJournalDelete) ||
+            !CodecT::Read(sum_in, &value) || !ReadU64(in, &checksum) ||
+            checksum != checksum_buf.hash()) {
+          break;
+        }
+        ++records;
+        valid_bytes = kLogHeaderBytes + checksum_buf.bytes() + 8 * records;
+        hash_ = checksum;
+        if (lsn <= checkpoint_lsn) {
+          continue;
+        }
+        lsn_ = lsn;
+        ++stats_.replayed;
+        if (op == kJournalInsert) {
+          tree_.Insert(value);
+        } else {
+          tree_.Delete(value);
+        }
+      }
+    }
+    log_bytes_ = valid_bytes;
+    if (valid_bytes < static_cast<uint64_t>(st.st_size) &&
+        (ftruncate(log_fd_, valid_bytes) != 0 || ::fsync(log_fd_) != 0)) {
+      return false;
+    }
+    return true;
+  }
+
+  void Append(JournalOp op, const ValueT& value) {
+    if (pending_records_ == 0 && options_.commit_interval_us > 0) {
+      first_pending_ = std::chrono::steady_clock::now();
+    }
+    const size_t start = pending_.size();
+    WriteU64(pending_out_, ++lsn_);
+    pending_out_.put(op);
+    CodecT::Write(pending_out_, value);
+    hash_ = Fnv1a(hash_, pending_.data() + start, pending_.size() - start);
+    WriteU64(pending_out_, hash_);
+    ++pending_records_;
+    ++stats_.records;
+  }
+
+  bool MaybeCommit() {
+    if (options_.commit_records > 0 &&
+        pending_records_ >= options_.commit_records) {
+      return Commit();
+    }
+    if (options_.commit_interval_us > 0 &&
+        std::chrono::steady_clock::now() - first_pending_ >=
+            std::chrono::microseconds(options_.commit_interval_us)) {
+      return Commit();
+    }
+    return true;
+  }
+
+  TreeT tree_;
+  std::string pending_;  // encoded records not written yet
+  StringAppendBuf pending_buf_;
+  std::ostream pending_out_;
+  int log_fd_;
+  uint64_t lsn_;
+  uint64_t log_bytes_;  // written and fsynced
+  uint64_t hash_;       // chained checksum of the last record
+  size_t pending_records_;
+  std::chrono::steady_clock::time_point first_pending_;
+  std::string checkpoint_path_;
+  JournalOptions options_;
+  JournalStats stats_;
+};
+
+}  // trilib
+
+#endif  // JOURNALED_RBTREE_H_
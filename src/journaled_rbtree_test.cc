@@ -0,0 +1,309 @@
+#include "journaled_rbtree.h"
+
+#include "gtest/gtest.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+using JournaledTree = trilib::JournaledRBTree<int64_t, less<int64_t>>;
+
+class JournaledRBTreeFixture : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    char dir[] = "/tmp/journaled_rbtree_test.XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != nullptr);
+    dir_ = dir;
+    checkpoint_ = dir_ + "/tree.ckpt";
+    log_ = dir_ + "/tree.log";
+  }
+
+  virtual void TearDown() {
+    unlink(checkpoint_.c_str());
+    unlink((checkpoint_ + ".tmp").c_str());
+    unlink(log_.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  string ReadFile(const string& path) {
+    ifstream in(path, ios::binary);
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  }
+
+  void WriteFile(const string& path, const string& content) {
+    ofstream out(path, ios::binary | ios::trunc);
+    out << content;
+  }
+
+  template <typename TreeT, typename ValueT>
+  void ExpectContent(const TreeT& tree, const multiset<ValueT>& expected) {
+    ASSERT_EQ(expected.size(), tree.size());
+    EXPECT_TRUE(equal(expected.begin(), expected.end(), tree.begin()));
+    EXPECT_TRUE(tree.IsBinarySearchTree());
+    EXPECT_TRUE(tree.IsBalanced());
+  }
+
+  string dir_;
+  string checkpoint_;
+  string log_;
+};
+
+TEST_F(JournaledRBTreeFixture, ReplaysLog) {
+  trilib::JournalOptions options;
+  options.commit_records = 16;
+  multiset<int64_t> expected;
+  {
+    JournaledTree tree;
+    EXPECT_FALSE(tree.Insert(1));
+    ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+    uint64_t changes = 0;
+    int64_t val = 0;
+    for (int i = 0; i < 1000; ++i) {
+      val = (val + 5678) % 1009;
+      ASSERT_TRUE(tree.Insert(val));
+      expected.insert(val);
+      ++changes;
+      if (i % 3 == 0) {
+        const bool present = expected.count(val / 2) > 0;
+        ASSERT_EQ(present, tree.Delete(val / 2));
+        if (present) {
+          expected.erase(expected.find(val / 2));
+          ++changes;
+        }
+      }
+    }
+    EXPECT_FALSE(tree.Delete(2000));
+    EXPECT_EQ(changes, tree.stats().records);
+    EXPECT_GE(tree.stats().commits, 1000u / 16);
+  }
+  JournaledTree tree;
+  ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+  ExpectContent(tree.tree(), expected);
+  EXPECT_EQ(tree.lsn(), tree.stats().replayed);
+}
+
+TEST_F(JournaledRBTreeFixture, CutsTornTail) {
+  trilib::JournalOptions options;
+  options.commit_records = 0;
+  multiset<int64_t> expected;
+  string committed;
+  {
+    JournaledTree tree;
+    ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+    for (int64_t val = 0; val < 100; ++val) {
+      ASSERT_TRUE(tree.Insert(val));
+      expected.insert(val);
+    }
+    ASSERT_TRUE(tree.Commit());
+    committed = ReadFile(log_);
+    for (int64_t val = 100; val < 200; ++val) {
+      ASSERT_TRUE(tree.Insert(val));
+    }
+    ASSERT_TRUE(tree.Commit());
+    // Crash in the middle of writing the second group.
+    const string log = ReadFile(log_);
+    WriteFile(log_, log.substr(0, committed.size() + 21));
+  }
+  JournaledTree tree;
+  ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+  ExpectContent(tree.tree(), expected);
+  EXPECT_EQ(committed, ReadFile(log_));
+
+  // Appending continues the checksum chain.
+  ASSERT_TRUE(tree.Insert(500));
+  expected.insert(500);
+  tree.Close();
+  ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+  ExpectContent(tree.tree(), expected);
+
+  // A corrupted record ends the log as well.
+  string log = ReadFile(log_);
+  log[log.size() - 10] ^= 1;
+  WriteFile(log_, log);
+  ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+  expected.erase(500);
+  ExpectContent(tree.tree(), expected);
+}
+
+// Fails the next failing_syncs syncs of the log.
+int failing_syncs = 0;
+
+int FlakySync(int fd) {
+  if (failing_syncs > 0) {
+    --failing_syncs;
+    errno = EIO;
+    return -1;
+  }
+  return fdatasync(fd);
+}
+
+TEST_F(JournaledRBTreeFixture, RetriesFailedSync) {
+  trilib::JournalOptions options;
+  options.commit_records = 0;
+  options.sync_log = FlakySync;
+  multiset<int64_t> expected;
+  {
+    JournaledTree tree;
+    ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+    for (int64_t val = 0; val < 100; ++val) {
+      ASSERT_TRUE(tree.Insert(val));
+      expected.insert(val);
+    }
+    ASSERT_TRUE(tree.Commit());
+    const string committed = ReadFile(log_);
+    for (int64_t val = 100; val < 200; ++val) {
+      ASSERT_TRUE(tree.Insert(val));
+      expected.insert(val);
+    }
+    // Written, but not known to be durable, so it's cut off and retried.
+    failing_syncs = 1;
+    EXPECT_FALSE(tree.Commit());
+    EXPECT_EQ(committed, ReadFile(log_));
+    EXPECT_TRUE(tree.IsOpen());
+    ASSERT_TRUE(tree.Commit());
+    ASSERT_TRUE(tree.Insert(500));
+    expected.insert(500);
+  }
+  JournaledTree tree;
+  ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+  ExpectContent(tree.tree(), expected);
+  EXPECT_EQ(201u, tree.lsn());
+  EXPECT_EQ(201u, tree.stats().replayed);
+}
+
+TEST_F(JournaledRBTreeFixture, Checkpoints) {
+  trilib::JournalOptions options;
+  options.commit_records = 64;
+  options.checkpoint_bytes = 4096;
+  multiset<int64_t> expected;
+  string before_checkpoint;
+  {
+    JournaledTree tree;
+    ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+    for (int64_t val = 0; val < 10000; ++val) {
+      ASSERT_TRUE(tree.Insert(val * 7919 % 10007));
+      expected.insert(val * 7919 % 10007);
+    }
+    EXPECT_GT(tree.stats().checkpoints, 10u);
+    EXPECT_LT(ReadFile(log_).size(), 4096u + 64 * 25);
+
+    // Crash after the checkpoint was renamed but before the log was cut,
+    // records covered by the checkpoint must not be applied twice.
+    ASSERT_TRUE(tree.Commit());
+    before_checkpoint = ReadFile(log_);
+    ASSERT_TRUE(tree.Checkpoint());
+    EXPECT_EQ(8u, ReadFile(log_).size());
+  }
+  WriteFile(log_, before_checkpoint);
+  JournaledTree tree;
+  ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+  ExpectContent(tree.tree(), expected);
+  EXPECT_EQ(0u, tree.stats().replayed);
+  EXPECT_EQ(10000u, tree.lsn());
+
+  // New records follow the stale ones and are replayed.
+  ASSERT_TRUE(tree.Delete(0));
+  expected.erase(0);
+  tree.Close();
+  ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+  ExpectContent(tree.tree(), expected);
+  EXPECT_EQ(1u, tree.stats().replayed);
+
+  // A damaged checkpoint isn't silently ignored.
+  string checkpoint = ReadFile(checkpoint_);
+  checkpoint[checkpoint.size() / 2] ^= 1;
+  WriteFile(checkpoint_, checkpoint);
+  EXPECT_FALSE(tree.Recover(checkpoint_, log_, options));
+  EXPECT_FALSE(tree.IsOpen());
+}
+
+TEST_F(JournaledRBTreeFixture, FailedCheckpointSyncCloses) {
+  trilib::JournalOptions options;
+  options.commit_records = 0;
+  options.sync_log = FlakySync;
+  multiset<int64_t> expected;
+  {
+    JournaledTree tree;
+    ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+    for (int64_t val = 0; val < 100; ++val) {
+      ASSERT_TRUE(tree.Insert(val));
+      expected.insert(val);
+    }
+    ASSERT_TRUE(tree.Commit());
+    // The log was cut, but that isn't known to be durable.
+    failing_syncs = 1;
+    EXPECT_FALSE(tree.Checkpoint());
+    EXPECT_FALSE(tree.IsOpen());
+    EXPECT_FALSE(tree.Insert(100));
+    EXPECT_EQ(8u, ReadFile(log_).size());
+  }
+  JournaledTree tree;
+  ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+  ExpectContent(tree.tree(), expected);
+  EXPECT_EQ(100u, tree.lsn());
+}
+
+TEST_F(JournaledRBTreeFixture, FailedAutomaticCheckpointKeepsCommit) {
+  trilib::JournalOptions options;
+  options.commit_records = 1;
+  options.checkpoint_bytes = 256;
+  // The temporary checkpoint file can't be created.
+  const string tmp = checkpoint_ + ".tmp";
+  ASSERT_EQ(0, mkdir(tmp.c_str(), 0755));
+  multiset<int64_t> expected;
+  {
+    JournaledTree tree;
+    ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+    // Committed records aren't reported as failed, so they aren't retried.
+    for (int64_t val = 0; val < 100; ++val) {
+      ASSERT_TRUE(tree.Insert(val));
+      expected.insert(val);
+    }
+    EXPECT_TRUE(tree.IsOpen());
+    EXPECT_EQ(0u, tree.stats().checkpoints);
+    EXPECT_GT(tree.stats().failed_checkpoints, 0u);
+  }
+  ASSERT_EQ(0, rmdir(tmp.c_str()));
+  JournaledTree tree;
+  ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+  ExpectContent(tree.tree(), expected);
+  EXPECT_EQ(100u, tree.stats().replayed);
+}
+
+TEST_F(JournaledRBTreeFixture, Strings) {
+  using StringTree =
+      trilib::JournaledRBTree<string, less<string>, trilib::StringCodec>;
+  trilib::JournalOptions options;
+  options.commit_records = 1;
+  multiset<string> expected;
+  {
+    StringTree tree;
+    ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+    for (int i = 0; i < 300; ++i) {
+      ostringstream word;
+      word << "key" << i * 37 % 101 << string(i % 13, 'x');
+      ASSERT_TRUE(tree.Insert(word.str()));
+      expected.insert(word.str());
+      if (i == 150) {
+        ASSERT_TRUE(tree.Checkpoint());
+      }
+    }
+    EXPECT_EQ(300u, tree.stats().commits);
+  }
+  StringTree tree;
+  ASSERT_TRUE(tree.Recover(checkpoint_, log_, options));
+  ExpectContent(tree.tree(), expected);
+  EXPECT_EQ(149u, tree.stats().replayed);
+}
@@ -0,0 +1,202 @@
+#ifndef MMAP_RBTREE_H_
+#define MMAP_RBTREE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+#include "offset_rbtree.h"
+
+namespace trilib {
+
+// Storage of OffsetRBTree nodes in a memory-mapped file. The file starts with
+// OffsetRBTreeHeader followed by nodes, it grows by doubling. Opening an
+// existing file only maps it, pages are loaded by the kernel on first touch.
+template <typename ValueT>
+class MmapStorage {
+ public:
+  using NodeT = OffsetRBTreeNode<ValueT>;
+
+  static constexpr uint64_t kMagic = 0x45455254424d5254ULL;  // "TRMBTREE"
+  static constexpr uint32_t kVersion = 1;
+  static constexpr uint64_t kHeaderSize = 64;
+  static_assert(sizeof(OffsetRBTreeHeader) <= kHeaderSize,
+                "header doesn't fit");
+
+  MmapStorage() : fd_(-1), base_(nullptr), capacity_(0) {}
+  ~MmapStorage() { Close(); }
+
+  MmapStorage(const MmapStorage&) = delete;
+  MmapStorage& operator=(const MmapStorage&) = delete;
+
+  // Opens or creates a file. Returns false if it can't be mapped or contains
+  // something else than a tree of the same node type.
+  bool Open(const std::string& path, uint64_t initial_capacity) {
+    Close();
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0) {
+      return false;
+    }
+    struct stat st;
+    if (::fstat(fd_, &st) != 0) {
+      Close();
+      return false;
+    }
+    const bool is_new = st.st_size == 0;
+    uint64_t capacity = st.st_size;
+    if (is_new) {
+      capacity = std::max<uint64_t>(initial_capacity,
+                                    kHeaderSize + sizeof(NodeT));
+      if (::ftruncate(fd_, capacity) != 0) {
+        Close();
+        return false;
+      }
+    }
+    if (!Map(capacity)) {
+      Close();
+      return false;
+    }
+    OffsetRBTreeHeader* header = WriteHeader();
+    if (is_new) {
+      header->magic = kMagic;
+      header->version = kVersion;
+      header->node_size = sizeof(NodeT);
+      header->root = 0;
+      header->size = 0;
+      header->free_list = 0;
+      header->end = kHeaderSize;
+      header->value_size = sizeof(ValueT);
+      header->page_size = 0;
+    } else if (capacity < kHeaderSize || header->magic != kMagic ||
+               header->version != kVersion ||
+               header->node_size != sizeof(NodeT) ||
+               header->value_size != sizeof(ValueT) || header->end > capacity) {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  bool IsOpen() const { return base_ != nullptr; }
+
+  // Flushes all changes to the file.
+  bool Sync() {
+    return base_ != nullptr && ::msync(base_, capacity_, MS_SYNC) == 0;
+  }
+
+  void Close() {
+    if (base_ != nullptr) {
+      ::munmap(base_, capacity_);
+      base_ = nullptr;
+      capacity_ = 0;
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  uint64_t capacity() const { return capacity_; }
+
+  const NodeT* Read(NodeOffset off) const {
+    return reinterpret_cast<const NodeT*>(base_ + off);
+  }
+
+  NodeT* Write(NodeOffset off) {
+    return reinterpret_cast<NodeT*>(base_ + off);
+  }
+
+  const OffsetRBTreeHeader* ReadHeader() const {
+    return reinterpret_cast<const OffsetRBTreeHeader*>(base_);
+  }
+
+  OffsetRBTreeHeader* WriteHeader() {
+    return reinterpret_cast<OffsetRBTreeHeader*>(base_);
+  }
+
+  NodeOffset Allocate() {
+    OffsetRBTreeHeader* header = WriteHeader();
+    if (header->free_list != 0) {
+      const NodeOffset node = header->free_list;
+      header->free_list = Read(node)->left_child;
+      return node;
+    }
+    if (header->end + sizeof(NodeT) > capacity_ && !Grow()) {
+      return 0;
+    }
+    header = WriteHeader();
+    const NodeOffset node = header->end;
+    header->end += sizeof(NodeT);
+    return node;
+  }
+
+  void Free(NodeOffset off) {
+    OffsetRBTreeHeader* header = WriteHeader();
+    Write(off)->left_child = header->free_list;
+    header->free_list = off;
+  }
+
+ private:
+  bool Map(uint64_t capacity) {
+    void* addr =
+        ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) {
+      return false;
+    }
+    base_ = static_cast<char*>(addr);
+    capacity_ = capacity;
+    return true;
+  }
+
+  // Doubles the file and maps it anew. The old mapping is dropped only after
+  // the new one succeeds, on failure the storage stays as it was.
+  bool Grow() {
+    const uint64_t capacity = capacity_ * 2;
+    if (::ftruncate(fd_, capacity) != 0) {
+      return false;
+    }
+    char* const old_base = base_;
+    const uint64_t old_capacity = capacity_;
+    if (!Map(capacity)) {
+      ::ftruncate(fd_, old_capacity);
+      return false;
+    }
+    ::munmap(old_base, old_capacity);
+    return true;
+  }
+
+  int fd_;
+  char* base_;
+  uint64_t capacity_;
+};
+
+// Red-black tree living in a memory-mapped file. Nodes are linked with
+// offsets, so after a restart the file is just mapped again and queries can
+// start immediately, touching only pages on their path.
+//
+//   trilib::MmapRBTree<int64_t, std::less<int64_t>> tree;
+//   if (!tree.Open("/var/lib/index.tree")) { ... }
+//   tree.Insert(42);
+//   tree.Sync();
+template <typename ValueT, typename CompT>
+class MmapRBTree : public OffsetRBTree<ValueT, CompT, MmapStorage<ValueT>> {
+ public:
+  bool Open(const std::string& path, uint64_t initial_capacity = 1 << 20) {
+    return this->storage_.Open(path, initial_capacity);
+  }
+
+  bool IsOpen() const { return this->storage_.IsOpen(); }
+
+  bool Sync() { return this->storage_.Sync(); }
+
+  void Close() { this->storage_.Close(); }
+};
+
+}  // trilib
+
+#endif  // MMAP_RBTREE_H_
@@ -0,0 +1,155 @@
+#include "mmap_rbtree.h"
+
+#include "gtest/gtest.h"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <string>
+
+using namespace std;
+
+using MmapTree = trilib::MmapRBTree<int64_t, less<int64_t>>;
+
+class MmapRBTreeFixture : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    char path[] = "/tmp/mmap_rbtree_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    unlink(path);
+    path_ = path;
+  }
+
+  virtual void TearDown() { unlink(path_.c_str()); }
+
+  string path_;
+};
+
+TEST_F(MmapRBTreeFixture, InsertSearchDelete) {
+  MmapTree tree;
+  ASSERT_TRUE(tree.Open(path_, 4096));
+  constexpr int64_t my_prime = 30011;
+  constexpr int64_t iter_val = 5678;
+  int64_t val = 0;
+  for (int i = 0; i < 10000; ++i) {
+    val = (val + iter_val) % my_prime;
+    ASSERT_TRUE(tree.Insert(val));
+  }
+  ASSERT_EQ(10000u, tree.size());
+  ASSERT_TRUE(tree.IsBinarySearchTree());
+  ASSERT_TRUE(tree.IsBlackProperty());
+  ASSERT_TRUE(tree.IsRedHasTwoBlacks());
+
+  val = 0;
+  for (int i = 0; i < 5000; ++i) {
+    val = (val + iter_val) % my_prime;
+    ASSERT_TRUE(tree.HasValue(val));
+    tree.Delete(val);
+    ASSERT_FALSE(tree.HasValue(val));
+  }
+  ASSERT_EQ(5000u, tree.size());
+  ASSERT_TRUE(tree.IsBinarySearchTree());
+  ASSERT_TRUE(tree.IsBlackProperty());
+  ASSERT_TRUE(tree.IsRedHasTwoBlacks());
+}
+
+TEST_F(MmapRBTreeFixture, Iteration) {
+  MmapTree tree;
+  ASSERT_TRUE(tree.Open(path_));
+  for (int64_t i : {8, 4, 12, 2, 6, 10, 14}) {
+    tree.Insert(i);
+  }
+  int64_t expected = 2;
+  for (int64_t x : tree) {
+    ASSERT_EQ(expected, x);
+    expected += 2;
+  }
+  ASSERT_EQ(16, expected);
+  EXPECT_EQ(10, *tree.LowerBound(8));
+  EXPECT_EQ(6, *tree.UpperBound(8));
+  EXPECT_EQ(tree.end(), tree.LowerBound(14));
+  EXPECT_EQ(14, *--tree.end());
+}
+
+TEST_F(MmapRBTreeFixture, Reopen) {
+  {
+    MmapTree tree;
+    ASSERT_TRUE(tree.Open(path_, 4096));
+    for (int64_t i = 0; i < 20000; ++i) {
+      tree.Insert(i * 2);
+    }
+    tree.Delete(int64_t(10));
+    ASSERT_TRUE(tree.Sync());
+  }
+  MmapTree tree;
+  ASSERT_TRUE(tree.Open(path_));
+  ASSERT_EQ(19999u, tree.size());
+  EXPECT_TRUE(tree.HasValue(0));
+  EXPECT_FALSE(tree.HasValue(10));
+  EXPECT_TRUE(tree.HasValue(39998));
+  ASSERT_TRUE(tree.IsBinarySearchTree());
+  ASSERT_TRUE(tree.IsBlackProperty());
+
+  // Freed node is reused.
+  const uint64_t capacity = tree.storage().capacity();
+  tree.Insert(11);
+  EXPECT_EQ(capacity, tree.storage().capacity());
+  EXPECT_TRUE(tree.HasValue(11));
+}
+
+TEST_F(MmapRBTreeFixture, RejectsOtherFiles) {
+  {
+    trilib::MmapRBTree<int32_t, less<int32_t>> tree;
+    ASSERT_TRUE(tree.Open(path_));
+    tree.Insert(1);
+  }
+  MmapTree tree;
+  EXPECT_FALSE(tree.Open(path_));
+  EXPECT_FALSE(tree.IsOpen());
+}
+
+// Size of the address space of the process in bytes.
+uint64_t VmSize() {
+  ifstream status("/proc/self/status");
+  string line;
+  while (getline(status, line)) {
+    if (line.compare(0, 7, "VmSize:") == 0) {
+      return strtoull(line.c_str() + 7, nullptr, 10) * 1024;
+    }
+  }
+  return 0;
+}
+
+TEST_F(MmapRBTreeFixture, FailedGrowKeepsTree) {
+  MmapTree tree;
+  ASSERT_TRUE(tree.Open(path_, 1 << 20));
+  const uint64_t capacity = tree.storage().capacity();
+  // Leave room for less than the doubled mapping, so it can't be mapped.
+  struct rlimit old_limit;
+  ASSERT_EQ(0, getrlimit(RLIMIT_AS, &old_limit));
+  const uint64_t vm_size = VmSize();
+  ASSERT_GT(vm_size, 0u);
+  struct rlimit limit = old_limit;
+  limit.rlim_cur = vm_size + capacity / 2;
+  ASSERT_EQ(0, setrlimit(RLIMIT_AS, &limit));
+  int64_t inserted = 0;
+  while (tree.Insert(inserted)) {
+    ++inserted;
+  }
+  ASSERT_EQ(0, setrlimit(RLIMIT_AS, &old_limit));
+  EXPECT_EQ(capacity, tree.storage().capacity());
+  EXPECT_EQ(uint64_t(inserted), tree.size());
+  for (int64_t i = 0; i < inserted; ++i) {
+    ASSERT_TRUE(tree.HasValue(i));
+  }
+  ASSERT_TRUE(tree.Insert(inserted));
+  EXPECT_EQ(2 * capacity, tree.storage().capacity());
+  ASSERT_TRUE(tree.IsBinarySearchTree());
+  ASSERT_TRUE(tree.IsBlackProperty());
+}
@@ -0,0 +1,499 @@
+#ifndef OFFSET_RBTREE_H_
+#define OFFSET_RBTREE_H_
+
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+
+namespace trilib {
+
+// Offset of a node inside a storage. Offset 0 is taken by the storage header
+// so it is used as a null link.
+using NodeOffset = uint64_t;
+
+// Node of a tree which is linked by offsets instead of pointers, so it can
+// live in a file and be mapped at any address.
+template <typename ValueT>
+struct OffsetRBTreeNode {
+  ValueT value_;
+  NodeOffset parent;
+  NodeOffset left_child;
+  NodeOffset right_child;
+  uint32_t properties;  // bit 0: is black
+};
+
+// Persistent part of the tree state, kept by a storage at offset 0.
+struct OffsetRBTreeHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t node_size;
+  NodeOffset root;
+  uint64_t size;
+  NodeOffset free_list;  // nodes linked through left_child
+  uint64_t end;          // first never allocated byte
+  uint32_t value_size;
+  uint32_t page_size;  // 0 if storage isn't paged
+};
+
+// Red-black tree which addresses nodes with offsets into a storage. It has
+// the same interface and semantics as RBTree, but as nodes can be moved by
+// the storage (remapped or evicted) iterators return values by copy.
+//
+// StorageT must provide:
+//   const NodeT* Read(NodeOffset off);   // node for reading
+//   NodeT* Write(NodeOffset off);        // node for writing
+//   const OffsetRBTreeHeader* ReadHeader();
+//   OffsetRBTreeHeader* WriteHeader();
+//   NodeOffset Allocate();               // 0 if out of space
+//   void Free(NodeOffset off);
+// A pointer returned by a storage may be invalidated by the next call to it,
+// so the tree never keeps them.
+template <typename ValueT, typename CompT, typename StorageT>
+class OffsetRBTree {
+ public:
+  static_assert(std::is_trivially_copyable<ValueT>::value,
+                "OffsetRBTree stores raw values, ValueT must be trivially "
+                "copyable");
+
+  using NodeT = OffsetRBTreeNode<ValueT>;
+  using value_type = ValueT;
+
+  OffsetRBTree() : value_cmp_() {}
+
+  StorageT& storage() { return storage_; }
+  const StorageT& storage() const { return storage_; }
+
+  class const_iterator
+      : public std::iterator<std::bidirectional_iterator_tag, ValueT> {
+   public:
+    const_iterator() : tree_(nullptr), node_(0) {}
+    const_iterator(const OffsetRBTree* tree, NodeOffset node)
+        : tree_(tree), node_(node) {}
+
+    bool operator==(const const_iterator& other) const {
+      return node_ == other.node_;
+    }
+
+    bool operator!=(const const_iterator& other) const {
+      return !(*this == other);
+    }
+
+    ValueT operator*() const { return tree_->Value(node_); }
+
+    const_iterator& operator++() {
+      node_ = tree_->Successor(node_);
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      const const_iterator old(*this);
+      ++(*this);
+      return old;
+    }
+
+    const_iterator& operator--() {
+      node_ = node_ == 0 ? tree_->Maximum(tree_->Root())
+                         : tree_->Predecessor(node_);
+      return *this;
+    }
+
+    const_iterator operator--(int) {
+      const const_iterator old(*this);
+      --(*this);
+      return old;
+    }
+
+    NodeOffset offset() const { return node_; }
+
+    friend class OffsetRBTree;
+
+   private:
+    const OffsetRBTree* tree_;
+    NodeOffset node_;
+  };
+
+  // Nodes can't be modified in place, so both are the same.
+  using iterator = const_iterator;
+
+  const_iterator begin() const { return const_iterator(this, Minimum(Root())); }
+  const_iterator end() const { return const_iterator(this, 0); }
+
+  size_t size() const { return storage_.ReadHeader()->size; }
+
+  bool empty() const { return size() == 0; }
+
+  // Returns false if the storage is out of space.
+  bool Insert(const ValueT& value) {
+    NodeOffset node = storage_.Allocate();
+    if (node == 0) {
+      return false;
+    }
+    NodeOffset parent = 0;
+    bool is_left = false;
+    for (NodeOffset x = Root(); x != 0;) {
+      parent = x;
+      is_left = value_cmp_(value, storage_.Read(x)->value_);
+      x = is_left ? Left(x) : Right(x);
+    }
+    NodeT* ptr = storage_.Write(node);
+    ptr->value_ = value;
+    ptr->parent = parent;
+    ptr->left_child = 0;
+    ptr->right_child = 0;
+    ptr->properties = 0;
+    if (parent == 0) {
+      SetRoot(node);
+    } else if (is_left) {
+      storage_.Write(parent)->left_child = node;
+    } else {
+      storage_.Write(parent)->right_child = node;
+    }
+    ++storage_.WriteHeader()->size;
+    InsertFixup(node);
+    return true;
+  }
+
+  void Delete(const ValueT& value) { Delete(Search(value)); }
+
+  void Delete(const_iterator iter) {
+    if (iter.node_ != 0) {
+      Erase(iter.node_);
+    }
+  }
+
+  // See RBTree::LowerBound.
+  const_iterator LowerBound(const ValueT& val) const {
+    NodeOffset y = 0;
+    for (NodeOffset x = Root(); x != 0;) {
+      if (value_cmp_(val, storage_.Read(x)->value_)) {
+        y = x;
+        x = Left(x);
+      } else {
+        x = Right(x);
+      }
+    }
+    return const_iterator(this, y);
+  }
+
+  // See RBTree::UpperBound.
+  const_iterator UpperBound(const ValueT& val) const {
+    NodeOffset y = 0;
+    for (NodeOffset x = Root(); x != 0;) {
+      if (value_cmp_(storage_.Read(x)->value_, val)) {
+        y = x;
+        x = Right(x);
+      } else {
+        x = Left(x);
+      }
+    }
+    return const_iterator(this, y);
+  }
+
+  const_iterator Search(const ValueT& value) const {
+    NodeOffset x = Root();
+    while (x != 0) {
+      const NodeT* ptr = storage_.Read(x);
+      if (value == ptr->value_) {
+        break;
+      }
+      x = value_cmp_(value, ptr->value_) ? ptr->left_child : ptr->right_child;
+    }
+    return const_iterator(this, x);
+  }
+
+  bool HasValue(const ValueT& value) const { return Search(value) != end(); }
+
+  bool IsBinarySearchTree() const {
+    return Root() == 0 || CheckIsBinarySearchTree(Root(), 0, 0);
+  }
+
+  bool IsBlackProperty() const {
+    return Root() == 0 || (!IsRed(Root()) && BlackToLeaves(Root()) >= 0);
+  }
+
+  bool IsRedHasTwoBlacks() const { return CheckRedHasTwoBlacks(Root()); }
+
+ protected:
+  mutable StorageT storage_;
+
+ private:
+  NodeOffset Root() const { return storage_.ReadHeader()->root; }
+  void SetRoot(NodeOffset x) { storage_.WriteHeader()->root = x; }
+
+  ValueT Value(NodeOffset x) const { return storage_.Read(x)->value_; }
+  NodeOffset Parent(NodeOffset x) const { return storage_.Read(x)->parent; }
+  NodeOffset Left(NodeOffset x) const { return storage_.Read(x)->left_child; }
+  NodeOffset Right(NodeOffset x) const {
+    return storage_.Read(x)->right_child;
+  }
+
+  void SetParent(NodeOffset x, NodeOffset p) {
+    if (x != 0) {
+      storage_.Write(x)->parent = p;
+    }
+  }
+  void SetLeft(NodeOffset x, NodeOffset c) {
+    storage_.Write(x)->left_child = c;
+  }
+  void SetRight(NodeOffset x, NodeOffset c) {
+    storage_.Write(x)->right_child = c;
+  }
+
+  bool IsRed(NodeOffset x) const {
+    return x != 0 && (storage_.Read(x)->properties & 1) == 0;
+  }
+  void SetColor(NodeOffset x, bool is_black) {
+    storage_.Write(x)->properties = is_black ? 1 : 0;
+  }
+
+  NodeOffset Minimum(NodeOffset x) const {
+    if (x == 0) {
+      return 0;
+    }
+    for (NodeOffset l = Left(x); l != 0; l = Left(x)) {
+      x = l;
+    }
+    return x;
+  }
+
+  NodeOffset Maximum(NodeOffset x) const {
+    if (x == 0) {
+      return 0;
+    }
+    for (NodeOffset r = Right(x); r != 0; r = Right(x)) {
+      x = r;
+    }
+    return x;
+  }
+
+  NodeOffset Successor(NodeOffset x) const {
+    if (Right(x) != 0) {
+      return Minimum(Right(x));
+    }
+    NodeOffset y = Parent(x);
+    while (y != 0 && x == Right(y)) {
+      x = y;
+      y = Parent(y);
+    }
+    return y;
+  }
+
+  NodeOffset Predecessor(NodeOffset x) const {
+    if (Left(x) != 0) {
+      return Maximum(Left(x));
+    }
+    NodeOffset y = Parent(x);
+    while (y != 0 && x == Left(y)) {
+      x = y;
+      y = Parent(y);
+    }
+    return y;
+  }
+
+  // Replaces subtree rooted at u with subtree rooted at v (can be null).
+  void Transplant(NodeOffset u, NodeOffset v) {
+    const NodeOffset parent = Parent(u);
+    if (parent == 0) {
+      SetRoot(v);
+    } else if (Left(parent) == u) {
+      SetLeft(parent, v);
+    } else {
+      SetRight(parent, v);
+    }
+    SetParent(v, parent);
+  }
+
+  void LeftRotate(NodeOffset x) {
+    const NodeOffset y = Right(x);
+    SetRight(x, Left(y));
+    SetParent(Left(y), x);
+    Transplant(x, y);
+    SetLeft(y, x);
+    SetParent(x, y);
+  }
+
+  void RightRotate(NodeOffset x) {
+    const NodeOffset y = Left(x);
+    SetLeft(x, Right(y));
+    SetParent(Right(y), x);
+    Transplant(x, y);
+    SetRight(y, x);
+    SetParent(x, y);
+  }
+
+  void InsertFixup(NodeOffset z) {
+    while (IsRed(Parent(z))) {
+      NodeOffset p = Parent(z);
+      const NodeOffset g = Parent(p);
+      if (p == Left(g)) {
+        const NodeOffset uncle = Right(g);
+        if (IsRed(uncle)) {
+          SetColor(p, true);
+          SetColor(uncle, true);
+          SetColor(g, false);
+          z = g;
+          continue;
+        }
+        if (z == Right(p)) {
+          z = p;
+          LeftRotate(z);
+          p = Parent(z);
+        }
+        SetColor(p, true);
+        SetColor(g, false);
+        RightRotate(g);
+      } else {
+        const NodeOffset uncle = Left(g);
+        if (IsRed(uncle)) {
+          SetColor(p, true);
+          SetColor(uncle, true);
+          SetColor(g, false);
+          z = g;
+          continue;
+        }
+        if (z == Left(p)) {
+          z = p;
+          RightRotate(z);
+          p = Parent(z);
+        }
+        SetColor(p, true);
+        SetColor(g, false);
+        LeftRotate(g);
+      }
+    }
+    SetColor(Root(), true);
+  }
+
+  void Erase(NodeOffset z) {
+    NodeOffset y = z;
+    bool y_was_black = !IsRed(y);
+    NodeOffset x = 0;
+    NodeOffset x_parent = 0;
+    if (Left(z) == 0) {
+      x = Right(z);
+      x_parent = Parent(z);
+      Transplant(z, x);
+    } else if (Right(z) == 0) {
+      x = Left(z);
+      x_parent = Parent(z);
+      Transplant(z, x);
+    } else {
+      y = Minimum(Right(z));
+      y_was_black = !IsRed(y);
+      x = Right(y);
+      if (Parent(y) == z) {
+        x_parent = y;
+      } else {
+        x_parent = Parent(y);
+        Transplant(y, x);
+        SetRight(y, Right(z));
+        SetParent(Right(y), y);
+      }
+      Transplant(z, y);
+      SetLeft(y, Left(z));
+      SetParent(Left(y), y);
+      SetColor(y, !IsRed(z));
+    }
+    storage_.Free(z);
+    --storage_.WriteHeader()->size;
+    if (y_was_black) {
+      EraseFixup(x, x_parent);
+    }
+  }
+
+  void EraseFixup(NodeOffset x, NodeOffset x_parent) {
+    while (x != Root() && !IsRed(x)) {
+      if (x == Left(x_parent)) {
+        NodeOffset w = Right(x_parent);
+        if (IsRed(w)) {
+          SetColor(w, true);
+          SetColor(x_parent, false);
+          LeftRotate(x_parent);
+          w = Right(x_parent);
+        }
+        if (!IsRed(Left(w)) && !IsRed(Right(w))) {
+          SetColor(w, false);
+          x = x_parent;
+          x_parent = Parent(x);
+          continue;
+        }
+        if (!IsRed(Right(w))) {
+          SetColor(Left(w), true);
+          SetColor(w, false);
+          RightRotate(w);
+          w = Right(x_parent);
+        }
+        SetColor(w, !IsRed(x_parent));
+        SetColor(x_parent, true);
+        SetColor(Right(w), true);
+        LeftRotate(x_parent);
+      } else {
+        NodeOffset w = Left(x_parent);
+        if (IsRed(w)) {
+          SetColor(w, true);
+          SetColor(x_parent, false);
+          RightRotate(x_parent);
+          w = Left(x_parent);
+        }
+        if (!IsRed(Left(w)) && !IsRed(Right(w))) {
+          SetColor(w, false);
+          x = x_parent;
+          x_parent = Parent(x);
+          continue;
+        }
+        if (!IsRed(Left(w))) {
+          SetColor(Right(w), true);
+          SetColor(w, false);
+          LeftRotate(w);
+          w = Left(x_parent);
+        }
+        SetColor(w, !IsRed(x_parent));
+        SetColor(x_parent, true);
+        SetColor(Left(w), true);
+        RightRotate(x_parent);
+      }
+      x = Root();
+    }
+    if (x != 0) {
+      SetColor(x, true);
+    }
+  }
+
+  bool CheckIsBinarySearchTree(NodeOffset x, NodeOffset left_bound,
+                               NodeOffset right_bound) const {
+    if (x == 0) {
+      return true;
+    }
+    const ValueT value = Value(x);
+    return (left_bound == 0 || value_cmp_(Value(left_bound), value)) &&
+           (right_bound == 0 || value_cmp_(value, Value(right_bound))) &&
+           CheckIsBinarySearchTree(Left(x), left_bound, x) &&
+           CheckIsBinarySearchTree(Right(x), x, right_bound);
+  }
+
+  int BlackToLeaves(NodeOffset x) const {
+    if (x == 0) {
+      return 0;
+    }
+    const int left = BlackToLeaves(Left(x));
+    const int right = BlackToLeaves(Right(x));
+    if (left < 0 || left != right) {
+      return -1;
+    }
+    return left + (IsRed(x) ? 0 : 1);
+  }
+
+  bool CheckRedHasTwoBlacks(NodeOffset x) const {
+    if (x == 0) {
+      return true;
+    }
+    return (!IsRed(x) || (!IsRed(Left(x)) && !IsRed(Right(x)))) &&
+           CheckRedHasTwoBlacks(Left(x)) && CheckRedHasTwoBlacks(Right(x));
+  }
+
+  const CompT value_cmp_;
+};
+
+}  // trilib
+
+#endif  // OFFSET_RBTREE_H_
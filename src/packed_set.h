@@ -0,0 +1,358 @@
+#ifndef PACKED_SET_H_
+#define PACKED_SET_H_
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <vector>
+
+namespace trilib {
+
+// Immutable sorted set of 64-bit integers compressed to a few bits per key,
+// an export target for big RBTrees of ids. Keys are split in blocks of
+// kBlockSize, each block keeps differences of consecutive keys bit-packed
+// with the width of its largest one. A separate index holds the minimum of
+// every block, so a query binary searches the index, decodes one block and
+// searches within it. Blocks with differences up to 32 bits are laid out in
+// four interleaved lanes and decoded four keys at a time with SSE2.
+//
+//   trilib::PackedSet<int64_t> ids = trilib::MakePackedSet(tree);
+//   bool known = ids.HasValue(id);
+//
+// Queries have the same meaning as RBTree ones. Iterators hold a decoded
+// block, so they are cheap to advance but not to copy.
+template <typename ValueT = int64_t>
+class PackedSet {
+  static_assert(std::is_integral<ValueT>::value && sizeof(ValueT) == 8,
+                "PackedSet keeps 64-bit integers");
+
+ public:
+  using value_type = ValueT;
+  static constexpr size_t kBlockSize = 128;
+
+  class const_iterator
+      : public std::iterator<std::forward_iterator_tag, ValueT,
+                             std::ptrdiff_t, const ValueT*, const ValueT&> {
+   public:
+    const_iterator() : set_(nullptr), index_(0), block_index_(kNoBlock) {}
+
+    const ValueT& operator*() const { return block_[index_ % kBlockSize]; }
+    const ValueT* operator->() const { return &**this; }
+
+    const_iterator& operator++() {
+      Seek(index_ + 1);
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      const_iterator old = *this;
+      ++*this;
+      return old;
+    }
+
+    bool operator==(const const_iterator& other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const const_iterator& other) const {
+      return index_ != other.index_;
+    }
+
+   private:
+    static constexpr size_t kNoBlock = ~size_t(0);
+
+    explicit const_iterator(const PackedSet* set)
+        : set_(set), index_(0), block_index_(kNoBlock) {}
+
+    // Moves to the key of rank index, decoding its block if needed.
+    void Seek(size_t index) {
+      index_ = index;
+      const size_t block = index / kBlockSize;
+      if (block != block_index_ && index < set_->size_) {
+        set_->DecodeBlock(block, block_);
+        block_index_ = block;
+      }
+    }
+
+    const PackedSet* set_;
+    size_t index_;
+    size_t block_index_;
+    ValueT block_[kBlockSize];
+
+    friend class PackedSet;
+  };
+  using iterator = const_iterator;
+
+  PackedSet() : size_(0) {}
+
+  // Keys must be sorted in ascending order, duplicates are kept.
+  template <typename IterT>
+  PackedSet(IterT first, IterT last) : size_(0) {
+    ValueT keys[kBlockSize];
+    size_t n = 0;
+    for (; first != last; ++first) {
+      keys[n++] = *first;
+      if (n == kBlockSize) {
+        AppendBlock(keys, n);
+        n = 0;
+      }
+    }
+    if (n > 0) {
+      AppendBlock(keys, n);
+    }
+    words_.shrink_to_fit();
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // Memory taken by the keys and the index.
+  size_t bytes() const {
+    return sizeof(*this) + words_.capacity() * sizeof(uint32_t) +
+           mins_.capacity() * sizeof(ValueT) +
+           offsets_.capacity() * sizeof(uint64_t) + bits_.capacity();
+  }
+
+  const_iterator begin() const {
+    const_iterator iter(this);
+    iter.Seek(0);
+    return iter;
+  }
+
+  const_iterator end() const {
+    const_iterator iter(this);
+    iter.index_ = size_;
+    return iter;
+  }
+
+  // Returns iterator to the first element equal to value or end().
+  const_iterator Search(const ValueT& value) const {
+    // The first block whose minimum isn't smaller than value, elements
+    // equal to value start in it or in the block before.
+    size_t block = std::lower_bound(mins_.begin(), mins_.end(), value) -
+                   mins_.begin();
+    const_iterator iter(this);
+    if (block > 0) {
+      --block;
+      iter.Seek(block * kBlockSize);
+      const ValueT* const first = iter.block_;
+      const ValueT* const last = first + BlockCount(block);
+      const ValueT* pos = std::lower_bound(first, last, value);
+      if (pos != last) {
+        iter.Seek(block * kBlockSize + (pos - first));
+        return *pos == value ? iter : end();
+      }
+      ++block;
+    }
+    if (block < mins_.size() && mins_[block] == value) {
+      iter.Seek(block * kBlockSize);
+      return iter;
+    }
+    return end();
+  }
+
+  bool HasValue(const ValueT& value) const { return Search(value) != end(); }
+
+  // Returns iterator to the first element greater than value or end().
+  const_iterator LowerBound(const ValueT& value) const {
+    // The last block whose minimum isn't greater than value, all later
+    // elements are greater.
+    size_t block = std::upper_bound(mins_.begin(), mins_.end(), value) -
+                   mins_.begin();
+    const_iterator iter(this);
+    if (block == 0) {
+      iter.Seek(0);
+      return iter;
+    }
+    --block;
+    iter.Seek(block * kBlockSize);
+    const ValueT* const first = iter.block_;
+    const ValueT* pos =
+        std::upper_bound(first, first + BlockCount(block), value);
+    iter.Seek(block * kBlockSize + (pos - first));
+    return iter;
+  }
+
+  // Returns iterator to the last element smaller than value or end().
+  const_iterator UpperBound(const ValueT& value) const {
+    size_t block = std::lower_bound(mins_.begin(), mins_.end(), value) -
+                   mins_.begin();
+    if (block == 0) {
+      return end();
+    }
+    --block;
+    const_iterator iter(this);
+    iter.Seek(block * kBlockSize);
+    const ValueT* const first = iter.block_;
+    const ValueT* pos =
+        std::lower_bound(first, first + BlockCount(block), value);
+    iter.Seek(block * kBlockSize + (pos - first) - 1);
+    return iter;
+  }
+
+ private:
+  size_t BlockCount(size_t block) const {
+    return std::min(kBlockSize, size_ - block * kBlockSize);
+  }
+
+  static uint32_t LowBits(int bits) {
+    return bits >= 32 ? ~uint32_t(0) : (uint32_t(1) << bits) - 1;
+  }
+
+  // Blocks of differences up to 32 bits wide: difference i goes to lane
+  // i % 4 at slot i / 4, lane words are interleaved, so a slot of all four
+  // lanes is at the same bit offset of four consecutive words. Wider ones
+  // form a plain bit stream.
+  void AppendBlock(const ValueT* keys, size_t n) {
+    uint64_t deltas[kBlockSize] = {};
+    uint64_t any_bits = 0;
+    for (size_t i = 1; i < n; ++i) {
+      deltas[i] = static_cast<uint64_t>(keys[i]) -
+                  static_cast<uint64_t>(keys[i - 1]);
+      any_bits |= deltas[i];
+    }
+    int bits = 0;
+    while (bits < 64 && (any_bits >> bits) != 0) {
+      ++bits;
+    }
+    mins_.push_back(keys[0]);
+    offsets_.push_back(words_.size());
+    bits_.push_back(static_cast<uint8_t>(bits));
+    // kBlockSize * bits bits.
+    words_.resize(words_.size() + kBlockSize / 32 * bits, 0);
+    size_ += n;
+    if (bits == 0) {
+      return;
+    }
+    uint32_t* out = words_.data() + offsets_.back();
+    for (size_t i = 0; i < kBlockSize; ++i) {
+      if (bits <= 32) {
+        const size_t pos = i / 4 * bits;
+        const size_t word = pos / 32 * 4 + i % 4;
+        const int shift = pos % 32;
+        out[word] |= static_cast<uint32_t>(deltas[i] << shift);
+        if (shift + bits > 32) {
+          out[word + 4] |= static_cast<uint32_t>(deltas[i] >> (32 - shift));
+        }
+      } else {
+        PutBits(out, i * bits, bits, deltas[i]);
+      }
+    }
+  }
+
+  static void PutBits(uint32_t* out, size_t pos, int bits, uint64_t value) {
+    while (bits > 0) {
+      const int shift = pos % 32;
+      const int take = std::min(32 - shift, bits);
+      out[pos / 32] |= (static_cast<uint32_t>(value) & LowBits(take))
+                       << shift;
+      value >>= take;
+      pos += take;
+      bits -= take;
+    }
+  }
+
+  static uint64_t GetBits(const uint32_t* in, size_t pos, int bits) {
+    uint64_t value = 0;
+    for (int got = 0; got < bits;) {
+      const int shift = pos % 32;
+      const int take = std::min(32 - shift, bits - got);
+      value |= static_cast<uint64_t>((in[pos / 32] >> shift) & LowBits(take))
+               << got;
+      pos += take;
+      got += take;
+    }
+    return value;
+  }
+
+  // Decodes all kBlockSize keys of a block, the last block is padded with
+  // copies of its largest key.
+  void DecodeBlock(size_t block, ValueT* out) const {
+    const uint32_t* in = words_.data() + offsets_[block];
+    const int bits = bits_[block];
+    uint64_t key = static_cast<uint64_t>(mins_[block]);
+    if (bits == 0) {
+      std::fill(out, out + kBlockSize, mins_[block]);
+    } else if (bits <= 32) {
+      DecodeLanes(in, bits, key, out);
+    } else {
+      for (size_t i = 0; i < kBlockSize; ++i) {
+        key += GetBits(in, i * bits, bits);
+        out[i] = static_cast<ValueT>(key);
+      }
+    }
+  }
+
+#if defined(__SSE2__)
+  // Every step extracts one slot of all lanes, four differences, and adds
+  // their prefix sums to the last key in two halves of 64-bit pairs.
+  static void DecodeLanes(const uint32_t* in, int bits, uint64_t key,
+                          ValueT* out) {
+    const __m128i* words = reinterpret_cast<const __m128i*>(in);
+    const __m128i mask = _mm_set1_epi32(static_cast<int>(LowBits(bits)));
+    const __m128i zero = _mm_setzero_si128();
+    __m128i last = _mm_set1_epi64x(static_cast<int64_t>(key));
+    __m128i* dst = reinterpret_cast<__m128i*>(out);
+    for (size_t slot = 0; slot < kBlockSize / 4; ++slot) {
+      const size_t pos = slot * bits;
+      const int shift = pos % 32;
+      __m128i deltas = _mm_srl_epi32(_mm_loadu_si128(words + pos / 32),
+                                     _mm_cvtsi32_si128(shift));
+      if (shift + bits > 32) {
+        deltas = _mm_or_si128(
+            deltas, _mm_sll_epi32(_mm_loadu_si128(words + pos / 32 + 1),
+                                  _mm_cvtsi32_si128(32 - shift)));
+      }
+      deltas = _mm_and_si128(deltas, mask);
+      __m128i low = _mm_unpacklo_epi32(deltas, zero);
+      __m128i high = _mm_unpackhi_epi32(deltas, zero);
+      low = _mm_add_epi64(low, _mm_slli_si128(low, 8));
+      high = _mm_add_epi64(high, _mm_slli_si128(high, 8));
+      low = _mm_add_epi64(low, last);
+      high = _mm_add_epi64(high, _mm_shuffle_epi32(low, 0xee));
+      last = _mm_shuffle_epi32(high, 0xee);
+      _mm_storeu_si128(dst + 2 * slot, low);
+      _mm_storeu_si128(dst + 2 * slot + 1, high);
+    }
+  }
+#else
+  static void DecodeLanes(const uint32_t* in, int bits, uint64_t key,
+                          ValueT* out) {
+    for (size_t i = 0; i < kBlockSize; ++i) {
+      const size_t pos = i / 4 * bits;
+      const size_t word = pos / 32 * 4 + i % 4;
+      const int shift = pos % 32;
+      uint64_t delta = in[word] >> shift;
+      if (shift + bits > 32) {
+        delta |= static_cast<uint64_t>(in[word + 4]) << (32 - shift);
+      }
+      key += delta & LowBits(bits);
+      out[i] = static_cast<ValueT>(key);
+    }
+  }
+#endif
+
+  size_t size_;
+  std::vector<uint32_t> words_;   // packed differences of all blocks
+  std::vector<ValueT> mins_;      // first key of every block
+  std::vector<uint64_t> offsets_; // first word of every block
+  std::vector<uint8_t> bits_;     // width of differences of every block
+};
+
+template <typename ValueT>
+constexpr size_t PackedSet<ValueT>::kBlockSize;
+
+// Exports keys of a tree, e.g. an RBTree<int64_t, std::less<int64_t>>.
+template <typename TreeT>
+PackedSet<typename TreeT::value_type> MakePackedSet(const TreeT& tree) {
+  return PackedSet<typename TreeT::value_type>(tree.begin(), tree.end());
+}
+
+}  // trilib
+
+#endif  // PACKED_SET_H_
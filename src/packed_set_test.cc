@@ -0,0 +1,133 @@
+#include "packed_set.h"
+#include "rbtree.h"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+// Compares all queries with binary searches of the sorted keys, probing
+// every key, its neighbours and random values.
+template <typename ValueT>
+void CheckQueries(const vector<ValueT>& keys) {
+  const trilib::PackedSet<ValueT> packed(keys.begin(), keys.end());
+  ASSERT_EQ(keys.size(), packed.size());
+  ASSERT_TRUE(equal(keys.begin(), keys.end(), packed.begin()));
+  ASSERT_EQ(keys.size(),
+            static_cast<size_t>(distance(packed.begin(), packed.end())));
+  vector<ValueT> probes;
+  for (ValueT key : keys) {
+    probes.push_back(key);
+    probes.push_back(static_cast<ValueT>(uint64_t(key) - 1));
+    probes.push_back(static_cast<ValueT>(uint64_t(key) + 1));
+  }
+  mt19937_64 gen(7);
+  for (int i = 0; i < 1000; ++i) {
+    probes.push_back(static_cast<ValueT>(gen()));
+  }
+  probes.push_back(numeric_limits<ValueT>::min());
+  probes.push_back(numeric_limits<ValueT>::max());
+  for (ValueT value : probes) {
+    const auto equal_range = std::equal_range(keys.begin(), keys.end(), value);
+    ASSERT_EQ(equal_range.first != equal_range.second, packed.HasValue(value));
+    auto found = packed.Search(value);
+    if (equal_range.first != equal_range.second) {
+      ASSERT_EQ(value, *found);
+      // The first of equal elements.
+      ASSERT_EQ(static_cast<size_t>(equal_range.second - equal_range.first),
+                static_cast<size_t>(distance(found, packed.LowerBound(value))));
+    } else {
+      ASSERT_TRUE(found == packed.end());
+    }
+    auto above = packed.LowerBound(value);
+    if (equal_range.second == keys.end()) {
+      ASSERT_TRUE(above == packed.end()) << value;
+    } else {
+      ASSERT_EQ(*equal_range.second, *above) << value;
+      ASSERT_EQ(keys.end() - equal_range.second, distance(above, packed.end()));
+    }
+    auto below = packed.UpperBound(value);
+    if (equal_range.first == keys.begin()) {
+      ASSERT_TRUE(below == packed.end()) << value;
+    } else {
+      ASSERT_EQ(*prev(equal_range.first), *below) << value;
+    }
+  }
+}
+
+}  // namespace
+
+TEST(PackedSet, Empty) {
+  const trilib::PackedSet<int64_t> packed;
+  EXPECT_TRUE(packed.empty());
+  EXPECT_TRUE(packed.begin() == packed.end());
+  EXPECT_FALSE(packed.HasValue(0));
+  EXPECT_TRUE(packed.LowerBound(0) == packed.end());
+  EXPECT_TRUE(packed.UpperBound(0) == packed.end());
+  CheckQueries(vector<int64_t>{});
+}
+
+TEST(PackedSet, AllWidths) {
+  // Every width of differences from 0 to 64 bits, some blocks mixed.
+  mt19937_64 gen(1);
+  vector<int64_t> keys;
+  int64_t key = numeric_limits<int64_t>::min();
+  for (int bits = 0; bits <= 63; ++bits) {
+    for (int i = 0; i < 150; ++i) {
+      keys.push_back(key);
+      const uint64_t delta = bits == 0 ? 0 : gen() >> (64 - bits);
+      if (uint64_t(numeric_limits<int64_t>::max()) - uint64_t(key) < delta) {
+        break;
+      }
+      key = static_cast<int64_t>(uint64_t(key) + delta);
+    }
+  }
+  CheckQueries(keys);
+  // A single difference of 64 bits.
+  CheckQueries(vector<uint64_t>{0, 1, 5, numeric_limits<uint64_t>::max()});
+}
+
+TEST(PackedSet, Sizes) {
+  for (size_t size : {1, 2, 127, 128, 129, 255, 256, 1000}) {
+    vector<int64_t> keys;
+    int64_t key = -500;
+    for (size_t i = 0; i < size; ++i) {
+      keys.push_back(key);
+      // Runs of duplicates, some crossing blocks.
+      key += i % 100 < 70 ? i % 5 : 0;
+    }
+    CheckQueries(keys);
+  }
+}
+
+TEST(PackedSet, FromTree) {
+  trilib::RBTree<int64_t, less<int64_t>> tree;
+  mt19937_64 gen(3);
+  for (int i = 0; i < 50000; ++i) {
+    tree.Insert(static_cast<int64_t>(gen() >> 36));
+  }
+  const auto packed = trilib::MakePackedSet(tree);
+  ASSERT_EQ(tree.size(), packed.size());
+  EXPECT_TRUE(equal(tree.begin(), tree.end(), packed.begin()));
+  // 28-bit keys, gaps of ~13 bits on average and ~16 at most in a block.
+  EXPECT_LT(packed.bytes(), 5 * tree.size() / 2);
+  for (int i = 0; i < 1000; ++i) {
+    const int64_t value = static_cast<int64_t>(gen() >> 36);
+    ASSERT_EQ(tree.HasValue(value), packed.HasValue(value));
+    auto above = tree.LowerBound(value);
+    if (above == tree.end()) {
+      ASSERT_TRUE(packed.LowerBound(value) == packed.end());
+    } else {
+      ASSERT_EQ(*above, *packed.LowerBound(value));
+    }
+  }
+}
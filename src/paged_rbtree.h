@@ -0,0 +1,391 @@
+#ifndef PAGED_RBTREE_H_
+#define PAGED_RBTREE_H_
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "offset_rbtree.h"
+
+namespace trilib {
+
+struct PageCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t writebacks;
+  uint64_t readahead_pages;
+};
+
+// Storage of OffsetRBTree nodes in a file of fixed-size pages, with hot pages
+// kept in an LRU cache of a bounded size. Page 0 keeps the header, nodes
+// never cross a page boundary. A miss on a page following one of recently
+// missed ones is treated as a sequential scan and reads ahead few more pages
+// in a single call.
+//
+// The first failed read or write makes the storage failed for good: the
+// tree in memory can't be trusted anymore, so nothing more is written to the
+// file and dirty pages are never dropped, the cache grows over its budget
+// instead.
+template <typename ValueT>
+class PagedStorage {
+ public:
+  using NodeT = OffsetRBTreeNode<ValueT>;
+
+  static constexpr uint64_t kMagic = 0x45455254474d5254ULL;  // "TRPGTREE"
+  static constexpr uint32_t kVersion = 1;
+  // Nodes touched by a single rotation must fit in the cache at once.
+  static constexpr size_t kMinCachePages = 8;
+  static constexpr size_t kMissHistory = 4;
+  static constexpr uint64_t kNoPage = ~uint64_t(0);
+
+  PagedStorage()
+      : fd_(-1), page_size_(0), cache_pages_(0), readahead_pages_(0),
+        header_dirty_(false), file_bytes_(0), failed_(false), last_page_(0),
+        last_frame_(nullptr), stats_() {
+    std::fill(last_loaded_, last_loaded_ + kMissHistory, kNoPage);
+  }
+  ~PagedStorage() { Close(); }
+
+  PagedStorage(const PagedStorage&) = delete;
+  PagedStorage& operator=(const PagedStorage&) = delete;
+
+  // Opens or creates a file. page_size is used only for new files.
+  bool Open(const std::string& path, size_t cache_bytes, uint32_t page_size,
+            size_t readahead_pages) {
+    Close();
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0) {
+      return false;
+    }
+    struct stat st;
+    if (::fstat(fd_, &st) != 0) {
+      Close();
+      return false;
+    }
+    file_bytes_ = st.st_size;
+    if (st.st_size == 0) {
+      if (page_size < sizeof(OffsetRBTreeHeader) ||
+          page_size < sizeof(NodeT)) {
+        Close();
+        return false;
+      }
+      header_.magic = kMagic;
+      header_.version = kVersion;
+      header_.node_size = sizeof(NodeT);
+      header_.root = 0;
+      header_.size = 0;
+      header_.free_list = 0;
+      header_.end = page_size;
+      header_.value_size = sizeof(ValueT);
+      header_.page_size = page_size;
+      header_dirty_ = true;
+    } else if (::pread(fd_, &header_, sizeof(header_), 0) != sizeof(header_) ||
+               header_.magic != kMagic || header_.version != kVersion ||
+               header_.node_size != sizeof(NodeT) ||
+               header_.value_size != sizeof(ValueT) ||
+               header_.page_size < sizeof(NodeT)) {
+      Close();
+      return false;
+    }
+    page_size_ = header_.page_size;
+    cache_pages_ = cache_bytes / page_size_;
+    if (cache_pages_ < kMinCachePages) {
+      cache_pages_ = kMinCachePages;
+    }
+    readahead_pages_ = std::min(readahead_pages, cache_pages_ / 2);
+    return true;
+  }
+
+  bool IsOpen() const { return fd_ >= 0; }
+
+  // True after an I/O error, until the file is closed.
+  bool failed() const { return failed_; }
+
+  // Writes all dirty pages and the header.
+  bool Flush() {
+    if (fd_ < 0 || failed_) {
+      return false;
+    }
+    bool ok = true;
+    for (Frame& frame : frames_) {
+      ok = WriteBack(&frame) && ok;
+    }
+    if (header_dirty_) {
+      header_dirty_ =
+          ::pwrite(fd_, &header_, sizeof(header_), 0) != sizeof(header_);
+      failed_ |= header_dirty_;
+      ok = !header_dirty_ && ok;
+    }
+    return ok;
+  }
+
+  void Close() {
+    if (fd_ >= 0) {
+      Flush();
+      ::close(fd_);
+      fd_ = -1;
+    }
+    frames_.clear();
+    index_.clear();
+    last_frame_ = nullptr;
+    failed_ = false;
+    std::fill(last_loaded_, last_loaded_ + kMissHistory, kNoPage);
+  }
+
+  uint32_t page_size() const { return page_size_; }
+  size_t cache_pages() const { return cache_pages_; }
+  const PageCacheStats& stats() const { return stats_; }
+  void ResetStats() { stats_ = PageCacheStats(); }
+
+  const NodeT* Read(NodeOffset off) {
+    return reinterpret_cast<const NodeT*>(Page(off / page_size_, false) +
+                                          off % page_size_);
+  }
+
+  NodeT* Write(NodeOffset off) {
+    return reinterpret_cast<NodeT*>(Page(off / page_size_, true) +
+                                    off % page_size_);
+  }
+
+  const OffsetRBTreeHeader* ReadHeader() const { return &header_; }
+
+  OffsetRBTreeHeader* WriteHeader() {
+    header_dirty_ = true;
+    return &header_;
+  }
+
+  NodeOffset Allocate() {
+    header_dirty_ = true;
+    if (header_.free_list != 0) {
+      const NodeOffset node = header_.free_list;
+      header_.free_list = Read(node)->left_child;
+      return node;
+    }
+    if (header_.end % page_size_ + sizeof(NodeT) > page_size_) {
+      header_.end += page_size_ - header_.end % page_size_;
+    }
+    const NodeOffset node = header_.end;
+    header_.end += sizeof(NodeT);
+    return node;
+  }
+
+  void Free(NodeOffset off) {
+    Write(off)->left_child = header_.free_list;
+    header_.free_list = off;
+    header_dirty_ = true;
+  }
+
+ private:
+  struct Frame {
+    uint64_t page;
+    bool dirty;
+    std::vector<char> data;
+  };
+  using FrameList = std::list<Frame>;
+
+  char* Page(uint64_t page, bool for_write) {
+    if (last_frame_ != nullptr && last_page_ == page) {
+      ++stats_.hits;
+      last_frame_->dirty |= for_write;
+      return last_frame_->data.data();
+    }
+    auto found = index_.find(page);
+    if (found != index_.end()) {
+      ++stats_.hits;
+      frames_.splice(frames_.begin(), frames_, found->second);
+    } else {
+      ++stats_.misses;
+      bool sequential = false;
+      for (uint64_t last : last_loaded_) {
+        sequential |= last != kNoPage && last + 1 == page;
+      }
+      last_loaded_[stats_.misses % kMissHistory] =
+          page + Load(page, sequential ? readahead_pages_ : 0);
+    }
+    last_page_ = page;
+    last_frame_ = &frames_.front();
+    last_frame_->dirty |= for_write;
+    return last_frame_->data.data();
+  }
+
+  // Reads page and those of readahead following pages which aren't cached
+  // yet, contiguous runs are read with a single call. The page ends up at
+  // the front of LRU list. Returns how many pages past page the loaded
+  // range ends, cached pages in it included.
+  size_t Load(uint64_t page, size_t readahead) {
+    const uint64_t end_page = (header_.end + page_size_ - 1) / page_size_;
+    const uint64_t last = std::min<uint64_t>(page + readahead, end_page - 1);
+    size_t loaded = 0;
+    for (uint64_t run = last + 1; run-- > page;) {
+      if (run != page && index_.find(run) != index_.end()) {
+        continue;
+      }
+      // Find [first, run] not cached, go backward so page is loaded last.
+      uint64_t first = run;
+      while (first > page && index_.find(first - 1) == index_.end()) {
+        --first;
+      }
+      loaded += LoadRun(first, run - first + 1);
+      run = first;
+    }
+    stats_.readahead_pages += loaded - 1;
+    return last - page;
+  }
+
+  size_t LoadRun(uint64_t first, size_t count) {
+    std::vector<struct iovec> iov(count);
+    for (size_t i = count; i-- > 0;) {
+      Frame* frame = NewFrame(first + i);
+      iov[i].iov_base = frame->data.data();
+      iov[i].iov_len = page_size_;
+    }
+    // Pages past the end of file weren't written yet and read as zeros.
+    const uint64_t offset = first * page_size_;
+    const size_t in_file =
+        file_bytes_ > offset
+            ? std::min<uint64_t>(file_bytes_ - offset, count * page_size_)
+            : 0;
+    const ssize_t got =
+        in_file == 0 ? 0 : ::preadv(fd_, iov.data(), count, offset);
+    size_t valid = in_file;
+    if (got < 0 || static_cast<size_t>(got) < in_file) {
+      // Zeros end walks of the failed tree instead of following garbage.
+      failed_ = true;
+      valid = 0;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      if (valid < (i + 1) * page_size_) {
+        const size_t from = valid > i * page_size_ ? valid - i * page_size_ : 0;
+        std::memset(static_cast<char*>(iov[i].iov_base) + from, 0,
+                    page_size_ - from);
+      }
+    }
+    return count;
+  }
+
+  // Returns a frame for page at the front of LRU list, evicting the least
+  // recently used one if the cache is full. A dirty page which can't be
+  // written back stays, the cache grows instead.
+  Frame* NewFrame(uint64_t page) {
+    if (frames_.size() < cache_pages_ || !WriteBack(&frames_.back())) {
+      frames_.push_front(Frame());
+      frames_.front().data.resize(page_size_);
+    } else {
+      Frame& victim = frames_.back();
+      index_.erase(victim.page);
+      ++stats_.evictions;
+      frames_.splice(frames_.begin(), frames_, std::prev(frames_.end()));
+      if (last_frame_ == &frames_.front()) {
+        last_frame_ = nullptr;
+      }
+    }
+    Frame& frame = frames_.front();
+    frame.page = page;
+    frame.dirty = false;
+    index_[page] = frames_.begin();
+    return &frame;
+  }
+
+  bool WriteBack(Frame* frame) {
+    if (!frame->dirty) {
+      return true;
+    }
+    if (failed_) {
+      return false;
+    }
+    ++stats_.writebacks;
+    const ssize_t written = ::pwrite(fd_, frame->data.data(), page_size_,
+                                     frame->page * page_size_);
+    frame->dirty = written != static_cast<ssize_t>(page_size_);
+    failed_ |= frame->dirty;
+    if (!frame->dirty) {
+      file_bytes_ = std::max(file_bytes_, (frame->page + 1) * page_size_);
+    }
+    return !frame->dirty;
+  }
+
+  int fd_;
+  uint32_t page_size_;
+  size_t cache_pages_;
+  size_t readahead_pages_;
+  OffsetRBTreeHeader header_;
+  bool header_dirty_;
+  uint64_t file_bytes_;
+  bool failed_;
+  FrameList frames_;  // most recently used first
+  std::unordered_map<uint64_t, typename FrameList::iterator> index_;
+  uint64_t last_page_;
+  Frame* last_frame_;
+  // Last page loaded by few recent misses. Scans interleave with accesses to
+  // ancestors, so more than one is needed to detect them.
+  uint64_t last_loaded_[kMissHistory];
+  PageCacheStats stats_;
+};
+
+template <typename ValueT>
+constexpr uint64_t PagedStorage<ValueT>::kNoPage;
+
+// Red-black tree for data sets larger than memory. Nodes live in a file and
+// only cache_bytes worth of pages is kept in memory, the rest is read on
+// demand. It has the same interface as MmapRBTree, but I/O is explicit and
+// bounded by the cache budget. After an I/O error Insert, Delete and Flush
+// return false and failed() is set; lookups may miss values then.
+//
+//   trilib::PagedRBTree<int64_t, std::less<int64_t>> tree;
+//   tree.Open("/data/big.tree", 256 << 20);  // 256MiB of cache
+//   tree.Insert(42);
+//   tree.Flush();
+template <typename ValueT, typename CompT>
+class PagedRBTree : public OffsetRBTree<ValueT, CompT, PagedStorage<ValueT>> {
+  using Base = OffsetRBTree<ValueT, CompT, PagedStorage<ValueT>>;
+
+ public:
+  bool Open(const std::string& path, size_t cache_bytes,
+            uint32_t page_size = 4096, size_t readahead_pages = 16) {
+    return this->storage_.Open(path, cache_bytes, page_size, readahead_pages);
+  }
+
+  bool IsOpen() const { return this->storage_.IsOpen(); }
+
+  bool failed() const { return this->storage_.failed(); }
+
+  // Returns false if out of space or on I/O error.
+  bool Insert(const ValueT& value) {
+    return !failed() && Base::Insert(value) && !failed();
+  }
+
+  // Returns false on I/O error.
+  bool Delete(const ValueT& value) {
+    return !failed() && Delete(this->Search(value));
+  }
+
+  bool Delete(typename Base::const_iterator iter) {
+    if (failed()) {
+      return false;
+    }
+    Base::Delete(iter);
+    return !failed();
+  }
+
+  bool Flush() { return this->storage_.Flush(); }
+
+  void Close() { this->storage_.Close(); }
+
+  const PageCacheStats& stats() const { return this->storage_.stats(); }
+
+  void ResetStats() { this->storage_.ResetStats(); }
+};
+
+}  // trilib
+
+#endif  // PAGED_RBTREE_H_
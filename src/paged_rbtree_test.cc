@@ -0,0 +1,166 @@
+#include "paged_rbtree.h"
+
+#include "gtest/gtest.h"
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <string>
+
+using namespace std;
+
+using PagedTree = trilib::PagedRBTree<int64_t, less<int64_t>>;
+
+class PagedRBTreeFixture : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    char path[] = "/tmp/paged_rbtree_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    unlink(path);
+    path_ = path;
+  }
+
+  virtual void TearDown() { unlink(path_.c_str()); }
+
+  string path_;
+};
+
+TEST_F(PagedRBTreeFixture, LargerThanCache) {
+  PagedTree tree;
+  // 8 pages of 4KiB of cache for ~1.2MiB of nodes.
+  ASSERT_TRUE(tree.Open(path_, 8 * 4096));
+  constexpr int64_t my_prime = 30011;
+  constexpr int64_t iter_val = 5678;
+  int64_t val = 0;
+  for (int i = 0; i < 30000; ++i) {
+    val = (val + iter_val) % my_prime;
+    ASSERT_TRUE(tree.Insert(val));
+  }
+  ASSERT_EQ(30000u, tree.size());
+  ASSERT_TRUE(tree.IsBinarySearchTree());
+  ASSERT_TRUE(tree.IsBlackProperty());
+  ASSERT_TRUE(tree.IsRedHasTwoBlacks());
+  EXPECT_GT(tree.stats().evictions, 0u);
+  EXPECT_GT(tree.stats().writebacks, 0u);
+
+  val = 0;
+  for (int i = 0; i < 15000; ++i) {
+    val = (val + iter_val) % my_prime;
+    ASSERT_TRUE(tree.HasValue(val));
+    tree.Delete(val);
+  }
+  ASSERT_EQ(15000u, tree.size());
+  ASSERT_TRUE(tree.IsBinarySearchTree());
+  ASSERT_TRUE(tree.IsBlackProperty());
+  ASSERT_TRUE(tree.IsRedHasTwoBlacks());
+
+  int64_t prev = -1;
+  size_t count = 0;
+  for (int64_t x : tree) {
+    ASSERT_LT(prev, x);
+    prev = x;
+    ++count;
+  }
+  EXPECT_EQ(15000u, count);
+}
+
+TEST_F(PagedRBTreeFixture, Reopen) {
+  {
+    PagedTree tree;
+    ASSERT_TRUE(tree.Open(path_, 8 * 4096));
+    for (int64_t i = 0; i < 20000; ++i) {
+      tree.Insert(i);
+    }
+    tree.Delete(int64_t(7));
+  }
+  PagedTree tree;
+  ASSERT_TRUE(tree.Open(path_, 8 * 4096));
+  ASSERT_EQ(19999u, tree.size());
+  EXPECT_FALSE(tree.HasValue(7));
+  EXPECT_TRUE(tree.HasValue(19999));
+  ASSERT_TRUE(tree.IsBlackProperty());
+  ASSERT_TRUE(tree.IsRedHasTwoBlacks());
+}
+
+TEST_F(PagedRBTreeFixture, SequentialScanReadsAhead) {
+  {
+    PagedTree tree;
+    ASSERT_TRUE(tree.Open(path_, 1 << 20));
+    for (int64_t i = 0; i < 50000; ++i) {
+      tree.Insert(i);
+    }
+  }
+  PagedTree tree;
+  ASSERT_TRUE(tree.Open(path_, 64 * 4096));
+  int64_t expected = 0;
+  for (int64_t x : tree) {
+    ASSERT_EQ(expected++, x);
+  }
+  ASSERT_EQ(50000, expected);
+  const trilib::PageCacheStats& stats = tree.stats();
+  EXPECT_GT(stats.readahead_pages, 0u);
+  EXPECT_LT(stats.misses, stats.readahead_pages);
+  EXPECT_EQ(0u, stats.writebacks);
+}
+
+TEST_F(PagedRBTreeFixture, FailedWriteKeepsPages) {
+  PagedTree tree;
+  ASSERT_TRUE(tree.Open(path_, 8 * 4096));
+  // Writes past 64KiB fail with EFBIG instead of killing the process.
+  struct rlimit old_limit;
+  ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &old_limit));
+  struct rlimit limit = old_limit;
+  limit.rlim_cur = 16 * 4096;
+  ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &limit));
+  void (*old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+  int64_t inserted = 0;
+  while (inserted < 30000 && tree.Insert(inserted)) {
+    ++inserted;
+  }
+  EXPECT_TRUE(tree.failed());
+  EXPECT_FALSE(tree.Insert(inserted));
+  EXPECT_FALSE(tree.Delete(int64_t(0)));
+  EXPECT_FALSE(tree.Flush());
+  // Pages which couldn't be written stayed in the cache.
+  EXPECT_GT(inserted, 0);
+  for (int64_t i = 0; i < inserted; ++i) {
+    ASSERT_TRUE(tree.HasValue(i));
+  }
+  EXPECT_GT(tree.size(), 0u);
+  tree.Close();
+  signal(SIGXFSZ, old_handler);
+  ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &old_limit));
+  struct stat st;
+  ASSERT_EQ(0, stat(path_.c_str(), &st));
+  EXPECT_LE(st.st_size, 16 * 4096);
+}
+
+TEST_F(PagedRBTreeFixture, FailedReadIsReported) {
+  {
+    PagedTree tree;
+    ASSERT_TRUE(tree.Open(path_, 8 * 4096));
+    for (int64_t i = 0; i < 20000; ++i) {
+      ASSERT_TRUE(tree.Insert(i));
+    }
+  }
+  PagedTree tree;
+  ASSERT_TRUE(tree.Open(path_, 8 * 4096));
+  // The file shrinks under the open tree, reads of cut pages come up short.
+  ASSERT_EQ(0, truncate(path_.c_str(), 8 * 4096));
+  EXPECT_FALSE(tree.failed());
+  size_t count = 0;
+  for (auto it = tree.begin(); it != tree.end() && count < 20000; ++it) {
+    ++count;
+  }
+  EXPECT_TRUE(tree.failed());
+  EXPECT_LT(count, 20000u);
+  EXPECT_FALSE(tree.Insert(1));
+  EXPECT_FALSE(tree.Flush());
+}
@@ -1,8 +1,21 @@
 #ifndef RBTREE_H_
 #define RBTREE_H_
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <new>
+#include <streambuf>
+#include <string>
+#include <thread>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace trilib {
 
@@ -13,8 +26,13 @@ inline bool is_null(const ValueT& ptr) {
   return ptr == nullptr;
 }
 
-template <typename ValueT>
-class RBTreeNode {
+// Per-node data of NoAugment, takes no space.
+struct NoAugmentData {};
+
+// DataT holds per-node data of the tree's augmentation policy. It's a base
+// class, so empty data takes no space.
+template <typename ValueT, typename DataT = NoAugmentData>
+class RBTreeNode : public DataT {
  public:
   RBTreeNode()
       : properties(0),
@@ -23,12 +41,15 @@ class RBTreeNode {
         right_child(nullptr) {}
 
   RBTreeNode(ValueT value)
-      : value_(value),
+      : value_(std::move(value)),
         properties(0),
         parent(nullptr),
         left_child(nullptr),
         right_child(nullptr) {}
 
+  DataT& augment() { return *this; }
+  const DataT& augment() const { return *this; }
+
   inline bool IsLeftChild() const { return parent->left_child == this; }
 
   inline bool SafeIsLeftChild() const {
@@ -53,6 +74,18 @@ class RBTreeNode {
   bool IsColorRed() const { return (properties & 1) == 0; }
   bool IsColorBlack() const { return properties & 1; }
 
+  // Bits of properties owned by a balancing policy.
+  static constexpr unsigned int kBalanceMask = 0xff;
+  unsigned int balance() const { return properties & kBalanceMask; }
+  void set_balance(unsigned int balance) {
+    properties = (properties & ~kBalanceMask) | balance;
+  }
+
+  // Bits of properties tracking where the node lives, see RBTree::Compact.
+  static constexpr unsigned int kInArena = 1u << 8;
+  static constexpr unsigned int kPendingMove = 1u << 9;
+  static constexpr unsigned int kDeleted = 1u << 10;
+
   ValueT value_;
   // Tree properties
   unsigned int properties;
@@ -66,26 +99,116 @@ class RBTreeNode {
   static const unsigned int kRightChild;
 };
 
+template <typename ValueT, typename DataT>
+const unsigned int RBTreeNode<ValueT, DataT>::kColorRed = 1;
+
+template <typename ValueT, typename DataT>
+const unsigned int RBTreeNode<ValueT, DataT>::kColorBlack = 2;
+
+template <typename ValueT, typename DataT>
+const unsigned int RBTreeNode<ValueT, DataT>::kLeftChild = 4;
+
+template <typename ValueT, typename DataT>
+const unsigned int RBTreeNode<ValueT, DataT>::kRightChild = 8;
+
+// Node data of the KeyOffset augmentation: a delta already added to the
+// value of the node, but not yet to values of its descendants.
 template <typename ValueT>
-const unsigned int RBTreeNode<ValueT>::kColorRed = 1;
+struct KeyOffsetData {
+  KeyOffsetData() : offset() {}
+  ValueT offset;
+};
+
+// Hands pending offset of x down to its children. Everything that descends
+// from a non-const node and reads values below it calls this first, it's a
+// no-op for nodes without KeyOffsetData and for const nodes, which are
+// never written, see OffsetWalk.
+template <typename NodeT>
+inline void PushDown(const NodeT*) {}
 
 template <typename ValueT>
-const unsigned int RBTreeNode<ValueT>::kColorBlack = 2;
+inline void PushDown(RBTreeNode<ValueT, KeyOffsetData<ValueT>>* x) {
+  const ValueT offset = x->offset;
+  if (offset == ValueT()) {
+    return;
+  }
+  if (x->HasLeftChild()) {
+    x->left_child->value_ += offset;
+    x->left_child->offset += offset;
+  }
+  if (x->HasRightChild()) {
+    x->right_child->value_ += offset;
+    x->right_child->offset += offset;
+  }
+  x->offset = ValueT();
+}
+
+// Pushes offsets of all ancestors of x and of x itself, top-down, so that
+// values around x are exact. For nodes reached without a descent.
+template <typename NodeT>
+inline void PushPath(const NodeT*) {}
 
 template <typename ValueT>
-const unsigned int RBTreeNode<ValueT>::kLeftChild = 4;
+inline void PushPath(RBTreeNode<ValueT, KeyOffsetData<ValueT>>* x) {
+  if (x->HasParent()) {
+    PushPath(x->parent);
+  }
+  PushDown(x);
+}
+
+// Value of nodes along a walk over the tree. A walk over non-const nodes
+// pushes pending offsets down as it descends, so node values are exact.
+// NodeT may be const qualified.
+template <typename NodeT>
+struct OffsetWalk {
+  // Before going from x to one of its children.
+  void Down(NodeT* x) { PushDown(x); }
+  // After going up to x from one of its children.
+  void Up(NodeT*) {}
+  // Starts at x, wherever it is.
+  void Start(NodeT*) {}
+  auto Value(NodeT* x) -> decltype((x->value_)) { return x->value_; }
+};
 
+// A walk over const nodes with KeyOffsetData doesn't write, so that const
+// trees can be read concurrently. It adds up pending offsets of ancestors
+// of the current node instead and adds them to values it returns.
 template <typename ValueT>
-const unsigned int RBTreeNode<ValueT>::kRightChild = 8;
+struct OffsetWalk<const RBTreeNode<ValueT, KeyOffsetData<ValueT>>> {
+  using NodeT = const RBTreeNode<ValueT, KeyOffsetData<ValueT>>;
+
+  OffsetWalk() : offset(), value() {}
+
+  void Down(NodeT* x) { offset += x->offset; }
+  void Up(NodeT* x) { offset -= x->offset; }
+
+  void Start(NodeT* x) {
+    offset = ValueT();
+    for (NodeT* y = is_null(x) ? nullptr : x->parent; !is_null(y);
+         y = y->parent) {
+      offset += y->offset;
+    }
+  }
+
+  // The reference is valid until the next call.
+  const ValueT& Value(NodeT* x) {
+    value = x->value_;
+    value += offset;
+    return value;
+  }
+
+  ValueT offset;  // sum of offsets of ancestors of the current node
+  ValueT value;
+};
 
 // helper methods
-template <typename ValueT>
-const ValueT& GetValue(const RBTreeNode<ValueT>* const ptr) {
+template <typename ValueT, typename DataT>
+const ValueT& GetValue(const RBTreeNode<ValueT, DataT>* const ptr) {
   return ptr->value_;
 }
 
-template <typename ValueT>
-const ValueT& GetValue(const RBTreeNode<ValueT>& ref) {
+template <typename ValueT, typename DataT>
+const ValueT& GetValue(const RBTreeNode<ValueT, DataT>& ref) {
   return ref.value_;
 }
 
@@ -109,17 +232,25 @@ bool CheckIsBinarySearchTree(const ValueT& root) {
            CheckIsBinarySearchTree<ValueT, CompT>(*root.right_child)));
 }
 
-template <typename ValueT, typename CompT>
-bool CheckIsBinarySearchTree(RBTreeNode<ValueT>* root,
-                             RBTreeNode<ValueT>* left_bound,
-                             RBTreeNode<ValueT>* right_bound,
-                             const CompT& cmp) {
-  return (is_null(left_bound) || RunCmp(left_bound, root, cmp)) &&
-         (is_null(right_bound) || RunCmp(root, right_bound, cmp)) &&
+template <typename ValueT, typename CompT, typename DataT>
+bool CheckIsBinarySearchTree(const RBTreeNode<ValueT, DataT>* root,
+                             const ValueT* left_bound,
+                             const ValueT* right_bound, const CompT& cmp,
+                             const OffsetWalk<const RBTreeNode<ValueT, DataT>>&
+                                 parent_walk) {
+  // value may point into walk and bounds values of children, so walk is a
+  // local: a tail call may reuse the space of a by-value parameter.
+  OffsetWalk<const RBTreeNode<ValueT, DataT>> walk = parent_walk;
+  auto&& value = walk.Value(root);
+  walk.Down(root);
+  return (is_null(left_bound) || cmp(*left_bound, value)) &&
+         (is_null(right_bound) || cmp(value, *right_bound)) &&
          (!root->HasLeftChild() ||
-          CheckIsBinarySearchTree(root->left_child, left_bound, root, cmp)) &&
+          CheckIsBinarySearchTree(root->left_child, left_bound, &value, cmp,
+                                  walk)) &&
          (!root->HasRightChild() ||
-          CheckIsBinarySearchTree(root->right_child, root, right_bound, cmp));
+          CheckIsBinarySearchTree(root->right_child, &value, right_bound, cmp,
+                                  walk));
 }
 
 template <typename ValueT, typename CompT>
@@ -132,28 +263,28 @@ bool CheckIsBinarySearchTree(const ValueT& root, const CompT& cmp) {
            CheckIsBinarySearchTree(*root.right_child, cmp)));
 }
 
-template <typename ValueT>
-int BlackToLeaves(const RBTreeNode<ValueT>* x) {
+template <typename ValueT, typename DataT>
+int BlackToLeaves(const RBTreeNode<ValueT, DataT>* x) {
   if (is_null(x)) {
     return 0;
   }
   const int left = BlackToLeaves(x->left_child);
   const int right = BlackToLeaves(x->right_child);
-  if (left == right) {
+  if (left >= 0 && left == right) {
     return left + (x->IsColorBlack() ? 1 : 0);
   }
   return -1;
 }
 
-template <typename ValueT>
-bool CheckBlackEquals(const RBTreeNode<ValueT>* x) {
+template <typename ValueT, typename DataT>
+bool CheckBlackEquals(const RBTreeNode<ValueT, DataT>* x) {
   const int left = BlackToLeaves(x->left_child);
   const int right = BlackToLeaves(x->right_child);
   return left == right;
 }
 
-template <typename ValueT>
-bool CheckRedHasTwoBlackChildren(const RBTreeNode<ValueT>* x) {
+template <typename ValueT, typename DataT>
+bool CheckRedHasTwoBlackChildren(const RBTreeNode<ValueT, DataT>* x) {
   return (!x->IsColorRed() ||
           ((!x->HasLeftChild() || x->left_child->IsColorBlack()) &&
            (!x->HasRightChild() || x->right_child->IsColorBlack()))) &&
@@ -161,8 +292,8 @@ bool CheckRedHasTwoBlackChildren(const RBTreeNode<ValueT>* x) {
          (!x->HasRightChild() || CheckRedHasTwoBlackChildren(x->right_child));
 }
 
-template <typename ValueT>
-void TreePrint(const RBTreeNode<ValueT>* x) {
+template <typename ValueT, typename DataT>
+void TreePrint(const RBTreeNode<ValueT, DataT>* x) {
   if (is_null(x)) {
     std::cout << "()";
     return;
@@ -177,56 +308,93 @@ void TreePrint(const RBTreeNode<ValueT>* x) {
   std::cout << ")";
 }
 
-template <typename ValueT>
-RBTreeNode<ValueT>* TreeMinimum(RBTreeNode<ValueT>* x) {
+// NodeT may be const qualified here and below.
+template <typename NodeT>
+NodeT* TreeMinimum(NodeT* x, OffsetWalk<NodeT>* walk) {
   while (x->HasLeftChild()) {
+    walk->Down(x);
     x = x->left_child;
   }
   return x;
 }
 
-template <typename ValueT>
-RBTreeNode<ValueT>* TreeMaximum(RBTreeNode<ValueT>* x) {
+template <typename NodeT>
+NodeT* TreeMinimum(NodeT* x) {
+  OffsetWalk<NodeT> walk;
+  return TreeMinimum(x, &walk);
+}
+
+template <typename NodeT>
+NodeT* TreeMaximum(NodeT* x, OffsetWalk<NodeT>* walk) {
   while (x->HasRightChild()) {
+    walk->Down(x);
     x = x->right_child;
   }
   return x;
 }
 
-template <typename ValueT, bool is_const = true>
-typename std::conditional<is_const, const RBTreeNode<ValueT>*, RBTreeNode<ValueT>*>::type
-TreePredecessor(typename std::conditional<is_const, const RBTreeNode<ValueT>*, RBTreeNode<ValueT>*>::type x) {
+template <typename NodeT>
+NodeT* TreeMaximum(NodeT* x) {
+  OffsetWalk<NodeT> walk;
+  return TreeMaximum(x, &walk);
+}
+
+template <typename NodeT>
+NodeT* TreePredecessor(NodeT* x, OffsetWalk<NodeT>* walk) {
   if (x->HasLeftChild()) {
-    return TreeMaximum(x->left_child);
+    walk->Down(x);
+    return TreeMaximum<NodeT>(x->left_child, walk);
   }
-  RBTreeNode<ValueT>* y = x->parent;
+  NodeT* y = x->parent;
   while (y != nullptr && x == y->left_child) {
+    walk->Up(y);
     x = y;
     y = y->parent;
   }
+  if (y != nullptr) {
+    walk->Up(y);
+  }
   return y;
 }
 
-template <typename ValueT, bool is_const = true>
-typename std::conditional<is_const, const RBTreeNode<ValueT>*, RBTreeNode<ValueT>*>::type
-TreeSuccessor(typename std::conditional<is_const, const RBTreeNode<ValueT>*, RBTreeNode<ValueT>*>::type x) {
+template <typename NodeT>
+NodeT* TreePredecessor(NodeT* x) {
+  OffsetWalk<NodeT> walk;
+  return TreePredecessor(x, &walk);
+}
+
+template <typename NodeT>
+NodeT* TreeSuccessor(NodeT* x, OffsetWalk<NodeT>* walk) {
   if (x->HasRightChild()) {
-    return TreeMinimum(x->right_child);
+    walk->Down(x);
+    return TreeMinimum<NodeT>(x->right_child, walk);
   }
-  RBTreeNode<ValueT>* y = x->parent;
+  NodeT* y = x->parent;
   while (y != nullptr && x == y->right_child) {
+    walk->Up(y);
     x = y;
     y = y->parent;
   }
+  if (y != nullptr) {
+    walk->Up(y);
+  }
   return y;
 }
 
-template <typename ValueT, typename CompT>
-RBTreeNode<ValueT>* TreeLowerBound(const ValueT& val, RBTreeNode<ValueT>* x,
-                                   const CompT& cmp) {
-  RBTreeNode<ValueT>* y = nullptr;
+template <typename NodeT>
+NodeT* TreeSuccessor(NodeT* x) {
+  OffsetWalk<NodeT> walk;
+  return TreeSuccessor(x, &walk);
+}
+
+template <typename ValueT, typename CompT, typename NodeT>
+NodeT* TreeLowerBound(const ValueT& val, NodeT* x, const CompT& cmp) {
+  OffsetWalk<NodeT> walk;
+  NodeT* y = nullptr;
   while (x != nullptr) {
-    if (cmp(val, x->value_)) {
+    const bool left = cmp(val, walk.Value(x));
+    walk.Down(x);
+    if (left) {
       y = x;
       x = x->left_child;
     } else {
@@ -236,12 +404,14 @@ RBTreeNode<ValueT>* TreeLowerBound(const ValueT& val, RBTreeNode<ValueT>* x,
   return y;
 }
 
-template <typename ValueT, typename CompT>
-RBTreeNode<ValueT>* TreeUpperBound(const ValueT& val, RBTreeNode<ValueT>* x,
-                                   const CompT& cmp) {
-  RBTreeNode<ValueT>* y = nullptr;
+template <typename ValueT, typename CompT, typename NodeT>
+NodeT* TreeUpperBound(const ValueT& val, NodeT* x, const CompT& cmp) {
+  OffsetWalk<NodeT> walk;
+  NodeT* y = nullptr;
   while (x != nullptr) {
-    if (cmp(x->value_, val)) {
+    const bool right = cmp(walk.Value(x), val);
+    walk.Down(x);
+    if (right) {
       y = x;
       x = x->right_child;
     } else {
@@ -251,13 +421,15 @@ RBTreeNode<ValueT>* TreeUpperBound(const ValueT& val, RBTreeNode<ValueT>* x,
   return y;
 }
 
-template <typename ValueT, typename CompT>
-RBTreeNode<ValueT>* TreeSearch(const ValueT& val, RBTreeNode<ValueT>* x,
-                               const CompT& cmp) {
-  RBTreeNode<ValueT>* ptr = x;
-  while (!is_null(ptr) && val != ptr->value_) {
+template <typename ValueT, typename CompT, typename NodeT>
+NodeT* TreeSearch(const ValueT& val, NodeT* x, const CompT& cmp) {
+  OffsetWalk<NodeT> walk;
+  NodeT* ptr = x;
+  while (!is_null(ptr) && val != walk.Value(ptr)) {
     // DCHECK(ptr != nullptr);
-    if (cmp(val, ptr->value_)) {
+    const bool left = cmp(val, walk.Value(ptr));
+    walk.Down(ptr);
+    if (left) {
       ptr = ptr->left_child;
     } else {
       ptr = ptr->right_child;
@@ -266,8 +438,54 @@ RBTreeNode<ValueT>* TreeSearch(const ValueT& val, RBTreeNode<ValueT>* x,
   return ptr;
 }
 
-template <typename ValueT>
-void TreeFree(RBTreeNode<ValueT>* x) {
+// Climbs from x to the lowest ancestor whose subtree spans all elements
+// between x and val, the rest of a finger search descends from there.
+// Elements equal to val stay on the side of val.
+template <typename ValueT, typename CompT, typename DataT>
+RBTreeNode<ValueT, DataT>* FingerRoot(const ValueT& val,
+                                      RBTreeNode<ValueT, DataT>* x,
+                                      const CompT& cmp) {
+  const bool to_left = cmp(val, x->value_);
+  while (x->HasParent()) {
+    RBTreeNode<ValueT, DataT>* p = x->parent;
+    if (to_left ? x->IsRightChild() && cmp(p->value_, val)
+                : x->IsLeftChild() && cmp(val, p->value_)) {
+      break;
+    }
+    x = p;
+  }
+  return x;
+}
+
+// Search starting at node x instead of the root, it takes O(log d) steps
+// where d is the distance between x and the result, amortized over sorted
+// sequences of lookups.
+template <typename ValueT, typename CompT, typename DataT>
+RBTreeNode<ValueT, DataT>* TreeFingerSearch(const ValueT& val,
+                                            RBTreeNode<ValueT, DataT>* x,
+                                            const CompT& cmp) {
+  if (!(val != x->value_)) {
+    return x;
+  }
+  return TreeSearch(val, FingerRoot(val, x, cmp), cmp);
+}
+
+// LowerBound starting at node x, see TreeFingerSearch.
+template <typename ValueT, typename CompT, typename DataT>
+RBTreeNode<ValueT, DataT>* TreeFingerLowerBound(const ValueT& val,
+                                                RBTreeNode<ValueT, DataT>* x,
+                                                const CompT& cmp) {
+  RBTreeNode<ValueT, DataT>* root = FingerRoot(val, x, cmp);
+  RBTreeNode<ValueT, DataT>* found = TreeLowerBound(val, root, cmp);
+  // The parent of a left child stopping the climb is greater than val.
+  if (is_null(found) && root->HasParent() && root->IsLeftChild()) {
+    return root->parent;
+  }
+  return found;
+}
+
+template <typename ValueT, typename DataT>
+void TreeFree(RBTreeNode<ValueT, DataT>* x) {
   if (!is_null(x)) {
     TreeFree(x->left_child);
     TreeFree(x->right_child);
@@ -275,121 +493,279 @@ void TreeFree(RBTreeNode<ValueT>* x) {
   }
 }
 
-}  // namespace
+// Copies shape, colors and values of a subtree, no comparisons are done.
+template <typename ValueT, typename DataT>
+RBTreeNode<ValueT, DataT>* TreeClone(const RBTreeNode<ValueT, DataT>* x,
+                                     RBTreeNode<ValueT, DataT>* parent) {
+  if (is_null(x)) {
+    return nullptr;
+  }
+  RBTreeNode<ValueT, DataT>* y = new RBTreeNode<ValueT, DataT>(x->value_);
+  y->properties = x->properties & RBTreeNode<ValueT, DataT>::kBalanceMask;
+  y->augment() = x->augment();
+  y->parent = parent;
+  y->left_child = TreeClone(x->left_child, y);
+  y->right_child = TreeClone(x->right_child, y);
+  return y;
+}
 
-template <typename ValueT, typename CompT>
-class RBTree {
- private:
-  using RBTreeNodeT = RBTreeNode<ValueT>;
+// Same as TreeClone, but left subtrees of top depth levels are copied by
+// new threads, so up to 2^depth threads are working at the same time.
+template <typename ValueT, typename DataT>
+RBTreeNode<ValueT, DataT>* TreeParallelClone(const RBTreeNode<ValueT, DataT>* x,
+                                             RBTreeNode<ValueT, DataT>* parent,
+                                             int depth) {
+  if (depth <= 0 || is_null(x)) {
+    return TreeClone(x, parent);
+  }
+  RBTreeNode<ValueT, DataT>* y = new RBTreeNode<ValueT, DataT>(x->value_);
+  y->properties = x->properties & RBTreeNode<ValueT, DataT>::kBalanceMask;
+  y->augment() = x->augment();
+  y->parent = parent;
+  std::thread left_thread([x, y, depth]() {
+    y->left_child = TreeParallelClone(x->left_child, y, depth - 1);
+  });
+  y->right_child = TreeParallelClone(x->right_child, y, depth - 1);
+  left_thread.join();
+  return y;
+}
 
- public:
-  RBTree() : root_(nullptr), value_cmp_() {}
-  ~RBTree() { TreeFree(root_); }
+// Calls fn for values of subtree x in order, limited to [*from, *to) when
+// the bounds aren't null. walk is at x.
+template <typename ValueT, typename CompT, typename FuncT, typename DataT>
+void TreeVisit(const RBTreeNode<ValueT, DataT>* x, const ValueT* from,
+               const ValueT* to, const CompT& cmp, FuncT& fn,
+               const OffsetWalk<const RBTreeNode<ValueT, DataT>>& x_walk =
+                   OffsetWalk<const RBTreeNode<ValueT, DataT>>()) {
+  OffsetWalk<const RBTreeNode<ValueT, DataT>> walk = x_walk;
+  while (!is_null(x)) {
+    auto&& value = walk.Value(x);
+    walk.Down(x);
+    const bool after_from = is_null(from) || !cmp(value, *from);
+    const bool before_to = is_null(to) || cmp(value, *to);
+    if (after_from) {
+      TreeVisit(x->left_child, from, to, cmp, fn, walk);
+    }
+    if (after_from && before_to) {
+      fn(value);
+    }
+    if (!before_to) {
+      return;
+    }
+    x = x->right_child;
+  }
+}
 
-  using value_type = ValueT;
+// Runs task(i) for each i in [0, num_tasks) on num_threads threads, the
+// calling one included. Every thread starts with a contiguous share of
+// tasks and takes them from its front, then steals from the back of shares
+// of other threads. Used for tasks of very different sizes.
+template <typename TaskT>
+void RunWorkStealing(size_t num_tasks, unsigned num_threads, TaskT& task) {
+  struct Share {
+    std::mutex mutex;
+    size_t front;
+    size_t back;
+    char padding[64];  // keeps shares of threads in separate cache lines
+  };
+  std::vector<Share> shares(num_threads);
+  for (unsigned i = 0; i < num_threads; ++i) {
+    shares[i].front = num_tasks * i / num_threads;
+    shares[i].back = num_tasks * (i + 1) / num_threads;
+  }
+  auto worker = [&](unsigned self) {
+    while (true) {
+      size_t next = num_tasks;
+      {
+        std::lock_guard<std::mutex> lock(shares[self].mutex);
+        if (shares[self].front < shares[self].back) {
+          next = shares[self].front++;
+        }
+      }
+      for (unsigned i = 1; i < num_threads && next == num_tasks; ++i) {
+        Share& victim = shares[(self + i) % num_threads];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.front < victim.back) {
+          next = --victim.back;
+        }
+      }
+      // Tasks don't spawn new ones, so all shares empty means done.
+      if (next == num_tasks) {
+        return;
+      }
+      task(next);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_threads; ++i) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
 
-  // Inner class that describes a const_iterator and 'regular' iterator at the
-  // same time, depending
-  // on the bool template parameter (default: true - a const_iterator)
-  template <bool is_const_iterator = true>
-  class const_noconst_iterator
-      : public std::iterator<std::bidirectional_iterator_tag, ValueT> {
-   private:
-    using RBTreeT = typename std::conditional<is_const_iterator, const RBTree*, RBTree*>::type;
-    RBTreeT tree_;
-    const_noconst_iterator(RBTreeT tree) : tree_(tree), node_(nullptr) {}
-   public:
-    // For const_iterator:   define DataStructurePointerType to be a
-    // const MyDataStructure*
-    // For regular iterator: define DataStructurePointerType to be a
-    // MyDataStructure*
-    using DataStructurePointerType = typename std::conditional<
-        is_const_iterator, const RBTreeNodeT*, RBTreeNodeT*>::type;
+// Serialization helpers used by RBTree::SaveTo and RBTree::LoadFrom.
 
-    // For const_iterator:   define ValueReferenceType to be a
-    // const ValueType&
-    // For regular iterator: define ValueReferenceType to be a ValueType&
-    using ValueReferenceType = typename std::conditional<
-        is_const_iterator, const ValueT&, ValueT&>::type;
+// Stream format version, bump on any incompatible change.
+constexpr uint32_t kStreamMagic = 0x424c5254;  // "TRLB"
+constexpr uint32_t kStreamVersion = 1;
 
-    // Regular constructor: set up your iterator.
-    const_noconst_iterator(RBTreeT tree, DataStructurePointerType node_)
-        : tree_(tree), node_(node_) {}
+inline uint64_t Fnv1a(uint64_t hash, const char* data, std::streamsize n) {
+  for (std::streamsize i = 0; i < n; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
 
-    const_noconst_iterator() : tree_(nullptr), node_(nullptr) {}
+// Unbuffered streambuf which forwards all bytes to/from another streambuf
+// and computes FNV-1a checksum of everything that went through it.
+class ChecksumStreamBuf : public std::streambuf {
+ public:
+  explicit ChecksumStreamBuf(std::streambuf* src)
+      : src_(src), hash_(14695981039346656037ULL), bytes_(0) {}
 
-    // Copy constructor. Allows for implicit conversion from a regular iterator
-    // to a const_iterator
-    const_noconst_iterator(const const_noconst_iterator<false>& other)
-        : tree_(other.tree_), node_(other.node_) {}
+  uint64_t hash() const { return hash_; }
+  uint64_t bytes() const { return bytes_; }
 
-    bool operator==(const const_noconst_iterator& other) const {
-      return node_ == other.node_;
+ protected:
+  int_type overflow(int_type c) override {
+    if (traits_type::eq_int_type(c, traits_type::eof())) {
+      return traits_type::not_eof(c);
     }
+    const char ch = traits_type::to_char_type(c);
+    hash_ = Fnv1a(hash_, &ch, 1);
+    ++bytes_;
+    return src_->sputc(ch);
+  }
 
-    bool operator!=(const const_noconst_iterator& other) const {
-      return !(*this == other);
-    }
+  std::streamsize xsputn(const char* s, std::streamsize n) override {
+    const std::streamsize written = src_->sputn(s, n);
+    hash_ = Fnv1a(hash_, s, written);
+    bytes_ += written;
+    return written;
+  }
 
-    // Dereference operator
-    ValueReferenceType operator*() { return node_->value_; }
+  int_type underflow() override { return src_->sgetc(); }
 
-    const_noconst_iterator& operator--() {
-      node_ = is_null(node_) ? trilib::TreeMaximum(tree_->root_)
-                             : trilib::TreePredecessor<ValueT, is_const_iterator>(node_);
-      return *this;
+  int_type uflow() override {
+    const int_type c = src_->sbumpc();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      const char ch = traits_type::to_char_type(c);
+      hash_ = Fnv1a(hash_, &ch, 1);
+      ++bytes_;
     }
+    return c;
+  }
 
-    const_noconst_iterator operator--(int) {
-      // Use operator--()
-      const const_noconst_iterator old(*this);
-      --(*this);
-      return old;
-    }
+  std::streamsize xsgetn(char* s, std::streamsize n) override {
+    const std::streamsize got = src_->sgetn(s, n);
+    hash_ = Fnv1a(hash_, s, got);
+    bytes_ += got;
+    return got;
+  }
 
-    const_noconst_iterator& operator++() {
-      node_ = trilib::TreeSuccessor<ValueT, is_const_iterator>(node_);
-      return *this;
-    }
+  int sync() override { return src_->pubsync(); }
 
-    const_noconst_iterator operator++(int) {
-      // Use operator++()
-      const const_noconst_iterator old(*this);
-      ++(*this);
-      return old;
-    }
+ private:
+  std::streambuf* src_;
+  uint64_t hash_;
+  uint64_t bytes_;
+};
 
-    // Make const_noconst_iterator<true> a friend class of
-    // const_noconst_iterator<false> so the copy constructor can access
-    // the private member variables.
-    friend class const_noconst_iterator<true>;
+// Buffered streambuf over a POSIX file descriptor. Doesn't own the fd.
+class FdStreamBuf : public std::streambuf {
+ public:
+  explicit FdStreamBuf(int fd) : fd_(fd) {
+    setg(buffer_, buffer_, buffer_);
+    setp(buffer_, buffer_ + kBufferSize);
+  }
 
-    // Make RBTree a friend class so iterator can be used for delete elements.
-    friend class RBTree;
+  ~FdStreamBuf() { sync(); }
 
-   private:
-    DataStructurePointerType node_;  // store a reference to MyDataStructure
+ protected:
+  int_type overflow(int_type c) override {
+    if (sync() != 0) {
+      return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
 
-  };  // end of nested class const_noconst_iterator
+  int sync() override {
+    const char* ptr = pbase();
+    while (ptr < pptr()) {
+      const ssize_t n = ::write(fd_, ptr, pptr() - ptr);
+      if (n <= 0) {
+        return -1;
+      }
+      ptr += n;
+    }
+    setp(buffer_, buffer_ + kBufferSize);
+    return 0;
+  }
 
-  // Shorthand for a regular iterator (non-const) type for MyDataStructure.
-  using iterator = const_noconst_iterator<false>;
+  int_type underflow() override {
+    if (gptr() < egptr()) {
+      return traits_type::to_int_type(*gptr());
+    }
+    const ssize_t n = ::read(fd_, buffer_, kBufferSize);
+    if (n <= 0) {
+      return traits_type::eof();
+    }
+    setg(buffer_, buffer_, buffer_ + n);
+    return traits_type::to_int_type(*gptr());
+  }
 
-  // Shorthand for a constant iterator (const_iterator) type for a
-  // MyDataStructure.
-  using const_iterator = const_noconst_iterator<true>;
+ private:
+  static constexpr int kBufferSize = 1 << 16;
+  int fd_;
+  char buffer_[kBufferSize];
+};
 
-  // STL like begin.
-  iterator begin() { return iterator(this, TreeMinimum(root_)); }
-  iterator end() { return iterator(this); }
+inline bool WriteU64(std::ostream& out, uint64_t value) {
+  char buf[8];
+  for (int i = 0; i < 8; ++i) {
+    buf[i] = static_cast<char>(value >> (8 * i));
+  }
+  return static_cast<bool>(out.write(buf, 8));
+}
 
-  const_iterator begin() const { return const_iterator(this, TreeMinimum(root_)); }
-  const_iterator end() const { return const_iterator(this); }
+inline bool ReadU64(std::istream& in, uint64_t* value) {
+  char buf[8];
+  if (!in.read(buf, 8)) {
+    return false;
+  }
+  *value = 0;
+  for (int i = 0; i < 8; ++i) {
+    *value |= static_cast<uint64_t>(static_cast<unsigned char>(buf[i]))
+              << (8 * i);
+  }
+  return true;
+}
 
-  void Insert(ValueT value) {
-    RBTreeNodeT* node = BinarySearchInsert(value);
-    node->SetColorRed();
+}  // namespace
 
+// Balancing policies of RBTree. A policy is called after a node got linked
+// into the tree (AfterInsert), after a node got unlinked (AfterUnlink) and
+// for every node of a tree built from sorted data (InitBuilt). It keeps its
+// data in balance bits of node properties and restructures the tree with
+// RBTree rotations, RBTree befriends it for that.
+//
+// AfterUnlink gets the node whose subtree on was_right side got shorter and
+// balance of the node removed from there.
+
+// Red-black tree: at most 2*log(n) deep, O(1) rotations per update.
+class RedBlackBalance {
+ public:
+  template <typename TreeT, typename NodeT>
+  void AfterInsert(TreeT* tree, NodeT* node) {
+    node->SetColorRed();
     while (true) {
       if (!node->HasParent()) {  // insert_case1
         node->SetColorBlack();
@@ -397,11 +773,11 @@ class RBTree {
       } else if (node->parent->IsColorBlack()) {  // insert_case2
         return;
       }
-      RBTreeNodeT* uncle = Uncle(node);  // insert_case3
+      NodeT* uncle = Uncle(node);  // insert_case3
       if (uncle != nullptr && uncle->IsColorRed()) {
         node->parent->SetColorBlack();
         uncle->SetColorBlack();
-        RBTreeNodeT* grandparent = GrandParent(node);
+        NodeT* grandparent = GrandParent(node);
         grandparent->SetColorRed();
         // insert_case1(g);
         // return;
@@ -409,110 +785,1916 @@ class RBTree {
         continue;
       } else {  // insert_case4
         if ((node->IsRightChild()) && node->parent->SafeIsLeftChild()) {
-          LeftRotate(node->parent);
+          tree->LeftRotate(node->parent);
           node = node->left_child;
         } else if (node->IsLeftChild() && node->parent->SafeIsRightChild()) {
-          RightRotate(node->parent);
+          tree->RightRotate(node->parent);
           node = node->right_child;
         }
         // insert_case5
-        RBTreeNodeT* grandparent = GrandParent(node);
+        NodeT* grandparent = GrandParent(node);
         node->parent->SetColorBlack();
         grandparent->SetColorRed();
         if (node->IsLeftChild()) {
-          RightRotate(grandparent);
+          tree->RightRotate(grandparent);
         } else {
-          LeftRotate(grandparent);
+          tree->LeftRotate(grandparent);
         }
         return;
       }
     }
   }
 
-  iterator LowerBound(const ValueT& val) {
-    return iterator(this, trilib::TreeLowerBound(val, root_, value_cmp_));
-  }
-
-  // Returns iterator to first element which fulfills condition value_cmp_(val,
-  // iter). If non of elements fulfills above condition returns end().
-  // If value_cmp_ is std::less, than: val < *iter.
-  // e.g. for RBTree with elems: { 0, 2, 4, 6, 8, 10 }
-  // LowerBound(5) = 6                      ^
-  const_iterator LowerBound(const ValueT& val) const {
-    return const_iterator(this, trilib::TreeLowerBound(val, root_, value_cmp_));
-  }
-
-  // Returns iterator to first element which fulfills condition value_cmp_(iter,
-  // val). If all elements fulfills above condition returns end().
-  // If value_cmp_ is std::less, than: *iter < val.
-  // e.g. for RBTree with elems: { 0, 2, 4, 6, 8, 10 }
-  // LowerBound(5) = 4                   ^
-  iterator UpperBound(const ValueT& val) {
-    return iterator(this, trilib::TreeUpperBound(val, root_, value_cmp_));
-  }
-
-  const_iterator UpperBound(const ValueT& val) const {
-    return const_iterator(this, trilib::TreeUpperBound(val, root_, value_cmp_));
-  }
-
-  const_iterator Search(const ValueT& value) const {
-    return const_iterator(this, trilib::TreeSearch(value, root_, value_cmp_));
-  }
-
-  // Returns iterator to element containing value. It's using operator= defined
-  // for a ValueT. If element not found returns end().
-  iterator Search(const ValueT& value) {
-    return iterator(this, trilib::TreeSearch(value, root_, value_cmp_));
-  }
-
-  bool HasValue(const ValueT& value) const { return !is_null(TreeSearch(value, root_, value_cmp_)); }
-
-  bool IsBinarySearchTree() const {
-    return is_null(root_) || CheckIsBinarySearchTree<ValueT, CompT>(
-                                 root_, nullptr, nullptr, value_cmp_);
+  template <typename TreeT, typename NodeT>
+  void AfterUnlink(TreeT* tree, NodeT* parent, bool was_right,
+                   unsigned int removed_balance) {
+    if (!is_null(tree->root_)) {
+      tree->root_->SetColorBlack();
+    }
+    if ((removed_balance & 1) && parent != nullptr) {
+      DeleteFixup(tree, parent, was_right);
+    }
   }
 
-  bool IsBlackProperty() const {
-    return is_null(root_) || (root_->IsColorBlack() && CheckBlackEquals(root_));
+  template <typename NodeT>
+  void InitBuilt(NodeT* node, int depth, int full_levels, int) const {
+    node->SetColor(depth < full_levels);
   }
 
-  bool IsRedHasTwoBlacks() const {
-    return is_null(root_) || CheckRedHasTwoBlackChildren(root_);
+  template <typename NodeT>
+  bool IsBalanced(const NodeT* root) const {
+    return is_null(root) ||
+           (root->IsColorBlack() && BlackToLeaves(root) >= 0 &&
+            CheckRedHasTwoBlackChildren(root));
   }
 
-  void Print() const {
-    TreePrint(root_);
-    std::cout << std::endl;
+  // Deferred work, none.
+  template <typename TreeT>
+  bool RunDeferred(TreeT*, size_t) {
+    return true;
   }
 
-  void Delete(const ValueT& value) { Delete(Search(value)); }
+  template <typename TreeT>
+  void AfterClone(TreeT*) {}
 
-  void Delete(iterator node) {
-    if (is_null(node.node_)) {
-      return;
+ private:
+  template <typename TreeT, typename NodeT>
+  NodeT* RightChildDeleteFixup(TreeT* tree, NodeT* x, bool* was_right) {
+    // black sibling and has red child
+    NodeT* sibling = x->left_child;
+    if (is_null(sibling)) {
+      return nullptr;  // ?
     }
-    RBTreeNodeT* z = node.node_;
-    RBTreeNodeT* y = z;
-    bool y_orig_is_black = y->IsColorBlack();
-    RBTreeNodeT* x = nullptr;
-    bool was_x_right = false;
-    if (!z->HasLeftChild()) {
-      x = z->parent;
+    if (sibling->IsColorRed()) {
+      tree->RightRotate(x);
+      x->SetColorRed();
+      sibling->SetColorBlack();
+      sibling = x->left_child;
+    }
+    if (sibling->HasLeftChild() && sibling->left_child->IsColorRed()) {
+      sibling->left_child->SetColorBlack();
+      sibling->SetColor(x->IsColorBlack());
+      x->SetColorBlack();
+      tree->RightRotate(x);
+      return nullptr;
+    } else if (sibling->HasRightChild() && sibling->right_child->IsColorRed()) {
+      sibling->right_child->SetColor(x->IsColorBlack());
+      x->SetColorBlack();
+      tree->LeftRotate(sibling);
+      tree->RightRotate(x);
+      return nullptr;
+    }
+    // we can assume that sibling is black
+    if (x->IsColorRed() && sibling->IsColorBlack()) {
+      x->SetColorBlack();
+      sibling->SetColorRed();
+      return nullptr;
+    } else if (sibling->IsColorBlack()) {
+      sibling->SetColorRed();
+      if (x->HasParent()) {
+        *was_right = x->IsRightChild();
+      }
+      x = x->parent;
+      return x;
+    }
+    // TODO decide what to do with unexpected cases assert ?
+    return nullptr;
+  }
+
+  template <typename TreeT, typename NodeT>
+  NodeT* LeftChildDeleteFixup(TreeT* tree, NodeT* x, bool* was_right) {
+    // black sibling and has red child
+    NodeT* sibling = x->right_child;
+    if (is_null(sibling)) {
+      return nullptr;  // ?
+    }
+    if (sibling->IsColorRed()) {
+      tree->LeftRotate(x);
+      x->SetColorRed();
+      sibling->SetColorBlack();
+      sibling = x->right_child;
+    }
+    if (sibling->HasRightChild() && sibling->right_child->IsColorRed()) {
+      sibling->right_child->SetColorBlack();
+      sibling->SetColor(x->IsColorBlack());
+      x->SetColorBlack();
+      tree->LeftRotate(x);
+      return nullptr;
+    } else if (sibling->HasLeftChild() && sibling->left_child->IsColorRed()) {
+      sibling->left_child->SetColor(x->IsColorBlack());
+      x->SetColorBlack();
+      tree->RightRotate(sibling);
+      tree->LeftRotate(x);
+      return nullptr;
+    }
+    // we can assume that sibling is black
+    if (x->IsColorRed() && sibling->IsColorBlack()) {
+      x->SetColorBlack();
+      sibling->SetColorRed();
+      return nullptr;
+    } else if (sibling->IsColorBlack()) {
+      sibling->SetColorRed();
+      if (x->HasParent()) {
+        *was_right = x->IsRightChild();
+      }
+      x = x->parent;
+      return x;
+    }
+    // TODO what to do?
+    return nullptr;
+  }
+
+  template <typename TreeT, typename NodeT>
+  void DeleteFixup(TreeT* tree, NodeT* x, bool was_right_child_removed) {
+    bool was_right_child = was_right_child_removed;
+    while (x != nullptr) {
+      if (!was_right_child) {
+        x = LeftChildDeleteFixup(tree, x, &was_right_child);
+      } else {
+        x = RightChildDeleteFixup(tree, x, &was_right_child);
+      }
+    }
+  }
+
+  template <typename NodeT>
+  static NodeT* GrandParent(NodeT* node) {
+    if ((node != nullptr) && (node->parent != nullptr)) {
+      return node->parent->parent;
+    } else {
+      return nullptr;
+    }
+  }
+
+  template <typename NodeT>
+  static NodeT* Uncle(NodeT* node) {
+    NodeT* g = GrandParent(node);
+    if (is_null(g)) {
+      return nullptr;                          // No grandparent means no uncle
+    } else if (node->parent->IsLeftChild()) {  // node->properties & kLeftChild
+      return g->right_child;
+    } else {
+      return g->left_child;
+    }
+  }
+};
+
+// AVL tree: subtree heights differ by at most one, so it's at most
+// 1.44*log(n) deep, which makes lookups cheaper. Updates may rotate all the
+// way up to the root. Balance bits keep height of a subtree.
+class AvlBalance {
+ public:
+  template <typename TreeT, typename NodeT>
+  void AfterInsert(TreeT* tree, NodeT* node) {
+    node->set_balance(1);
+    for (NodeT* x = node->parent; x != nullptr; x = x->parent) {
+      const unsigned int old_height = x->balance();
+      x = Rebalance(tree, x);
+      if (x->balance() == old_height) {
+        break;
+      }
+    }
+  }
+
+  template <typename TreeT, typename NodeT>
+  void AfterUnlink(TreeT* tree, NodeT* parent, bool, unsigned int) {
+    for (NodeT* x = parent; x != nullptr; x = x->parent) {
+      x = Rebalance(tree, x);
+    }
+  }
+
+  template <typename NodeT>
+  void InitBuilt(NodeT* node, int, int, int height) const {
+    node->set_balance(height);
+  }
+
+  template <typename NodeT>
+  bool IsBalanced(const NodeT* root) const {
+    return CheckHeights(root) >= 0;
+  }
+
+  // Deferred work, none.
+  template <typename TreeT>
+  bool RunDeferred(TreeT*, size_t) {
+    return true;
+  }
+
+  template <typename TreeT>
+  void AfterClone(TreeT*) {}
+
+ private:
+  template <typename NodeT>
+  static int Height(const NodeT* x) {
+    return is_null(x) ? 0 : x->balance();
+  }
+
+  template <typename NodeT>
+  static void UpdateHeight(NodeT* x) {
+    x->set_balance(1 + std::max(Height(x->left_child), Height(x->right_child)));
+  }
+
+  // Restores AVL property at x, whose children are AVL trees. Returns the
+  // root of the subtree.
+  template <typename TreeT, typename NodeT>
+  static NodeT* Rebalance(TreeT* tree, NodeT* x) {
+    const int diff = Height(x->left_child) - Height(x->right_child);
+    if (diff > 1) {
+      NodeT* y = x->left_child;
+      if (Height(y->left_child) < Height(y->right_child)) {
+        tree->LeftRotate(y);
+        UpdateHeight(y);
+      }
+      tree->RightRotate(x);
+    } else if (diff < -1) {
+      NodeT* y = x->right_child;
+      if (Height(y->right_child) < Height(y->left_child)) {
+        tree->RightRotate(y);
+        UpdateHeight(y);
+      }
+      tree->LeftRotate(x);
+    } else {
+      UpdateHeight(x);
+      return x;
+    }
+    UpdateHeight(x);
+    UpdateHeight(x->parent);
+    return x->parent;
+  }
+
+  template <typename NodeT>
+  static int CheckHeights(const NodeT* x) {
+    if (is_null(x)) {
+      return 0;
+    }
+    const int left = CheckHeights(x->left_child);
+    const int right = CheckHeights(x->right_child);
+    if (left < 0 || right < 0 || left - right > 1 || right - left > 1 ||
+        Height(x) != 1 + std::max(left, right)) {
+      return -1;
+    }
+    return Height(x);
+  }
+};
+
+// Weak AVL tree (Haeupler, Sen, Tarjan: Rank-balanced trees). Without
+// deletions it is an AVL tree, deletions take O(1) rotations like in
+// red-black tree, but the tree is never deeper than 2*log(n). Balance bits
+// keep the rank of a node, missing nodes have rank -1. Rank differences
+// between a node and its children are 1 or 2, leaves have rank 0.
+class WavlBalance {
+ public:
+  template <typename TreeT, typename NodeT>
+  void AfterInsert(TreeT* tree, NodeT* node) {
+    node->set_balance(0);
+    NodeT* x = node;
+    NodeT* p = x->parent;
+    while (p != nullptr && Rank(p) == Rank(x)) {
+      const bool is_left = p->left_child == x;
+      NodeT* sibling = is_left ? p->right_child : p->left_child;
+      if (Rank(p) - Rank(sibling) == 1) {
+        Promote(p);
+        x = p;
+        p = x->parent;
+        continue;
+      }
+      // x is a 0-child and its sibling is a 2-child.
+      NodeT* inner = is_left ? x->right_child : x->left_child;
+      if (Rank(x) - Rank(inner) == 2) {
+        Rotate(tree, p, is_left);
+        Demote(p);
+      } else {
+        Rotate(tree, x, !is_left);
+        Rotate(tree, p, is_left);
+        Promote(inner);
+        Demote(x);
+        Demote(p);
+      }
+      return;
+    }
+  }
+
+  template <typename TreeT, typename NodeT>
+  void AfterUnlink(TreeT* tree, NodeT* parent, bool was_right, unsigned int) {
+    NodeT* p = parent;
+    if (p == nullptr) {
+      return;
+    }
+    NodeT* x = was_right ? p->right_child : p->left_child;
+    bool is_left = !was_right;
+    if (is_null(p->left_child) && is_null(p->right_child) && Rank(p) == 1) {
+      // 2,2-leaf
+      Demote(p);
+      x = p;
+      p = x->parent;
+    }
+    while (p != nullptr && Rank(p) - Rank(x) == 3) {
+      if (!is_null(x)) {
+        is_left = p->left_child == x;
+      }
+      NodeT* sibling = is_left ? p->right_child : p->left_child;
+      if (Rank(p) - Rank(sibling) == 2) {
+        Demote(p);
+      } else if (Rank(sibling) - Rank(sibling->left_child) == 2 &&
+                 Rank(sibling) - Rank(sibling->right_child) == 2) {
+        Demote(p);
+        Demote(sibling);
+      } else {
+        NodeT* outer = is_left ? sibling->right_child : sibling->left_child;
+        NodeT* inner = is_left ? sibling->left_child : sibling->right_child;
+        if (Rank(sibling) - Rank(outer) == 1) {
+          Rotate(tree, p, !is_left);
+          Promote(sibling);
+          Demote(p);
+          if (is_null(p->left_child) && is_null(p->right_child)) {
+            Demote(p);
+          }
+        } else {
+          Rotate(tree, sibling, is_left);
+          Rotate(tree, p, !is_left);
+          Promote(inner);
+          Promote(inner);
+          Demote(sibling);
+          Demote(p);
+          Demote(p);
+        }
+        return;
+      }
+      x = p;
+      p = x->parent;
+    }
+  }
+
+  template <typename NodeT>
+  void InitBuilt(NodeT* node, int, int, int height) const {
+    node->set_balance(height - 1);
+  }
+
+  template <typename NodeT>
+  bool IsBalanced(const NodeT* root) const {
+    return CheckRanks(root);
+  }
+
+  // Deferred work, none.
+  template <typename TreeT>
+  bool RunDeferred(TreeT*, size_t) {
+    return true;
+  }
+
+  template <typename TreeT>
+  void AfterClone(TreeT*) {}
+
+ private:
+  template <typename NodeT>
+  static int Rank(const NodeT* x) {
+    return is_null(x) ? -1 : static_cast<int>(x->balance());
+  }
+
+  template <typename NodeT>
+  static void Promote(NodeT* x) {
+    x->set_balance(x->balance() + 1);
+  }
+
+  template <typename NodeT>
+  static void Demote(NodeT* x) {
+    x->set_balance(x->balance() - 1);
+  }
+
+  // Rotates x with its child, the left one if to_right.
+  template <typename TreeT, typename NodeT>
+  static void Rotate(TreeT* tree, NodeT* x, bool to_right) {
+    if (to_right) {
+      tree->RightRotate(x);
+    } else {
+      tree->LeftRotate(x);
+    }
+  }
+
+  template <typename NodeT>
+  static bool CheckRanks(const NodeT* x) {
+    if (is_null(x)) {
+      return true;
+    }
+    const int left = Rank(x) - Rank(x->left_child);
+    const int right = Rank(x) - Rank(x->right_child);
+    return (left == 1 || left == 2) && (right == 1 || right == 2) &&
+           (!is_null(x->left_child) || !is_null(x->right_child) ||
+            Rank(x) == 0) &&
+           CheckRanks(x->left_child) && CheckRanks(x->right_child);
+  }
+};
+
+// Red-black balancing with relaxed inserts: a new node is linked red and
+// a red-red violation it may cause is only recorded, to be repaired later
+// by RBTree::Rebalance, in bounded steps if needed. Only a third red in
+// a row is repaired right away, so with black heights always equal paths
+// are at most 1.5 times longer than in a red-black tree. Deletes repair
+// all violations first and then run the eager delete fixup.
+class RelaxedRedBlackBalance : public RedBlackBalance {
+ public:
+  template <typename TreeT, typename NodeT>
+  void AfterInsert(TreeT* tree, NodeT* node) {
+    node->SetColorRed();
+    if (!node->HasParent()) {
+      node->SetColorBlack();
+    } else if (node->parent->IsColorRed()) {
+      // A red parent isn't the root, so the grandparent exists.
+      if (node->parent->parent->IsColorRed()) {
+        Fix(tree, node);
+      } else {
+        pending_.push_back(node);
+      }
+    }
+  }
+
+  // Repairs up to max_fixes recorded violations, returns true if none are
+  // left.
+  template <typename TreeT>
+  bool RunDeferred(TreeT* tree, size_t max_fixes) {
+    using NodeT = typename std::remove_pointer<decltype(tree->root_)>::type;
+    for (; max_fixes > 0 && !pending_.empty(); --max_fixes) {
+      NodeT* node = static_cast<NodeT*>(pending_.back());
+      pending_.pop_back();
+      Fix(tree, node);
+    }
+    return pending_.empty();
+  }
+
+  // Copies don't share pending nodes, violations are found again.
+  template <typename TreeT>
+  void AfterClone(TreeT* tree) {
+    pending_.clear();
+    FindViolations(tree->root_);
+  }
+
+  size_t pending() const { return pending_.size(); }
+
+  // Black heights are equal, only recorded nodes may have a red parent.
+  template <typename NodeT>
+  bool IsBalanced(const NodeT* root) const {
+    std::vector<const void*> pending(pending_.begin(), pending_.end());
+    std::sort(pending.begin(), pending.end());
+    return is_null(root) || (root->IsColorBlack() && BlackToLeaves(root) >= 0 &&
+                             CheckRecorded(root, pending));
+  }
+
+ private:
+  // Repairs red-red violation between node and its parent, if it's still
+  // there. A violation above the parent is repaired first, so the standard
+  // insert fixup can rely on a black grandparent.
+  template <typename TreeT, typename NodeT>
+  void Fix(TreeT* tree, NodeT* node) {
+    while (node->HasParent() && node->IsColorRed() &&
+           node->parent->IsColorRed()) {
+      NodeT* parent = node->parent;
+      NodeT* grandparent = parent->parent;  // red parent isn't the root
+      if (grandparent->IsColorRed()) {
+        Fix(tree, parent);
+        continue;
+      }
+      NodeT* uncle = parent->IsLeftChild() ? grandparent->right_child
+                                           : grandparent->left_child;
+      if (!is_null(uncle) && uncle->IsColorRed()) {
+        parent->SetColorBlack();
+        uncle->SetColorBlack();
+        grandparent->SetColorRed();
+        node = grandparent;
+        continue;
+      }
+      if (node->IsRightChild() && parent->IsLeftChild()) {
+        tree->LeftRotate(parent);
+        std::swap(node, parent);
+      } else if (node->IsLeftChild() && parent->IsRightChild()) {
+        tree->RightRotate(parent);
+        std::swap(node, parent);
+      }
+      parent->SetColorBlack();
+      grandparent->SetColorRed();
+      if (node->IsLeftChild()) {
+        tree->RightRotate(grandparent);
+      } else {
+        tree->LeftRotate(grandparent);
+      }
+      // Red children of other pending nodes could have been moved below
+      // a red node.
+      RecordRedChildren(node);
+      RecordRedChildren(grandparent);
+      break;
+    }
+    tree->root_->SetColorBlack();
+  }
+
+  template <typename NodeT>
+  void RecordRedChildren(NodeT* node) {
+    if (!node->IsColorRed()) {
+      return;
+    }
+    for (NodeT* child : {node->left_child, node->right_child}) {
+      if (!is_null(child) && child->IsColorRed()) {
+        pending_.push_back(child);
+      }
+    }
+  }
+
+  template <typename NodeT>
+  void FindViolations(NodeT* x) {
+    if (is_null(x)) {
+      return;
+    }
+    RecordRedChildren(x);
+    FindViolations(x->left_child);
+    FindViolations(x->right_child);
+  }
+
+  template <typename NodeT>
+  static bool CheckRecorded(const NodeT* x,
+                            const std::vector<const void*>& pending) {
+    if (is_null(x)) {
+      return true;
+    }
+    for (const NodeT* child : {x->left_child, x->right_child}) {
+      if (!is_null(child) && x->IsColorRed() && child->IsColorRed() &&
+          !std::binary_search(pending.begin(), pending.end(), child)) {
+        return false;
+      }
+    }
+    return CheckRecorded(x->left_child, pending) &&
+           CheckRecorded(x->right_child, pending);
+  }
+
+  std::vector<void*> pending_;
+};
+
+struct LookupCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+
+  double hit_rate() const {
+    return hits + misses == 0 ? 0.0 : double(hits) / (hits + misses);
+  }
+};
+
+// Lookup cache policy of RBTree which caches nothing, Search always descends
+// from the root.
+class NoLookupCache {
+ public:
+  template <typename NodeT, typename ValueT, typename SearchT>
+  NodeT* Lookup(const ValueT&, SearchT search) {
+    return search();
+  }
+
+  template <typename NodeT>
+  void Invalidate(const NodeT*) {}
+
+  void Clear() {}
+
+  LookupCacheStats stats() const { return LookupCacheStats(); }
+};
+
+// Lookup cache policy of RBTree for skewed workloads. Maps recently found
+// values to their nodes in kSets sets of kWays entries each, hashed with
+// std::hash<ValueT> and replaced in LRU order within a set. kWays = 1 makes
+// it direct-mapped. Only hits are cached, so inserts don't touch it, and a
+// node is dropped from it before it leaves the tree.
+//
+//   trilib::RBTree<int64_t, std::less<int64_t>, trilib::RedBlackBalance,
+//                  trilib::LookupCache<256, 4>> tree;
+template <size_t kSets, size_t kWays = 1>
+class LookupCache {
+  static_assert(kSets > 0 && (kSets & (kSets - 1)) == 0,
+                "number of sets must be a power of two");
+  static_assert(kWays > 0, "at least one way is needed");
+
+ public:
+  LookupCache() : slots_(), stats_() {}
+
+  // Returns a cached node equal to value, or calls search and caches its
+  // result if it's not null.
+  template <typename NodeT, typename ValueT, typename SearchT>
+  NodeT* Lookup(const ValueT& value, SearchT search) {
+    const void** set = Set(value);
+    for (size_t way = 0; way < kWays && set[way] != nullptr; ++way) {
+      NodeT* node = static_cast<NodeT*>(const_cast<void*>(set[way]));
+      if (!(value != node->value_)) {
+        ++stats_.hits;
+        MoveToFront(set, way, node);
+        return node;
+      }
+    }
+    ++stats_.misses;
+    NodeT* node = search();
+    if (node != nullptr) {
+      MoveToFront(set, kWays - 1, node);
+    }
+    return node;
+  }
+
+  template <typename NodeT>
+  void Invalidate(const NodeT* node) {
+    const void** set = Set(node->value_);
+    for (size_t way = 0; way < kWays; ++way) {
+      if (set[way] == node) {
+        std::copy(set + way + 1, set + kWays, set + way);
+        set[kWays - 1] = nullptr;
+        return;
+      }
+    }
+  }
+
+  void Clear() { std::fill(slots_, slots_ + kSets * kWays, nullptr); }
+
+  LookupCacheStats stats() const { return stats_; }
+
+ private:
+  template <typename ValueT>
+  const void** Set(const ValueT& value) {
+    // std::hash of integers is usually identity, mix it before taking bits.
+    const uint64_t hash =
+        uint64_t(std::hash<ValueT>()(value)) * 0x9e3779b97f4a7c15ULL;
+    return slots_ + ((hash >> 32) & (kSets - 1)) * kWays;
+  }
+
+  // Puts node at the front of a set, shifting entries before way back.
+  static void MoveToFront(const void** set, size_t way, const void* node) {
+    std::copy_backward(set, set + way, set + way + 1);
+    set[0] = node;
+  }
+
+  const void* slots_[kSets * kWays];
+  LookupCacheStats stats_;
+};
+
+// Augmentation policy of RBTree which keeps no data in nodes.
+struct NoAugment {
+  using Data = NoAugmentData;
+  static const bool kEnabled = false;
+
+  template <typename NodeT>
+  static void Update(NodeT*) {}
+};
+
+// Augmentation policy of RBTree keeping the number of nodes of each subtree,
+// which makes RBTree::Select and RBTree::Rank O(log n). Every insert and
+// removal updates the path to the root, rotations update two nodes.
+//
+//   trilib::RBTree<int64_t, std::less<int64_t>, trilib::RedBlackBalance,
+//                  trilib::NoLookupCache, trilib::SubtreeSize> tree;
+struct SubtreeSize {
+  struct Data {
+    size_t subtree_size;
+  };
+  static const bool kEnabled = true;
+
+  // Recomputes data of x from its children.
+  template <typename NodeT>
+  static void Update(NodeT* x) {
+    x->augment().subtree_size = 1 + Size(x->left_child) + Size(x->right_child);
+  }
+
+  template <typename NodeT>
+  static size_t Size(const NodeT* x) {
+    return is_null(x) ? 0 : x->augment().subtree_size;
+  }
+};
+
+// Augmentation policy of RBTree keeping, on top of SubtreeSize, the sum of
+// hashes of values of each subtree. The sum doesn't depend on the shape of
+// the tree, so trees holding equal values have equal RBTree::RootHash, and
+// RBTree::Diff finds values two trees differ in by descending only into
+// key ranges whose sums differ. Sums are easy to collide on purpose, they
+// detect divergence of replicas, not tampering.
+struct SubtreeHash {
+  struct Data : SubtreeSize::Data {
+    uint64_t subtree_hash;
+  };
+  static const bool kEnabled = true;
+
+  // Rehashes the value of x, which is cheap for integers and short strings.
+  template <typename NodeT>
+  static void Update(NodeT* x) {
+    SubtreeSize::Update(x);
+    x->augment().subtree_hash =
+        Hash(x->left_child) + ValueHash(x->value_) + Hash(x->right_child);
+  }
+
+  template <typename NodeT>
+  static size_t Size(const NodeT* x) {
+    return SubtreeSize::Size(x);
+  }
+
+  template <typename NodeT>
+  static uint64_t Hash(const NodeT* x) {
+    return is_null(x) ? 0 : x->augment().subtree_hash;
+  }
+
+  // std::hash of an integer is usually the integer itself, so it's mixed to
+  // keep sums of few hashes from colliding.
+  template <typename ValueT>
+  static uint64_t ValueHash(const ValueT& value) {
+    uint64_t hash = std::hash<ValueT>()(value);
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+  }
+};
+
+// Augmentation policy of RBTree for arithmetic keys ordered by <, which
+// makes RBTree::ShiftFrom and RBTree::ShiftAll O(log n). A shift adds the
+// delta to the nodes on one search path and leaves it pending on subtrees
+// hanging off it, non-const descents push it further down as they pass.
+// Const lookups and const iterators don't write, they add up pending
+// offsets on their way instead, and const Search and HasValue skip the
+// lookup cache.
+//
+//   trilib::RBTree<int64_t, std::less<int64_t>, trilib::RedBlackBalance,
+//                  trilib::NoLookupCache, trilib::KeyOffset<int64_t>> tree;
+template <typename ValueT>
+struct KeyOffset {
+  static_assert(std::is_arithmetic<ValueT>::value,
+                "KeyOffset needs arithmetic values");
+  using Data = KeyOffsetData<ValueT>;
+  // Offsets are pushed by descents, there is nothing to recompute.
+  static const bool kEnabled = false;
+
+  template <typename NodeT>
+  static void Update(NodeT*) {}
+};
+
+// Default codec used by RBTree::SaveTo and RBTree::LoadFrom. It writes raw
+// object representation, so it's only valid for trivially copyable types
+// and the stream is portable only between machines with the same ABI.
+template <typename ValueT>
+struct PodCodec {
+  static_assert(std::is_trivially_copyable<ValueT>::value,
+                "PodCodec requires trivially copyable type, "
+                "provide your own codec");
+
+  static bool Write(std::ostream& out, const ValueT& value) {
+    return static_cast<bool>(
+        out.write(reinterpret_cast<const char*>(&value), sizeof(ValueT)));
+  }
+
+  static bool Read(std::istream& in, ValueT* value) {
+    return static_cast<bool>(
+        in.read(reinterpret_cast<char*>(value), sizeof(ValueT)));
+  }
+};
+
+// Codec for std::string, a length prefixed sequence of bytes. It is also an
+// example how to write a codec for non-trivial types.
+struct StringCodec {
+  static bool Write(std::ostream& out, const std::string& value) {
+    return WriteU64(out, value.size()) &&
+           out.write(value.data(), value.size());
+  }
+
+  static bool Read(std::istream& in, std::string* value) {
+    uint64_t size = 0;
+    if (!ReadU64(in, &size)) {
+      return false;
+    }
+    value->resize(size);
+    return size == 0 || static_cast<bool>(in.read(&(*value)[0], size));
+  }
+};
+
+// Order of nodes in memory after RBTree::Compact.
+enum class NodeLayout {
+  kInOrder,       // sorted order, best for iteration and range scans
+  kBreadthFirst,  // level by level, top levels share few cache lines
+  kVanEmdeBoas,   // recursive blocks of subtrees, cache-oblivious lookups
+};
+
+// Binary search tree of values ordered by CompT. Duplicates are allowed.
+// BalanceT selects how the tree is kept balanced, see RedBlackBalance,
+// AvlBalance and WavlBalance. CacheT may put a LookupCache in front of
+// Search and HasValue. AugmentT keeps extra data in nodes, see SubtreeSize.
+template <typename ValueT, typename CompT, typename BalanceT = RedBlackBalance,
+          typename CacheT = NoLookupCache, typename AugmentT = NoAugment>
+class RBTree {
+ private:
+  using AugmentDataT = typename AugmentT::Data;
+  using RBTreeNodeT = RBTreeNode<ValueT, AugmentDataT>;
+  // Nodes may hold pending offsets, see KeyOffset.
+  static constexpr bool kKeyOffsets =
+      std::is_same<AugmentDataT, KeyOffsetData<ValueT>>::value;
+
+  friend BalanceT;
+  // RelaxedRedBlackBalance reuses its delete fixup.
+  friend RedBlackBalance;
+
+ public:
+  RBTree()
+      : root_(nullptr), leftmost_(nullptr), rightmost_(nullptr), size_(0),
+        value_cmp_(), free_slots_(nullptr), compact_next_(0),
+        compact_slot_(0) {}
+  ~RBTree() { Clear(); }
+
+  // Copies the structure of other tree in O(n), without any comparisons.
+  RBTree(const RBTree& other)
+      : root_(TreeClone<ValueT, AugmentDataT>(other.root_, nullptr)),
+        leftmost_(nullptr),
+        rightmost_(nullptr),
+        size_(other.size_),
+        value_cmp_(other.value_cmp_),
+        free_slots_(nullptr),
+        compact_next_(0),
+        compact_slot_(0) {
+    ResetExtremes();
+    balance_.AfterClone(this);
+  }
+
+  RBTree(RBTree&& other)
+      : root_(nullptr), leftmost_(nullptr), rightmost_(nullptr), size_(0),
+        value_cmp_(other.value_cmp_), free_slots_(nullptr), compact_next_(0),
+        compact_slot_(0) {
+    Swap(other);
+  }
+
+  RBTree& operator=(const RBTree& other) {
+    if (this != &other) {
+      RBTree copy(other);
+      Swap(copy);
+    }
+    return *this;
+  }
+
+  RBTree& operator=(RBTree&& other) {
+    if (this != &other) {
+      Clear();
+      Swap(other);
+    }
+    return *this;
+  }
+
+  // Exchanges content of two trees. Comparators aren't swapped, they are
+  // expected to be stateless.
+  void Swap(RBTree& other) {
+    std::swap(root_, other.root_);
+    std::swap(leftmost_, other.leftmost_);
+    std::swap(rightmost_, other.rightmost_);
+    std::swap(size_, other.size_);
+    std::swap(balance_, other.balance_);
+    std::swap(cache_, other.cache_);
+    arenas_.swap(other.arenas_);
+    std::swap(free_slots_, other.free_slots_);
+    compact_order_.swap(other.compact_order_);
+    std::swap(compact_next_, other.compact_next_);
+    std::swap(compact_slot_, other.compact_slot_);
+  }
+
+  // Returns a copy of the tree made by up to num_threads threads, each of them
+  // copying a different subtree. Worth it only for big trees.
+  RBTree Clone(unsigned num_threads = 1) const {
+    int depth = 0;
+    while ((2u << depth) <= num_threads) {
+      ++depth;
+    }
+    RBTree copy;
+    copy.root_ =
+        TreeParallelClone<ValueT, AugmentDataT>(root_, nullptr, depth);
+    copy.size_ = size_;
+    copy.ResetExtremes();
+    copy.balance_.AfterClone(&copy);
+    return copy;
+  }
+
+  using value_type = ValueT;
+
+  // Owns a node extracted from a tree. It can be inserted back to the same or
+  // another tree of this type without any allocation.
+  class node_type {
+   public:
+    node_type() : node_(nullptr) {}
+    node_type(node_type&& other) : node_(other.node_) { other.node_ = nullptr; }
+    ~node_type() { delete node_; }
+
+    node_type& operator=(node_type&& other) {
+      if (this != &other) {
+        delete node_;
+        node_ = other.node_;
+        other.node_ = nullptr;
+      }
+      return *this;
+    }
+
+    bool empty() const { return is_null(node_); }
+    explicit operator bool() const { return !empty(); }
+
+    // Value can be changed before the node is inserted again.
+    ValueT& value() const { return node_->value_; }
+
+   private:
+    explicit node_type(RBTreeNodeT* node) : node_(node) {}
+
+    RBTreeNodeT* node_;
+
+    friend class RBTree;
+  };
+
+  // Inner class that describes a const_iterator and 'regular' iterator at the
+  // same time, depending
+  // on the bool template parameter (default: true - a const_iterator)
+  template <bool is_const_iterator = true>
+  class const_noconst_iterator
+      : public std::iterator<std::bidirectional_iterator_tag, ValueT>,
+        // Empty unless a const_iterator needs to add up offsets.
+        private OffsetWalk<typename std::conditional<
+            is_const_iterator, const RBTreeNodeT, RBTreeNodeT>::type> {
+   private:
+    using RBTreeT = typename std::conditional<is_const_iterator, const RBTree*, RBTree*>::type;
+    RBTreeT tree_;
+    const_noconst_iterator(RBTreeT tree) : tree_(tree), node_(nullptr) {}
+   public:
+    // For const_iterator:   define DataStructurePointerType to be a
+    // const MyDataStructure*
+    // For regular iterator: define DataStructurePointerType to be a
+    // MyDataStructure*
+    using DataStructurePointerType = typename std::conditional<
+        is_const_iterator, const RBTreeNodeT*, RBTreeNodeT*>::type;
+
+    // For const_iterator:   define ValueReferenceType to be a
+    // const ValueType&
+    // For regular iterator: define ValueReferenceType to be a ValueType&
+    using ValueReferenceType = typename std::conditional<
+        is_const_iterator, const ValueT&, ValueT&>::type;
+
+    // Regular constructor: set up your iterator.
+    const_noconst_iterator(RBTreeT tree, DataStructurePointerType node_)
+        : tree_(tree), node_(node_) {
+      this->Start(node_);
+    }
+
+    const_noconst_iterator() : tree_(nullptr), node_(nullptr) {}
+
+    // Copy constructor. Allows for implicit conversion from a regular iterator
+    // to a const_iterator
+    const_noconst_iterator(const const_noconst_iterator<false>& other)
+        : tree_(other.tree_), node_(other.node_) {
+      this->Start(node_);
+    }
+
+    bool operator==(const const_noconst_iterator& other) const {
+      return node_ == other.node_;
+    }
+
+    bool operator!=(const const_noconst_iterator& other) const {
+      return !(*this == other);
+    }
+
+    // Dereference operator
+    ValueReferenceType operator*() { return this->Value(node_); }
+
+    const_noconst_iterator& operator--() {
+      if (is_null(node_)) {
+        node_ = tree_->rightmost_;
+        this->Start(node_);
+      } else {
+        node_ = trilib::TreePredecessor(node_, Walk());
+      }
+      return *this;
+    }
+
+    const_noconst_iterator operator--(int) {
+      // Use operator--()
+      const const_noconst_iterator old(*this);
+      --(*this);
+      return old;
+    }
+
+    const_noconst_iterator& operator++() {
+      node_ = trilib::TreeSuccessor(node_, Walk());
+      return *this;
+    }
+
+    const_noconst_iterator operator++(int) {
+      // Use operator++()
+      const const_noconst_iterator old(*this);
+      ++(*this);
+      return old;
+    }
+
+    // Make const_noconst_iterator<true> a friend class of
+    // const_noconst_iterator<false> so the copy constructor can access
+    // the private member variables.
+    friend class const_noconst_iterator<true>;
+
+    // Make RBTree a friend class so iterator can be used for delete elements.
+    friend class RBTree;
+
+   private:
+    using WalkT = OffsetWalk<typename std::remove_pointer<
+        DataStructurePointerType>::type>;
+
+    WalkT* Walk() { return this; }
+
+    DataStructurePointerType node_;  // store a reference to MyDataStructure
+
+  };  // end of nested class const_noconst_iterator
+
+  // Shorthand for a regular iterator (non-const) type for MyDataStructure.
+  using iterator = const_noconst_iterator<false>;
+
+  // Shorthand for a constant iterator (const_iterator) type for a
+  // MyDataStructure.
+  using const_iterator = const_noconst_iterator<true>;
+
+  // STL like begin.
+  iterator begin() { return iterator(this, leftmost_); }
+  iterator end() { return iterator(this); }
+
+  const_iterator begin() const { return const_iterator(this, leftmost_); }
+  const_iterator end() const { return const_iterator(this); }
+
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  // Removes all elements.
+  void Clear() {
+    if (arenas_.empty()) {
+      TreeFree(root_);
+    } else {
+      DestroySubtree(root_);
+    }
+    for (size_t i = compact_next_; i < compact_order_.size(); ++i) {
+      if (compact_order_[i]->properties & RBTreeNodeT::kDeleted) {
+        DestroyNode(compact_order_[i]);
+      }
+    }
+    compact_order_.clear();
+    compact_order_.shrink_to_fit();
+    for (RBTreeNodeT* arena : arenas_) {
+      ::operator delete(arena);
+    }
+    arenas_.clear();
+    free_slots_ = nullptr;
+    root_ = nullptr;
+    leftmost_ = nullptr;
+    rightmost_ = nullptr;
+    size_ = 0;
+    balance_ = BalanceT();
+    cache_.Clear();
+  }
+
+  iterator Insert(ValueT value) {
+    RBTreeNodeT* node = NewNode(std::move(value));
+    InsertNode(node);
+    return iterator(this, node);
+  }
+
+  // Changes value of an element, reusing its node. If the new value still
+  // fits between the neighbours, it's written in place in O(1). Otherwise
+  // the node is unlinked and inserted again, descending only from the
+  // lowest ancestor of a former neighbour that bounds the new value, so
+  // small moves stay cheap. Returns iterator to the element, others stay
+  // valid.
+  iterator UpdateKey(iterator iter, ValueT value) {
+    RBTreeNodeT* node = iter.node_;
+    PushPath(node);
+    RBTreeNodeT* prev = trilib::TreePredecessor(node);
+    RBTreeNodeT* next = trilib::TreeSuccessor(node);
+    const bool after_prev =
+        is_null(prev) || !value_cmp_(value, prev->value_);
+    const bool before_next =
+        is_null(next) || !value_cmp_(next->value_, value);
+    if (after_prev && before_next) {
+      cache_.Invalidate(node);
+      node->value_ = std::move(value);
+      UpdatePath(node);
+      return iter;
+    }
+    Unlink(node);
+    node->value_ = std::move(value);
+    // The neighbour on the side the value moves to stays in the tree.
+    RBTreeNodeT* from = after_prev ? next : prev;
+    InsertNode(node, FingerRoot(node->value_, from, value_cmp_));
+    return iter;
+  }
+
+  // Smallest and largest values in O(1), the tree must not be empty.
+  const ValueT& Min() const { return leftmost_->value_; }
+  const ValueT& Max() const { return rightmost_->value_; }
+
+  // Removes the smallest (largest) value and returns it moved out of the
+  // node, the tree must not be empty. Together with Min and Insert this
+  // makes the tree a priority queue which also allows iteration and
+  // deletion of arbitrary elements.
+  ValueT PopMin() { return PopNode(leftmost_); }
+  ValueT PopMax() { return PopNode(rightmost_); }
+
+  // Adds delta to all values not smaller than key, without moving nodes.
+  // Needs the KeyOffset augmentation, then it's O(log n), plus O(log n) for
+  // each value in [key + delta, key) when delta is negative: those would be
+  // overtaken, so they are taken out and inserted again. Search, bounds and
+  // iteration see shifted values. Iterators stay valid, but one taken before
+  // a shift may read the old value until a lookup passes its node again.
+  // Only non-const lookups finish shifts in nodes they pass, const ones add
+  // pending offsets up without writing, so they can run concurrently.
+  void ShiftFrom(const ValueT& key, ValueT delta) {
+    static_assert(std::is_same<AugmentT, KeyOffset<ValueT>>::value,
+                  "ShiftFrom needs the KeyOffset augmentation");
+    std::vector<RBTreeNodeT*> overtaken;
+    if (delta < ValueT()) {
+      RBTreeNodeT* x =
+          trilib::TreeUpperBound(ValueT(key + delta), root_, value_cmp_);
+      x = is_null(x) ? leftmost_ : trilib::TreeSuccessor(x);
+      for (; !is_null(x) && value_cmp_(x->value_, key);
+           x = trilib::TreeSuccessor(x)) {
+        overtaken.push_back(x);
+      }
+      for (RBTreeNodeT* node : overtaken) {
+        Unlink(node);
+      }
+    }
+    RBTreeNodeT* x = root_;
+    while (!is_null(x)) {
+      PushDown(x);
+      if (value_cmp_(x->value_, key)) {
+        x = x->right_child;
+      } else {
+        x->value_ += delta;
+        AddOffset(x->right_child, delta);
+        x = x->left_child;
+      }
+    }
+    FinishShift();
+    for (RBTreeNodeT* node : overtaken) {
+      InsertNode(node);
+    }
+  }
+
+  // Adds delta to all values in O(log n), see ShiftFrom.
+  void ShiftAll(ValueT delta) {
+    static_assert(std::is_same<AugmentT, KeyOffset<ValueT>>::value,
+                  "ShiftAll needs the KeyOffset augmentation");
+    AddOffset(root_, delta);
+    FinishShift();
+  }
+
+  // Returns iterator to the k-th smallest element counting from 0, end() if
+  // k >= size(). Needs the SubtreeSize augmentation, then it's O(log n).
+  iterator Select(size_t k) { return iterator(this, SelectNode(k)); }
+  const_iterator Select(size_t k) const {
+    return const_iterator(this, SelectNode(k));
+  }
+
+  // Returns the number of elements smaller than value. Needs the SubtreeSize
+  // augmentation, then it's O(log n).
+  size_t Rank(const ValueT& value) const {
+    size_t rank = 0;
+    const RBTreeNodeT* x = root_;
+    while (!is_null(x)) {
+      if (value_cmp_(x->value_, value)) {
+        rank += AugmentT::Size(x->left_child) + 1;
+        x = x->right_child;
+      } else {
+        x = x->left_child;
+      }
+    }
+    return rank;
+  }
+
+  // Sum of hashes of all values in O(1), equal for trees holding equal
+  // values whatever their shape. Needs the SubtreeHash augmentation.
+  uint64_t RootHash() const { return AugmentT::Hash(root_); }
+
+  // Calls fn(value, true) for each value of this tree missing in other and
+  // fn(value, false) for each value of other missing in this one, in
+  // ascending order. Extra copies of duplicates count as missing. Ranges of
+  // values are split in halves only while their hashes differ, so it takes
+  // O(d log^2 n) for d differences. Needs the SubtreeHash augmentation.
+  // Returns the number of differences.
+  template <typename FuncT>
+  size_t Diff(const RBTree& other, FuncT fn) const {
+    const HashedPrefix none = {0, 0};
+    return DiffRange(other, nullptr, nullptr, none, PrefixHash(nullptr),
+                     none, other.PrefixHash(nullptr), fn);
+  }
+
+  // Inserts a node extracted from this or another tree, nothing is allocated
+  // or copied. Returns end() for an empty handle.
+  iterator Insert(node_type&& handle) {
+    RBTreeNodeT* node = handle.node_;
+    if (is_null(node)) {
+      return end();
+    }
+    handle.node_ = nullptr;
+    InsertNode(node);
+    return iterator(this, node);
+  }
+
+  // Unlinks a node from the tree and passes its ownership to the returned
+  // handle. Returns an empty handle for end(). Nodes placed by Compact are
+  // part of a bigger block, their value is moved to a new node instead.
+  node_type Extract(iterator iter) {
+    RBTreeNodeT* node = iter.node_;
+    if (is_null(node)) {
+      return node_type();
+    }
+    Unlink(node);
+    if (node->properties &
+        (RBTreeNodeT::kInArena | RBTreeNodeT::kPendingMove)) {
+      RBTreeNodeT* copy = new RBTreeNodeT(std::move(node->value_));
+      FreeNode(node);
+      node = copy;
+    }
+    return node_type(node);
+  }
+
+  node_type Extract(const ValueT& value) { return Extract(Search(value)); }
+
+  // Moves all nodes of other tree into this one, without allocation or
+  // copying values. The other tree is left empty.
+  void Merge(RBTree& other) {
+    if (this == &other) {
+      return;
+    }
+    FinishCompaction();
+    other.FinishCompaction();
+    // Blocks of compacted nodes come along with the nodes.
+    arenas_.insert(arenas_.end(), other.arenas_.begin(), other.arenas_.end());
+    other.arenas_.clear();
+    while (!is_null(other.free_slots_)) {
+      RBTreeNodeT* slot = other.free_slots_;
+      other.free_slots_ = NextFreeSlot(slot);
+      PushFreeSlot(slot);
+    }
+    RBTreeNodeT* other_root = other.root_;
+    other.root_ = nullptr;
+    other.leftmost_ = nullptr;
+    other.rightmost_ = nullptr;
+    other.size_ = 0;
+    other.balance_ = BalanceT();
+    other.cache_.Clear();
+    MergeSubtree(other_root);
+  }
+
+  iterator LowerBound(const ValueT& val) {
+    return iterator(this, trilib::TreeLowerBound(val, root_, value_cmp_));
+  }
+
+  // Returns iterator to first element which fulfills condition value_cmp_(val,
+  // iter). If non of elements fulfills above condition returns end().
+  // If value_cmp_ is std::less, than: val < *iter.
+  // e.g. for RBTree with elems: { 0, 2, 4, 6, 8, 10 }
+  // LowerBound(5) = 6                      ^
+  const_iterator LowerBound(const ValueT& val) const {
+    return const_iterator(this,
+                          trilib::TreeLowerBound(val, ConstRoot(), value_cmp_));
+  }
+
+  // Returns iterator to first element which fulfills condition value_cmp_(iter,
+  // val). If all elements fulfills above condition returns end().
+  // If value_cmp_ is std::less, than: *iter < val.
+  // e.g. for RBTree with elems: { 0, 2, 4, 6, 8, 10 }
+  // LowerBound(5) = 4                   ^
+  iterator UpperBound(const ValueT& val) {
+    return iterator(this, trilib::TreeUpperBound(val, root_, value_cmp_));
+  }
+
+  const_iterator UpperBound(const ValueT& val) const {
+    return const_iterator(this,
+                          trilib::TreeUpperBound(val, ConstRoot(), value_cmp_));
+  }
+
+  const_iterator Search(const ValueT& value) const {
+    return const_iterator(this, ConstSearch(value));
+  }
+
+  // Returns iterator to element containing value. It's using operator= defined
+  // for a ValueT. If element not found returns end().
+  iterator Search(const ValueT& value) {
+    return iterator(this, CachedSearch(value));
+  }
+
+  bool HasValue(const ValueT& value) const {
+    return !is_null(ConstSearch(value));
+  }
+
+  // Finger search: like Search, but starts from the node of iterator from
+  // and climbs only as high as needed, so a lookup close to the previous
+  // result costs O(log d) for distance d instead of O(log n). Meant for
+  // cursors and merge joins probing in sorted order. from may be end().
+  iterator Search(const_iterator from, const ValueT& value) {
+    RBTreeNodeT* node = const_cast<RBTreeNodeT*>(from.node_);
+    if (!is_null(node)) {
+      PushPath(node);
+    }
+    return iterator(this, is_null(node)
+                              ? trilib::TreeSearch(value, root_, value_cmp_)
+                              : TreeFingerSearch(value, node, value_cmp_));
+  }
+
+  // With pending offsets it starts at the root, the climb would have to
+  // write them down.
+  const_iterator Search(const_iterator from, const ValueT& value) const {
+    if (kKeyOffsets) {
+      return Search(value);
+    }
+    return const_cast<RBTree*>(this)->Search(from, value);
+  }
+
+  // LowerBound starting from the node of iterator from, see finger Search.
+  iterator LowerBound(const_iterator from, const ValueT& value) {
+    RBTreeNodeT* node = const_cast<RBTreeNodeT*>(from.node_);
+    if (!is_null(node)) {
+      PushPath(node);
+    }
+    return iterator(this,
+                    is_null(node)
+                        ? trilib::TreeLowerBound(value, root_, value_cmp_)
+                        : TreeFingerLowerBound(value, node, value_cmp_));
+  }
+
+  const_iterator LowerBound(const_iterator from, const ValueT& value) const {
+    if (kKeyOffsets) {
+      return LowerBound(value);
+    }
+    return const_cast<RBTree*>(this)->LowerBound(from, value);
+  }
+
+  // Calls fn(value) for every value from up to num_threads threads, 0 means
+  // one per core. The tree is split at subtree roots into tasks balanced by
+  // work stealing. Calls come in no particular order and fn must be safe to
+  // run concurrently. The tree must not be modified meanwhile.
+  template <typename FuncT>
+  void ParallelForEach(FuncT fn, unsigned num_threads = 0) const {
+    ParallelVisit(nullptr, nullptr, fn, num_threads);
+  }
+
+  // ParallelForEach limited to values in [from, to).
+  template <typename FuncT>
+  void ParallelForEach(const ValueT& from, const ValueT& to, FuncT fn,
+                       unsigned num_threads = 0) const {
+    ParallelVisit(&from, &to, fn, num_threads);
+  }
+
+  // Returns combine(...combine(combine(identity, map(v1)), map(v2))...,
+  // map(vn)) over values in order, computed in parallel like
+  // ParallelForEach. combine must be associative, but it doesn't have to be
+  // commutative: partial results are always combined in order.
+  template <typename ResultT, typename MapT, typename CombineT>
+  ResultT ParallelReduce(ResultT identity, MapT map, CombineT combine,
+                         unsigned num_threads = 0) const {
+    return ParallelFold(nullptr, nullptr, std::move(identity), map, combine,
+                        num_threads);
+  }
+
+  // ParallelReduce limited to values in [from, to).
+  template <typename ResultT, typename MapT, typename CombineT>
+  ResultT ParallelReduce(const ValueT& from, const ValueT& to,
+                         ResultT identity, MapT map, CombineT combine,
+                         unsigned num_threads = 0) const {
+    return ParallelFold(&from, &to, std::move(identity), map, combine,
+                        num_threads);
+  }
+
+  // Hits and misses of the lookup cache, all zero for NoLookupCache.
+  LookupCacheStats cache_stats() const { return cache_.stats(); }
+
+  bool IsBinarySearchTree() const {
+    return is_null(root_) ||
+           CheckIsBinarySearchTree<ValueT, CompT, AugmentDataT>(
+               ConstRoot(), nullptr, nullptr, value_cmp_,
+               OffsetWalk<const RBTreeNodeT>());
+  }
+
+  // Runs up to max_fixes steps of rebalancing deferred by the balancing
+  // policy, see RelaxedRedBlackBalance. Returns true if nothing is left.
+  bool Rebalance(size_t max_fixes = SIZE_MAX) {
+    return balance_.RunDeferred(this, max_fixes);
+  }
+
+  // Checks invariants of the balancing policy.
+  bool IsBalanced() const { return balance_.IsBalanced(root_); }
+
+  bool IsBlackProperty() const {
+    return is_null(root_) || (root_->IsColorBlack() && CheckBlackEquals(root_));
+  }
+
+  bool IsRedHasTwoBlacks() const {
+    return is_null(root_) || CheckRedHasTwoBlackChildren(root_);
+  }
+
+  void Print() const {
+    TreePrint(root_);
+    std::cout << std::endl;
+  }
+
+  void Delete(const ValueT& value) { Delete(Search(value)); }
+
+  void Delete(iterator node) {
+    if (is_null(node.node_)) {
+      return;
+    }
+    Unlink(node.node_);
+    FreeNode(node.node_);
+  }
+
+  // Moves all nodes into a single contiguous block in the given layout.
+  // Links are fixed in place, values are moved and never compared. Moved
+  // nodes get new addresses, so iterators pointing to them are invalidated,
+  // like those of std::vector on reallocation.
+  void Compact(NodeLayout layout = NodeLayout::kInOrder) {
+    StartCompaction(layout);
+    FinishCompaction();
+  }
+
+  // Incremental version of Compact. StartCompaction allocates the block and
+  // records order of the current nodes in a single O(n) pass without
+  // modifying the tree, then each CompactStep moves at most max_nodes of
+  // them. The tree may be used and modified between steps: deleted nodes
+  // are skipped, inserted ones stay where they are. Each step invalidates
+  // iterators, they have to be looked up again by value.
+  void StartCompaction(NodeLayout layout) {
+    FinishCompaction();
+    if (is_null(root_)) {
+      return;
+    }
+    compact_order_.reserve(size_);
+    switch (layout) {
+      case NodeLayout::kInOrder:
+        for (RBTreeNodeT* x = TreeMinimum(root_); !is_null(x);
+             x = trilib::TreeSuccessor(x)) {
+          compact_order_.push_back(x);
+        }
+        break;
+      case NodeLayout::kBreadthFirst:
+        compact_order_.push_back(root_);
+        for (size_t i = 0; i < compact_order_.size(); ++i) {
+          RBTreeNodeT* x = compact_order_[i];
+          if (x->HasLeftChild()) {
+            compact_order_.push_back(x->left_child);
+          }
+          if (x->HasRightChild()) {
+            compact_order_.push_back(x->right_child);
+          }
+        }
+        break;
+      case NodeLayout::kVanEmdeBoas:
+        VanEmdeBoasOrder(root_, TreeHeight(root_), &compact_order_);
+        break;
+    }
+    for (RBTreeNodeT* x : compact_order_) {
+      x->properties |= RBTreeNodeT::kPendingMove;
+    }
+    arenas_.push_back(static_cast<RBTreeNodeT*>(
+        ::operator new(compact_order_.size() * sizeof(RBTreeNodeT))));
+    compact_next_ = 0;
+    compact_slot_ = 0;
+    // Free slots are in old blocks, which are released at the end.
+    free_slots_ = nullptr;
+  }
+
+  // Returns true when there is nothing more to move.
+  bool CompactStep(size_t max_nodes) {
+    if (compact_order_.empty()) {
+      return true;
+    }
+    // Deferred fixes may point to nodes which are going to be moved.
+    Rebalance();
+    const size_t left = compact_order_.size() - compact_next_;
+    const size_t end = compact_next_ + std::min(max_nodes, left);
+    for (; compact_next_ < end; ++compact_next_) {
+      RBTreeNodeT* x = compact_order_[compact_next_];
+      if (x->properties & RBTreeNodeT::kDeleted) {
+        DestroyNode(x);
+      } else {
+        Relocate(x, arenas_.back() + compact_slot_++);
+      }
+    }
+    if (compact_next_ < compact_order_.size()) {
+      return false;
+    }
+    for (size_t i = 0; i + 1 < arenas_.size(); ++i) {
+      ::operator delete(arenas_[i]);
+    }
+    arenas_.erase(arenas_.begin(), arenas_.end() - 1);
+    // Slots of nodes deleted meanwhile.
+    for (size_t i = compact_slot_; i < compact_order_.size(); ++i) {
+      PushFreeSlot(arenas_.back() + i);
+    }
+    compact_order_.clear();
+    compact_order_.shrink_to_fit();
+    return true;
+  }
+
+  bool compacting() const { return !compact_order_.empty(); }
+
+  // Writes the tree to a stream: a versioned header, the values in order
+  // encoded with CodecT and a checksum of all the above. Returns false if
+  // the stream failed.
+  template <typename CodecT = PodCodec<ValueT>>
+  bool SaveTo(std::ostream& out) const {
+    ChecksumStreamBuf checksum_buf(out.rdbuf());
+    std::ostream sum_out(&checksum_buf);
+    if (!WriteU64(sum_out, (uint64_t(kStreamVersion) << 32) | kStreamMagic) ||
+        !WriteU64(sum_out, size_)) {
+      return false;
+    }
+    for (const_iterator iter = begin(); iter != end(); ++iter) {
+      if (!CodecT::Write(sum_out, *iter)) {
+        return false;
+      }
+    }
+    return WriteU64(out, checksum_buf.hash()) && out.flush();
+  }
+
+  template <typename CodecT = PodCodec<ValueT>>
+  bool SaveTo(int fd) const {
+    FdStreamBuf fd_buf(fd);
+    std::ostream out(&fd_buf);
+    return SaveTo<CodecT>(out);
+  }
+
+  // Replaces content of the tree with one written by SaveTo. The tree is
+  // built in linear time directly from the sorted stream, no rebalancing
+  // is done and only a single value is held in memory besides the nodes.
+  // On error (bad header, unordered values, checksum mismatch) the tree is
+  // left empty and false is returned.
+  template <typename CodecT = PodCodec<ValueT>>
+  bool LoadFrom(std::istream& in) {
+    Clear();
+    ChecksumStreamBuf checksum_buf(in.rdbuf());
+    std::istream sum_in(&checksum_buf);
+    uint64_t magic = 0;
+    uint64_t size = 0;
+    if (!ReadU64(sum_in, &magic) ||
+        magic != ((uint64_t(kStreamVersion) << 32) | kStreamMagic) ||
+        !ReadU64(sum_in, &size)) {
+      return false;
+    }
+    int full_levels = 0;
+    while ((uint64_t(2) << full_levels) - 1 <= size) {
+      ++full_levels;
+    }
+    SortedLoader<CodecT> loader(&sum_in, value_cmp_, &balance_, full_levels);
+    int height = 0;
+    root_ = loader.Build(size, 0, &height);
+    uint64_t checksum = 0;
+    if (loader.failed || !ReadU64(in, &checksum) ||
+        checksum != checksum_buf.hash()) {
+      TreeFree(root_);
+      root_ = nullptr;
+      return false;
+    }
+    size_ = size;
+    ResetExtremes();
+    return true;
+  }
+
+  // Reading is buffered, so the fd position may end up past the tree data.
+  template <typename CodecT = PodCodec<ValueT>>
+  bool LoadFrom(int fd) {
+    FdStreamBuf fd_buf(fd);
+    std::istream in(&fd_buf);
+    return LoadFrom<CodecT>(in);
+  }
+
+ private:
+  void InsertNode(RBTreeNodeT* node) { InsertNode(node, root_); }
+
+  void InsertNode(RBTreeNodeT* node, RBTreeNodeT* start) {
+    BinarySearchInsert(node, start);
+    UpdatePath(node);
+    // Equal values go right, so a new minimum must be strictly smaller.
+    if (is_null(leftmost_) || value_cmp_(node->value_, leftmost_->value_)) {
+      leftmost_ = node;
+    }
+    if (is_null(rightmost_) || !value_cmp_(node->value_, rightmost_->value_)) {
+      rightmost_ = node;
+    }
+    ++size_;
+    balance_.AfterInsert(this, node);
+  }
+
+  // Part of the tree visited by a single task of parallel algorithms, either
+  // a whole subtree or just its root.
+  struct Segment {
+    const RBTreeNodeT* node;
+    bool subtree;
+    OffsetWalk<const RBTreeNodeT> walk;  // at node
+  };
+
+  // Splits values of subtree x within [*from, *to) into ordered segments,
+  // subtrees at depth levels below x become whole segments.
+  void SplitSegments(const RBTreeNodeT* x, int depth, const ValueT* from,
+                     const ValueT* to, std::vector<Segment>* segments,
+                     OffsetWalk<const RBTreeNodeT> walk =
+                         OffsetWalk<const RBTreeNodeT>()) const {
+    while (!is_null(x)) {
+      if (!is_null(from) && value_cmp_(walk.Value(x), *from)) {
+        walk.Down(x);
+        x = x->right_child;
+      } else if (!is_null(to) && !value_cmp_(walk.Value(x), *to)) {
+        walk.Down(x);
+        x = x->left_child;
+      } else if (depth == 0) {
+        segments->push_back(Segment{x, true, walk});
+        return;
+      } else {
+        const OffsetWalk<const RBTreeNodeT> at_x = walk;
+        walk.Down(x);
+        SplitSegments(x->left_child, depth - 1, from, to, segments, walk);
+        segments->push_back(Segment{x, false, at_x});
+        x = x->right_child;
+        --depth;
+      }
+    }
+  }
+
+  // Splits the tree into segments for num_threads threads, 0 is replaced
+  // by the number of cores.
+  std::vector<Segment> Segments(const ValueT* from, const ValueT* to,
+                                unsigned* num_threads) const {
+    if (*num_threads == 0) {
+      *num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // Many more segments than threads, so stealing can even them out.
+    int depth = 0;
+    while (*num_threads > 1 && (1u << depth) < 8 * *num_threads) {
+      ++depth;
+    }
+    std::vector<Segment> segments;
+    SplitSegments(ConstRoot(), depth, from, to, &segments);
+    return segments;
+  }
+
+  template <typename FuncT>
+  void VisitSegment(const Segment& segment, const ValueT* from,
+                    const ValueT* to, FuncT& fn) const {
+    OffsetWalk<const RBTreeNodeT> walk = segment.walk;
+    if (segment.subtree) {
+      TreeVisit(segment.node, from, to, value_cmp_, fn, walk);
+    } else {
+      fn(walk.Value(segment.node));
+    }
+  }
+
+  template <typename FuncT>
+  void ParallelVisit(const ValueT* from, const ValueT* to, FuncT& fn,
+                     unsigned num_threads) const {
+    const std::vector<Segment> segments = Segments(from, to, &num_threads);
+    auto task = [&](size_t i) { VisitSegment(segments[i], from, to, fn); };
+    RunWorkStealing(segments.size(), num_threads, task);
+  }
+
+  template <typename ResultT, typename MapT, typename CombineT>
+  ResultT ParallelFold(const ValueT* from, const ValueT* to, ResultT identity,
+                       MapT& map, CombineT& combine,
+                       unsigned num_threads) const {
+    const std::vector<Segment> segments = Segments(from, to, &num_threads);
+    // Wrapped, so that std::vector<bool> can't pack results of different
+    // threads into the same word.
+    struct Partial {
+      ResultT value;
+    };
+    std::vector<Partial> partials(segments.size(), Partial{identity});
+    auto task = [&](size_t i) {
+      ResultT acc = identity;
+      auto fold = [&](const ValueT& value) {
+        acc = combine(std::move(acc), map(value));
+      };
+      VisitSegment(segments[i], from, to, fold);
+      partials[i].value = std::move(acc);
+    };
+    RunWorkStealing(segments.size(), num_threads, task);
+    for (Partial& partial : partials) {
+      identity = combine(std::move(identity), std::move(partial.value));
+    }
+    return identity;
+  }
+
+  ValueT PopNode(RBTreeNodeT* node) {
+    // Unlink first, the lookup cache hashes the value.
+    Unlink(node);
+    ValueT value(std::move(node->value_));
+    FreeNode(node);
+    return value;
+  }
+
+  // Allocates a node, in a free slot of a compacted block if there is one.
+  RBTreeNodeT* NewNode(ValueT value) {
+    if (is_null(free_slots_)) {
+      return new RBTreeNodeT(std::move(value));
+    }
+    RBTreeNodeT* slot = free_slots_;
+    free_slots_ = NextFreeSlot(slot);
+    RBTreeNodeT* node = new (slot) RBTreeNodeT(std::move(value));
+    node->properties = RBTreeNodeT::kInArena;
+    return node;
+  }
+
+  // Frees a node unlinked from the tree. A node still waiting to be moved
+  // by CompactStep is only marked, the step frees it.
+  void FreeNode(RBTreeNodeT* node) {
+    if (node->properties & RBTreeNodeT::kPendingMove) {
+      node->properties |= RBTreeNodeT::kDeleted;
+    } else if (node->properties & RBTreeNodeT::kInArena) {
+      node->~RBTreeNodeT();
+      PushFreeSlot(node);
+    } else {
+      delete node;
+    }
+  }
+
+  // Destroys a node, memory of those in a block is released with the block.
+  static void DestroyNode(RBTreeNodeT* node) {
+    if (node->properties & RBTreeNodeT::kInArena) {
+      node->~RBTreeNodeT();
+    } else {
+      delete node;
+    }
+  }
+
+  static void DestroySubtree(RBTreeNodeT* x) {
+    if (is_null(x)) {
+      return;
+    }
+    DestroySubtree(x->left_child);
+    DestroySubtree(x->right_child);
+    DestroyNode(x);
+  }
+
+  // Free slots are linked through their first bytes.
+  static RBTreeNodeT* NextFreeSlot(RBTreeNodeT* slot) {
+    return *reinterpret_cast<RBTreeNodeT**>(slot);
+  }
+
+  void PushFreeSlot(RBTreeNodeT* slot) {
+    *reinterpret_cast<RBTreeNodeT**>(slot) = free_slots_;
+    free_slots_ = slot;
+  }
+
+  void FinishCompaction() { CompactStep(compact_order_.size()); }
+
+  // Moves node x to slot and points its neighbours to the new place.
+  void Relocate(RBTreeNodeT* x, RBTreeNodeT* slot) {
+    cache_.Invalidate(x);
+    RBTreeNodeT* node = new (slot) RBTreeNodeT(std::move(x->value_));
+    node->properties = (x->properties & ~RBTreeNodeT::kPendingMove) |
+                       RBTreeNodeT::kInArena;
+    node->augment() = x->augment();
+    node->parent = x->parent;
+    node->left_child = x->left_child;
+    node->right_child = x->right_child;
+    if (!x->HasParent()) {
+      root_ = node;
+    } else if (x->IsLeftChild()) {
+      x->parent->left_child = node;
+    } else {
+      x->parent->right_child = node;
+    }
+    if (x->HasLeftChild()) {
+      x->left_child->parent = node;
+    }
+    if (x->HasRightChild()) {
+      x->right_child->parent = node;
+    }
+    if (x == leftmost_) {
+      leftmost_ = node;
+    }
+    if (x == rightmost_) {
+      rightmost_ = node;
+    }
+    DestroyNode(x);
+  }
+
+  // Adds delta to the value of x and leaves it pending for its subtree.
+  static void AddOffset(RBTreeNodeT* x, const ValueT& delta) {
+    if (!is_null(x)) {
+      x->value_ += delta;
+      x->augment().offset += delta;
+    }
+  }
+
+  // Pushes offsets off the paths to the extremes, so that Min, Max, begin()
+  // and --end() read exact values without a descent. Cached lookups may
+  // land below pending offsets, they are dropped.
+  void FinishShift() {
+    for (RBTreeNodeT* x = root_; !is_null(x); x = x->left_child) {
+      PushDown(x);
+    }
+    for (RBTreeNodeT* x = root_; !is_null(x); x = x->right_child) {
+      PushDown(x);
+    }
+    cache_.Clear();
+  }
+
+  void ResetExtremes() {
+    leftmost_ = is_null(root_) ? nullptr : TreeMinimum(root_);
+    rightmost_ = is_null(root_) ? nullptr : TreeMaximum(root_);
+  }
+
+  static int TreeHeight(const RBTreeNodeT* x) {
+    return is_null(x) ? 0
+                      : 1 + std::max(TreeHeight(x->left_child),
+                                     TreeHeight(x->right_child));
+  }
+
+  // Lays out the top half of levels of subtree x, then each subtree hanging
+  // below them, recursively. Only height levels below x are visited.
+  static void VanEmdeBoasOrder(RBTreeNodeT* x, int height,
+                               std::vector<RBTreeNodeT*>* order) {
+    if (is_null(x)) {
+      return;
+    }
+    if (height == 1) {
+      order->push_back(x);
+      return;
+    }
+    const int top = height / 2;
+    VanEmdeBoasOrder(x, top, order);
+    std::vector<RBTreeNodeT*> bottoms;
+    CollectLevel(x, top, &bottoms);
+    for (RBTreeNodeT* bottom : bottoms) {
+      VanEmdeBoasOrder(bottom, height - top, order);
+    }
+  }
+
+  static void CollectLevel(RBTreeNodeT* x, int depth,
+                           std::vector<RBTreeNodeT*>* level) {
+    if (is_null(x)) {
+      return;
+    }
+    if (depth == 0) {
+      level->push_back(x);
+      return;
+    }
+    CollectLevel(x->left_child, depth - 1, level);
+    CollectLevel(x->right_child, depth - 1, level);
+  }
+
+  // Lookups update the cache, so even const ones aren't safe to run
+  // concurrently when CacheT isn't NoLookupCache.
+  RBTreeNodeT* CachedSearch(const ValueT& value) const {
+    return cache_.template Lookup<RBTreeNodeT>(value, [&]() {
+      return trilib::TreeSearch(value, root_, value_cmp_);
+    });
+  }
+
+  // Search of const methods. With pending offsets it bypasses the cache,
+  // found nodes may hold values without offsets of their ancestors.
+  const RBTreeNodeT* ConstSearch(const ValueT& value) const {
+    if (kKeyOffsets) {
+      return trilib::TreeSearch(value, ConstRoot(), value_cmp_);
+    }
+    return CachedSearch(value);
+  }
+
+  // Walks from the const root never write to nodes.
+  const RBTreeNodeT* ConstRoot() const { return root_; }
+
+  // Removes z from the tree and rebalances it, z itself is left detached.
+  void Unlink(RBTreeNodeT* z) {
+    Rebalance();
+    cache_.Invalidate(z);
+    // z may come from an iterator, values around it must be exact before
+    // nodes move.
+    PushPath(z);
+    // Extremes have at most one child, so their neighbour is at most a step
+    // or two away and the removal itself is the simple case below.
+    if (z == leftmost_) {
+      leftmost_ = trilib::TreeSuccessor(z);
+    }
+    if (z == rightmost_) {
+      rightmost_ = trilib::TreePredecessor(z);
+    }
+    RBTreeNodeT* y = z;
+    unsigned int y_orig_balance = y->balance();
+    RBTreeNodeT* x = nullptr;
+    bool was_x_right = false;
+    if (!z->HasLeftChild()) {
+      x = z->parent;
       was_x_right = z->SafeIsRightChild();
       Transplant(z, z->right_child);
-      if (!is_null(root_)) {
-        root_->SetColorBlack();
-      }
     } else if (!z->HasRightChild()) {
       x = z->parent;
       was_x_right = z->SafeIsRightChild();
       Transplant(z, z->left_child);
-      if (!is_null(root_)) {
-        root_->SetColorBlack();
-      }
     } else {                            // z has both parents
       y = TreeMinimum(z->right_child);  // minimum never has left_child
-      y_orig_is_black = y->IsColorBlack();
+      PushDown(y);
+      y_orig_balance = y->balance();
       if (y != z->right_child) {
         x = y->parent;
         Transplant(y, y->right_child);
@@ -525,109 +2707,77 @@ class RBTree {
       Transplant(z, y);
       y->left_child = z->left_child;  // we know z has left child, and y doesn't
       y->left_child->parent = y;
-      y->SetColor(z->IsColorBlack());
-    }
-    delete z;
-    if (y_orig_is_black && x != nullptr) {
-      DeleteFixup(x, was_x_right);
+      y->set_balance(z->balance());
     }
+    z->parent = nullptr;
+    z->left_child = nullptr;
+    z->right_child = nullptr;
+    --size_;
+    UpdatePath(x);
+    balance_.AfterUnlink(this, x, was_x_right, y_orig_balance);
   }
 
- private:
-  RBTreeNodeT* RightChildDeleteFixup(RBTreeNodeT* x, bool* was_right) {
-    // black sibling and has red child
-    RBTreeNodeT* sibling = x->left_child;
-    if (is_null(sibling)) {
-      return nullptr;  // ?
-    }
-    if (sibling->IsColorRed()) {
-      RightRotate(x);
-      x->SetColorRed();
-      sibling->SetColorBlack();
-      sibling = x->left_child;
-    }
-    if (sibling->HasLeftChild() && sibling->left_child->IsColorRed()) {
-      sibling->left_child->SetColorBlack();
-      sibling->SetColor(x->IsColorBlack());
-      x->SetColorBlack();
-      RightRotate(x);
-      return nullptr;
-    } else if (sibling->HasRightChild() && sibling->right_child->IsColorRed()) {
-      sibling->right_child->SetColor(x->IsColorBlack());
-      x->SetColorBlack();
-      LeftRotate(sibling);
-      RightRotate(x);
-      return nullptr;
-    }
-    // we can assume that sibling is black
-    if (x->IsColorRed() && sibling->IsColorBlack()) {
-      x->SetColorBlack();
-      sibling->SetColorRed();
-      return nullptr;
-    } else if (sibling->IsColorBlack()) {
-      sibling->SetColorRed();
-      if (x->HasParent()) {
-        *was_right = x->IsRightChild();
-      }
-      x = x->parent;
-      return x;
+  // Detaches all nodes of a subtree (not linked from any tree) and inserts
+  // them into this tree.
+  void MergeSubtree(RBTreeNodeT* x) {
+    if (is_null(x)) {
+      return;
     }
-    // TODO decide what to do with unexpected cases assert ?
-    return nullptr;
+    PushDown(x);
+    MergeSubtree(x->left_child);
+    MergeSubtree(x->right_child);
+    x->parent = nullptr;
+    x->left_child = nullptr;
+    x->right_child = nullptr;
+    InsertNode(x);
   }
 
-  RBTreeNodeT* LeftChildDeleteFixup(RBTreeNodeT* x, bool* was_right) {
-    // black sibling and has red child
-    RBTreeNodeT* sibling = x->right_child;
-    if (is_null(sibling)) {
-      return nullptr;  // ?
-    }
-    if (sibling->IsColorRed()) {
-      LeftRotate(x);
-      x->SetColorRed();
-      sibling->SetColorBlack();
-      sibling = x->right_child;
-    }
-    if (sibling->HasRightChild() && sibling->right_child->IsColorRed()) {
-      sibling->right_child->SetColorBlack();
-      sibling->SetColor(x->IsColorBlack());
-      x->SetColorBlack();
-      LeftRotate(x);
-      return nullptr;
-    } else if (sibling->HasLeftChild() && sibling->left_child->IsColorRed()) {
-      sibling->left_child->SetColor(x->IsColorBlack());
-      x->SetColorBlack();
-      RightRotate(sibling);
-      LeftRotate(x);
-      return nullptr;
-    }
-    // we can assume that sibling is black
-    if (x->IsColorRed() && sibling->IsColorBlack()) {
-      x->SetColorBlack();
-      sibling->SetColorRed();
-      return nullptr;
-    } else if (sibling->IsColorBlack()) {
-      sibling->SetColorRed();
-      if (x->HasParent()) {
-        *was_right = x->IsRightChild();
+  // Builds a balanced tree from a sorted stream of values. All levels but
+  // the last are full, so the result is valid for any balancing policy.
+  template <typename CodecT>
+  struct SortedLoader {
+    SortedLoader(std::istream* in, const CompT& cmp, BalanceT* balance,
+                 int full_levels)
+        : in(in), cmp(cmp), balance(balance), full_levels(full_levels),
+          prev(nullptr), failed(false) {}
+
+    RBTreeNodeT* Build(uint64_t size, int depth, int* height) {
+      *height = 0;
+      if (size == 0 || failed) {
+        return nullptr;
       }
-      x = x->parent;
-      return x;
-    }
-    // TODO what to do?
-    return nullptr;
-  }
-
-  void DeleteFixup(RBTreeNodeT* x, bool was_right_child_removed) {
-    bool was_right_child = was_right_child_removed;
-    while (x != nullptr) {
-      if (!was_right_child) {
-        x = LeftChildDeleteFixup(x, &was_right_child);
-      } else {
-        x = RightChildDeleteFixup(x, &was_right_child);
+      const uint64_t left_size = (size - 1) / 2;
+      int left_height = 0;
+      int right_height = 0;
+      RBTreeNodeT* left = Build(left_size, depth + 1, &left_height);
+      RBTreeNodeT* node = new RBTreeNodeT();
+      node->left_child = left;
+      if (!is_null(left)) {
+        left->parent = node;
       }
+      if (failed || !CodecT::Read(*in, &node->value_) ||
+          (!is_null(prev) && cmp(node->value_, prev->value_))) {
+        failed = true;
+        return node;
+      }
+      prev = node;
+      node->right_child = Build(size - 1 - left_size, depth + 1, &right_height);
+      if (!is_null(node->right_child)) {
+        node->right_child->parent = node;
+      }
+      *height = 1 + std::max(left_height, right_height);
+      AugmentT::Update(node);
+      balance->InitBuilt(node, depth, full_levels, *height);
+      return node;
     }
-  }
+
+    std::istream* in;
+    const CompT& cmp;
+    BalanceT* balance;
+    const int full_levels;
+    RBTreeNodeT* prev;
+    bool failed;
+  };
 
   // Replaces subtree rooted at u with subtree rooted at v.
   // v can be nullptr.
@@ -652,27 +2802,144 @@ class RBTree {
     return trilib::TreeSuccessor(x);
   }
 
-  RBTreeNodeT* GrandParent(RBTreeNodeT* node) {
-    if ((node != nullptr) && (node->parent != nullptr)) {
-      return node->parent->parent;
-    } else {
-      return nullptr;
+  // Number of values before a bound and the sum of their hashes.
+  struct HashedPrefix {
+    size_t size;
+    uint64_t hash;
+  };
+
+  // Values smaller than *bound, all of them if bound is null.
+  HashedPrefix PrefixHash(const ValueT* bound) const {
+    HashedPrefix prefix = {AugmentT::Size(root_), AugmentT::Hash(root_)};
+    if (is_null(bound)) {
+      return prefix;
     }
+    prefix = HashedPrefix{0, 0};
+    const RBTreeNodeT* x = root_;
+    while (!is_null(x)) {
+      if (value_cmp_(x->value_, *bound)) {
+        prefix.size += AugmentT::Size(x->left_child) + 1;
+        prefix.hash += AugmentT::Hash(x->left_child) +
+                       AugmentT::ValueHash(x->value_);
+        x = x->right_child;
+      } else {
+        x = x->left_child;
+      }
+    }
+    return prefix;
   }
 
-  RBTreeNodeT* Uncle(RBTreeNodeT* node) {
-    RBTreeNodeT* g = GrandParent(node);
-    if (is_null(g)) {
-      return nullptr;                          // No grandparent means no uncle
-    } else if (node->parent->IsLeftChild()) {  // node->properties & kLeftChild
-      return g->right_child;
-    } else {
-      return g->left_child;
+  // Diffs values within [*from, *to), prefixes of both trees at both bounds
+  // are given. Splits the range at the middle value of the tree having more
+  // of them, both halves have fewer values of that tree.
+  template <typename FuncT>
+  size_t DiffRange(const RBTree& other, const ValueT* from, const ValueT* to,
+                   const HashedPrefix& from_this, const HashedPrefix& to_this,
+                   const HashedPrefix& from_other,
+                   const HashedPrefix& to_other, FuncT& fn) const {
+    const size_t size_this = to_this.size - from_this.size;
+    const size_t size_other = to_other.size - from_other.size;
+    if (size_this == size_other &&
+        to_this.hash - from_this.hash == to_other.hash - from_other.hash) {
+      return 0;
+    }
+    constexpr size_t kMergeSize = 16;
+    const RBTree& larger = size_this >= size_other ? *this : other;
+    const size_t larger_from =
+        size_this >= size_other ? from_this.size : from_other.size;
+    const RBTreeNodeT* middle = nullptr;
+    if (size_this > 0 && size_other > 0 &&
+        size_this + size_other > kMergeSize) {
+      middle = larger.SelectNode(
+          larger_from + std::max(size_this, size_other) / 2);
+      const ValueT& first = larger.SelectNode(larger_from)->value_;
+      if (!value_cmp_(first, middle->value_)) {
+        // The first half are duplicates, split after all of them.
+        middle = trilib::TreeLowerBound(first, larger.root_, value_cmp_);
+        if (!is_null(middle) && !is_null(to) &&
+            !value_cmp_(middle->value_, *to)) {
+          middle = nullptr;
+        }
+      }
+    }
+    if (is_null(middle)) {
+      return MergeDiff(other, from, to, fn);
+    }
+    const ValueT& pivot = middle->value_;
+    const HashedPrefix pivot_this = PrefixHash(&pivot);
+    const HashedPrefix pivot_other = other.PrefixHash(&pivot);
+    return DiffRange(other, from, &pivot, from_this, pivot_this, from_other,
+                     pivot_other, fn) +
+           DiffRange(other, &pivot, to, pivot_this, to_this, pivot_other,
+                     to_other, fn);
+  }
+
+  // Diffs values within [*from, *to) by merging them.
+  template <typename FuncT>
+  size_t MergeDiff(const RBTree& other, const ValueT* from, const ValueT* to,
+                   FuncT& fn) const {
+    std::vector<const ValueT*> values_this;
+    std::vector<const ValueT*> values_other;
+    auto collect_this = [&values_this](const ValueT& value) {
+      values_this.push_back(&value);
+    };
+    auto collect_other = [&values_other](const ValueT& value) {
+      values_other.push_back(&value);
+    };
+    TreeVisit(root_, from, to, value_cmp_, collect_this);
+    TreeVisit(other.root_, from, to, value_cmp_, collect_other);
+    size_t diffs = 0;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < values_this.size() || j < values_other.size()) {
+      if (j == values_other.size() ||
+          (i < values_this.size() &&
+           value_cmp_(*values_this[i], *values_other[j]))) {
+        fn(*values_this[i++], true);
+        ++diffs;
+      } else if (i == values_this.size() ||
+                 value_cmp_(*values_other[j], *values_this[i])) {
+        fn(*values_other[j++], false);
+        ++diffs;
+      } else {
+        ++i;
+        ++j;
+      }
+    }
+    return diffs;
+  }
+
+  RBTreeNodeT* SelectNode(size_t k) const {
+    RBTreeNodeT* x = root_;
+    while (!is_null(x)) {
+      const size_t left = AugmentT::Size(x->left_child);
+      if (k == left) {
+        return x;
+      }
+      if (k < left) {
+        x = x->left_child;
+      } else {
+        k -= left + 1;
+        x = x->right_child;
+      }
+    }
+    return nullptr;
+  }
+
+  // Recomputes augmented data of x and all its ancestors.
+  void UpdatePath(RBTreeNodeT* x) {
+    if (!AugmentT::kEnabled) {
+      return;
+    }
+    for (; !is_null(x); x = x->parent) {
+      AugmentT::Update(x);
     }
   }
 
   void LeftRotate(RBTreeNodeT* x) {
     RBTreeNodeT* y = x->right_child;
+    PushDown(x);
+    PushDown(y);
     x->right_child = y->left_child;
     if (y->HasLeftChild()) {
       y->left_child->parent = x;
@@ -687,10 +2954,14 @@ class RBTree {
     }
     y->left_child = x;
     x->parent = y;
+    AugmentT::Update(x);
+    AugmentT::Update(y);
   }
 
   void RightRotate(RBTreeNodeT* x) {
     RBTreeNodeT* y = x->left_child;
+    PushDown(x);
+    PushDown(y);
     x->left_child = y->right_child;  // 1
     if (y->HasRightChild()) {
       y->right_child->parent = x;  // 2
@@ -705,39 +2976,56 @@ class RBTree {
     }
     y->right_child = x;  // 5
     x->parent = y;       // 6
+    AugmentT::Update(x);
+    AugmentT::Update(y);
   }
 
-  RBTreeNodeT* BinarySearchInsert(ValueT value) {
+  // Inserts node as a leaf of subtree ptr, which has to be the root or
+  // a subtree whose range of values includes value of node.
+  void BinarySearchInsert(RBTreeNodeT* node, RBTreeNodeT* ptr) {
     if (is_null(root_)) {
-      root_ = new RBTreeNodeT(value);
-      return root_;
+      root_ = node;
+      return;
     }
-    RBTreeNodeT* ptr = root_;
     while (true) {
       // DCHECK(ptr != nullptr);
-      if (value_cmp_(value, ptr->value_)) {
+      PushDown(ptr);
+      if (value_cmp_(node->value_, ptr->value_)) {
         if (ptr->HasLeftChild()) {
           ptr = ptr->left_child;
         } else {
-          ptr->left_child = new RBTreeNodeT(value);
-          ptr->left_child->parent = ptr;
-          return ptr->left_child;
+          ptr->left_child = node;
+          break;
         }
       } else {
         if (ptr->HasRightChild()) {
           ptr = ptr->right_child;
         } else {
-          ptr->right_child = new RBTreeNodeT(value);
-          ptr->right_child->parent = ptr;
-          return ptr->right_child;
+          ptr->right_child = node;
+          break;
         }
       }
     }
-    return nullptr;
+    node->parent = ptr;
   }
 
   RBTreeNodeT* root_;
+  // Cached TreeMinimum and TreeMaximum of root_, nullptr if empty.
+  RBTreeNodeT* leftmost_;
+  RBTreeNodeT* rightmost_;
+  size_t size_;
   const CompT value_cmp_;
+  BalanceT balance_;
+  mutable CacheT cache_;
+  // Blocks of nodes allocated by Compact, the last one is being filled
+  // while compacting(). Slots of nodes deleted from them are in free_slots_.
+  std::vector<RBTreeNodeT*> arenas_;
+  RBTreeNodeT* free_slots_;
+  // Nodes in the order they are moved to, those before compact_next_ are
+  // already moved to the first compact_slot_ slots of the last block.
+  std::vector<RBTreeNodeT*> compact_order_;
+  size_t compact_next_;
+  size_t compact_slot_;
 };
 
 }  // trilib
@@ -0,0 +1,980 @@
+// Benchmarks of trilib trees. Runs all benchmarks whose name contains the
+// first argument, or all of them:
+//   ./bin/rbtree_bench [filter]
+#include "journaled_rbtree.h"
+#include "packed_set.h"
+#include "rbtree.h"
+#include "sliding_quantile.h"
+#include "static_set.h"
+#include "string_rbtree.h"
+#include "topdown_rbtree.h"
+
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <queue>
+#include <set>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+template <typename FuncT>
+double Seconds(FuncT func) {
+  const auto start = chrono::steady_clock::now();
+  func();
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+double Mops(size_t ops, double seconds) { return ops / seconds / 1e6; }
+
+vector<int64_t> RandomKeys(size_t size, uint64_t seed) {
+  mt19937_64 gen(seed);
+  vector<int64_t> keys(size);
+  for (int64_t& key : keys) {
+    key = gen() >> 1;
+  }
+  return keys;
+}
+
+// Counts comparisons, Search makes one per level it descends.
+uint64_t comparisons = 0;
+
+struct CountingLess {
+  bool operator()(int64_t a, int64_t b) const {
+    ++comparisons;
+    return a < b;
+  }
+};
+
+template <typename BalanceT>
+void BenchBalance(const char* name, size_t size) {
+  const vector<int64_t> keys = RandomKeys(size, 1);
+  vector<int64_t> shuffled = keys;
+  shuffle(shuffled.begin(), shuffled.end(), mt19937_64(2));
+
+  trilib::RBTree<int64_t, less<int64_t>, BalanceT> tree;
+  const double insert = Seconds([&]() {
+    for (int64_t key : keys) {
+      tree.Insert(key);
+    }
+  });
+  size_t found = 0;
+  const double search = Seconds([&]() {
+    for (int64_t key : shuffled) {
+      found += tree.HasValue(key);
+    }
+  });
+  const double remove = Seconds([&]() {
+    for (int64_t key : shuffled) {
+      tree.Delete(key);
+    }
+  });
+
+  // The same tree again, this time counting depth of every key.
+  trilib::RBTree<int64_t, CountingLess, BalanceT> counting;
+  for (int64_t key : keys) {
+    counting.Insert(key);
+  }
+  uint64_t total_depth = 0;
+  uint64_t max_depth = 0;
+  for (int64_t key : keys) {
+    comparisons = 0;
+    counting.Search(key);
+    total_depth += comparisons;
+    max_depth = max(max_depth, comparisons);
+  }
+
+  if (found != size) {
+    printf("%s: found %zu of %zu keys\n", name, found, size);
+  }
+  printf("%-10s %9zu %10.2f %10.2f %10.2f %9.2f %9lu\n", name, size,
+         Mops(size, insert), Mops(size, search), Mops(size, remove),
+         static_cast<double>(total_depth) / size,
+         static_cast<unsigned long>(max_depth));
+}
+
+void BenchBalancePolicies() {
+  printf("%-10s %9s %10s %10s %10s %9s %9s\n", "policy", "size", "insert/us",
+         "search/us", "delete/us", "avg_depth", "max_depth");
+  for (size_t size : {size_t(1) << 10, size_t(1) << 16, size_t(1) << 20}) {
+    BenchBalance<trilib::RedBlackBalance>("red-black", size);
+    BenchBalance<trilib::AvlBalance>("avl", size);
+    BenchBalance<trilib::WavlBalance>("wavl", size);
+  }
+}
+
+// Lookups of which 90% go to 1% of keys.
+template <typename CacheT>
+void BenchCache(const char* name, size_t size) {
+  const vector<int64_t> keys = RandomKeys(size, 1);
+  trilib::RBTree<int64_t, less<int64_t>, trilib::RedBlackBalance, CacheT> tree;
+  for (int64_t key : keys) {
+    tree.Insert(key);
+  }
+  mt19937_64 gen(3);
+  const size_t hot = max<size_t>(size / 100, 1);
+  vector<int64_t> lookups(4 * size);
+  for (int64_t& key : lookups) {
+    key = gen() % 10 != 0 ? keys[gen() % hot] : keys[gen() % size];
+  }
+  size_t found = 0;
+  const double search = Seconds([&]() {
+    for (int64_t key : lookups) {
+      found += tree.HasValue(key);
+    }
+  });
+  if (found != lookups.size()) {
+    printf("%s: found %zu of %zu keys\n", name, found, lookups.size());
+  }
+  printf("%-12s %9zu %10.2f %9.3f\n", name, size,
+         Mops(lookups.size(), search), tree.cache_stats().hit_rate());
+}
+
+void BenchLookupCache() {
+  printf("%-12s %9s %10s %9s\n", "cache", "size", "search/us", "hit_rate");
+  for (size_t size : {size_t(1) << 16, size_t(1) << 20}) {
+    BenchCache<trilib::NoLookupCache>("none", size);
+    BenchCache<trilib::LookupCache<1024>>("direct-1k", size);
+    BenchCache<trilib::LookupCache<256, 4>>("4way-1k", size);
+    BenchCache<trilib::LookupCache<4096, 4>>("4way-16k", size);
+  }
+}
+
+// Merge join of a sorted probe list against a big tree, probes are dense
+// (every key of a range) or sparse (random keys of the tree).
+void BenchFingerJoin(const char* name, const vector<int64_t>& keys,
+                     const vector<int64_t>& probes) {
+  trilib::RBTree<int64_t, CountingLess> tree;
+  for (int64_t key : keys) {
+    tree.Insert(key);
+  }
+  size_t root_found = 0;
+  comparisons = 0;
+  const double root = Seconds([&]() {
+    for (int64_t key : probes) {
+      root_found += tree.Search(key) != tree.end();
+    }
+  });
+  const uint64_t root_cmps = comparisons;
+  size_t finger_found = 0;
+  comparisons = 0;
+  const double finger = Seconds([&]() {
+    auto iter = tree.begin();
+    for (int64_t key : probes) {
+      auto found = tree.Search(iter, key);
+      if (found != tree.end()) {
+        ++finger_found;
+        iter = found;
+      }
+    }
+  });
+  if (root_found != finger_found) {
+    printf("%s: found %zu and %zu\n", name, root_found, finger_found);
+  }
+  printf("%-8s %9zu %9zu %10.2f %10.2f %9.2f %9.2f\n", name, keys.size(),
+         probes.size(), Mops(probes.size(), root),
+         Mops(probes.size(), finger),
+         static_cast<double>(root_cmps) / probes.size(),
+         static_cast<double>(comparisons) / probes.size());
+}
+
+void BenchFingerSearch() {
+  printf("%-8s %9s %9s %10s %10s %9s %9s\n", "probes", "size", "probes",
+         "root/us", "finger/us", "root_cmp", "fing_cmp");
+  for (size_t size : {size_t(1) << 16, size_t(1) << 20}) {
+    vector<int64_t> keys = RandomKeys(size, 1);
+    sort(keys.begin(), keys.end());
+    vector<int64_t> dense(keys.begin() + size / 4, keys.begin() + size / 2);
+    BenchFingerJoin("dense", keys, dense);
+    vector<int64_t> sparse;
+    for (size_t i = 0; i < size; i += 16) {
+      sparse.push_back(keys[i]);
+    }
+    BenchFingerJoin("sparse", keys, sparse);
+  }
+}
+
+// Lookups and a full scan of a tree after heavy churn, then after Compact.
+void BenchCompact() {
+  const size_t size = size_t(1) << 20;
+  printf("%-12s %9s %10s %10s %10s\n", "layout", "size", "search/us",
+         "scan/us", "compact_s");
+  const vector<int64_t> keys = RandomKeys(size, 1);
+  vector<int64_t> shuffled = keys;
+  shuffle(shuffled.begin(), shuffled.end(), mt19937_64(2));
+  const struct {
+    const char* name;
+    trilib::NodeLayout layout;
+  } layouts[] = {{"churned", trilib::NodeLayout::kInOrder},
+                 {"in-order", trilib::NodeLayout::kInOrder},
+                 {"bfs", trilib::NodeLayout::kBreadthFirst},
+                 {"veb", trilib::NodeLayout::kVanEmdeBoas}};
+  for (const auto& layout : layouts) {
+    trilib::RBTree<int64_t, less<int64_t>> tree;
+    // Interleave with garbage, so the nodes end up scattered in memory.
+    vector<vector<char>> garbage;
+    for (int64_t key : keys) {
+      tree.Insert(key);
+      garbage.emplace_back(64 + key % 256);
+    }
+    for (size_t i = 0; i < size; i += 2) {
+      tree.Delete(shuffled[i]);
+      tree.Insert(shuffled[i]);
+    }
+    garbage.clear();
+    double compact = 0;
+    if (&layout != &layouts[0]) {
+      compact = Seconds([&]() { tree.Compact(layout.layout); });
+    }
+    size_t found = 0;
+    const double search = Seconds([&]() {
+      for (int64_t key : shuffled) {
+        found += tree.HasValue(key);
+      }
+    });
+    int64_t sum = 0;
+    const double scan = Seconds([&]() {
+      for (int64_t key : tree) {
+        sum += key;
+      }
+    });
+    if (found != size || sum == 0) {
+      printf("%s: found %zu of %zu keys\n", layout.name, found, size);
+    }
+    printf("%-12s %9zu %10.2f %10.2f %10.3f\n", layout.name, size,
+           Mops(size, search), Mops(size, scan), compact);
+  }
+}
+
+// Sum of all values by iterators and by ParallelReduce.
+void BenchParallelScan() {
+  const size_t size = size_t(1) << 22;
+  trilib::RBTree<int64_t, less<int64_t>> tree;
+  for (int64_t key : RandomKeys(size, 1)) {
+    tree.Insert(key >> 20);
+  }
+  printf("%-10s %9s %8s %10s\n", "scan", "size", "threads", "values/us");
+  int64_t expected = 0;
+  const double sequential = Seconds([&]() {
+    for (int64_t key : tree) {
+      expected += key;
+    }
+  });
+  printf("%-10s %9zu %8u %10.2f\n", "iterator", size, 1u,
+         Mops(size, sequential));
+  for (unsigned threads : {1u, 2u, 4u, 8u, 16u}) {
+    int64_t sum = 0;
+    const double parallel = Seconds([&]() {
+      sum = tree.ParallelReduce(
+          int64_t(0), [](int64_t key) { return key; },
+          [](int64_t a, int64_t b) { return a + b; }, threads);
+    });
+    if (sum != expected) {
+      printf("parallel sum %ld != %ld\n", static_cast<long>(sum),
+             static_cast<long>(expected));
+    }
+    printf("%-10s %9zu %8u %10.2f\n", "reduce", size, threads,
+           Mops(size, parallel));
+  }
+}
+
+// Hold model of a scheduler: pop the earliest deadline, push a later one.
+void BenchPriorityQueue() {
+  printf("%-14s %9s %10s\n", "queue", "size", "hold/us");
+  for (size_t size : {size_t(1) << 10, size_t(1) << 20}) {
+    const vector<int64_t> keys = RandomKeys(size, 1);
+    const vector<int64_t> delays = RandomKeys(4 * size, 2);
+    trilib::RBTree<int64_t, less<int64_t>> tree;
+    multiset<int64_t> set(keys.begin(), keys.end());
+    priority_queue<int64_t, vector<int64_t>, greater<int64_t>> heap(
+        keys.begin(), keys.end());
+    for (int64_t key : keys) {
+      tree.Insert(key);
+    }
+    int64_t tree_sum = 0;
+    const double pop_min = Seconds([&]() {
+      for (int64_t delay : delays) {
+        const int64_t now = tree.PopMin();
+        tree_sum += now;
+        tree.Insert(now + (delay >> 40));
+      }
+    });
+    int64_t set_sum = 0;
+    const double multiset = Seconds([&]() {
+      for (int64_t delay : delays) {
+        const int64_t now = *set.begin();
+        set.erase(set.begin());
+        set_sum += now;
+        set.insert(now + (delay >> 40));
+      }
+    });
+    int64_t heap_sum = 0;
+    const double binary_heap = Seconds([&]() {
+      for (int64_t delay : delays) {
+        const int64_t now = heap.top();
+        heap.pop();
+        heap_sum += now;
+        heap.push(now + (delay >> 40));
+      }
+    });
+    if (tree_sum != set_sum || tree_sum != heap_sum) {
+      printf("sums differ\n");
+    }
+    printf("%-14s %9zu %10.2f\n", "RBTree::PopMin", size,
+           Mops(delays.size(), pop_min));
+    printf("%-14s %9zu %10.2f\n", "std::multiset", size,
+           Mops(delays.size(), multiset));
+    printf("%-14s %9zu %10.2f\n", "binary heap", size,
+           Mops(delays.size(), binary_heap));
+  }
+}
+
+// Deadlines of timers pushed a little into the future, by Delete and Insert
+// or by UpdateKey. Both look the timer up first.
+void BenchUpdateKey() {
+  printf("%-14s %9s %10s %10s\n", "update", "size", "small/us", "far/us");
+  for (size_t size : {size_t(1) << 10, size_t(1) << 20}) {
+    const vector<int64_t> keys = RandomKeys(size, 1);
+    const vector<int64_t> picks = RandomKeys(size, 2);
+    double results[2][2];
+    for (int far = 0; far < 2; ++far) {
+      const int64_t spread = far ? (int64_t(1) << 62) / size : 1 << 10;
+      for (int update = 0; update < 2; ++update) {
+        trilib::RBTree<int64_t, less<int64_t>> tree;
+        vector<int64_t> deadlines = keys;
+        for (int64_t key : keys) {
+          tree.Insert(key);
+        }
+        results[far][update] = Seconds([&]() {
+          for (int64_t pick : picks) {
+            int64_t& deadline = deadlines[pick % size];
+            const int64_t later = deadline + pick % spread;
+            auto iter = tree.Search(deadline);
+            if (update) {
+              tree.UpdateKey(iter, later);
+            } else {
+              tree.Delete(iter);
+              tree.Insert(later);
+            }
+            deadline = later;
+          }
+        });
+      }
+    }
+    printf("%-14s %9zu %10.2f %10.2f\n", "Delete+Insert", size,
+           Mops(size, results[0][0]), Mops(size, results[1][0]));
+    printf("%-14s %9zu %10.2f %10.2f\n", "UpdateKey", size,
+           Mops(size, results[0][1]), Mops(size, results[1][1]));
+  }
+}
+
+// Latency of inserts during a burst into a big tree, then the time the
+// deferred rebalancing takes and depth of the tree before it.
+template <typename BalanceT>
+void BenchBurst(const char* name, size_t size, size_t burst) {
+  const vector<int64_t> keys = RandomKeys(size + burst, 1);
+  trilib::RBTree<int64_t, CountingLess, BalanceT> tree;
+  for (size_t i = 0; i < size; ++i) {
+    tree.Insert(keys[i]);
+  }
+  tree.Rebalance();
+  vector<double> latency(burst);
+  const double insert = Seconds([&]() {
+    for (size_t i = 0; i < burst; ++i) {
+      const auto start = chrono::steady_clock::now();
+      tree.Insert(keys[size + i]);
+      latency[i] = chrono::duration<double, micro>(
+                       chrono::steady_clock::now() - start).count();
+    }
+  });
+  comparisons = 0;
+  for (size_t i = 0; i < size + burst; i += 16) {
+    tree.Search(keys[i]);
+  }
+  const double avg_depth = comparisons / double((size + burst + 15) / 16);
+  const double rebalance = Seconds([&]() { tree.Rebalance(); });
+  sort(latency.begin(), latency.end());
+  printf("%-10s %9zu %8zu %8.2f %8.3f %8.3f %8.2f %9.2f %9.2f\n", name, size,
+         burst, Mops(burst, insert), latency[burst / 2],
+         latency[burst * 99 / 100], latency.back(), rebalance * 1e3,
+         avg_depth);
+}
+
+void BenchRelaxedBalance() {
+  printf("%-10s %9s %8s %8s %8s %8s %8s %9s %9s\n", "policy", "size",
+         "burst", "ins/us", "p50_us", "p99_us", "max_us", "fix_ms",
+         "avg_depth");
+  for (size_t burst : {size_t(1) << 12, size_t(1) << 16}) {
+    BenchBurst<trilib::RedBlackBalance>("eager", size_t(1) << 20, burst);
+    BenchBurst<trilib::RelaxedRedBlackBalance>("relaxed", size_t(1) << 20,
+                                               burst);
+  }
+  // Sorted burst, each insert would rotate in the eager tree.
+  printf("%-10s %9s %8s %8s %8s %8s %8s %9s %9s\n", "sorted", "size",
+         "burst", "ins/us", "p50_us", "p99_us", "max_us", "fix_ms",
+         "avg_depth");
+  for (int relaxed = 0; relaxed < 2; ++relaxed) {
+    trilib::RBTree<int64_t, less<int64_t>> eager;
+    trilib::RBTree<int64_t, less<int64_t>, trilib::RelaxedRedBlackBalance>
+        lazy;
+    const size_t burst = size_t(1) << 16;
+    const double insert = Seconds([&]() {
+      for (size_t i = 0; i < burst; ++i) {
+        if (relaxed) {
+          lazy.Insert(i);
+        } else {
+          eager.Insert(i);
+        }
+      }
+    });
+    const double rebalance = Seconds([&]() { lazy.Rebalance(); });
+    printf("%-10s %9d %8zu %8.2f %8s %8s %8s %9.2f %9s\n",
+           relaxed ? "relaxed" : "eager", 0, burst, Mops(burst, insert), "-",
+           "-", "-", rebalance * 1e3, "-");
+  }
+}
+
+// Samples per second added to a full count window, alone and followed by
+// p50, p99 and p999 queries. "plain" is the same FIFO of iterators over an
+// RBTree without subtree counts, which can't answer the queries.
+void BenchSlidingQuantile() {
+  printf("%-10s %9s %10s %10s\n", "quantile", "window", "add/us",
+         "add+q/us");
+  const size_t samples = size_t(1) << 21;
+  const vector<int64_t> keys = RandomKeys(samples, 1);
+  for (size_t window : {size_t(1) << 10, size_t(1) << 17}) {
+    trilib::RBTree<int64_t, less<int64_t>> plain;
+    vector<trilib::RBTree<int64_t, less<int64_t>>::iterator> fifo;
+    const double plain_add = Seconds([&]() {
+      for (size_t i = 0; i < samples; ++i) {
+        if (fifo.size() < window) {
+          fifo.push_back(plain.Insert(keys[i]));
+        } else {
+          auto& oldest = fifo[i % window];
+          oldest = plain.UpdateKey(oldest, keys[i]);
+        }
+      }
+    });
+    double results[2];
+    int64_t sum = 0;
+    for (int query = 0; query < 2; ++query) {
+      trilib::SlidingQuantile<int64_t> quantiles(window);
+      results[query] = Seconds([&]() {
+        for (size_t i = 0; i < samples; ++i) {
+          quantiles.Add(keys[i]);
+          if (query) {
+            sum += quantiles.Quantile(0.5) + quantiles.Quantile(0.99) +
+                   quantiles.Quantile(0.999);
+          }
+        }
+      });
+    }
+    printf("%-10s %9zu %10.2f %10s\n", "plain", window,
+           Mops(samples, plain_add), "-");
+    printf("%-10s %9zu %10.2f %10.2f\n", "sliding", window,
+           Mops(samples, results[0]), Mops(samples, results[1]));
+    if (sum == 42) {
+      printf("\n");
+    }
+  }
+}
+
+// Time to find d differences between two replicas of a million values with
+// Diff, against a merge of both trees in order. Also the cost of keeping
+// subtree hashes on inserts.
+void BenchDiff() {
+  using HashedTree = trilib::RBTree<int64_t, less<int64_t>,
+                                    trilib::RedBlackBalance,
+                                    trilib::NoLookupCache, trilib::SubtreeHash>;
+  const size_t size = size_t(1) << 20;
+  const vector<int64_t> keys = RandomKeys(size, 1);
+  trilib::RBTree<int64_t, less<int64_t>> plain;
+  const double plain_insert = Seconds([&]() {
+    for (int64_t key : keys) {
+      plain.Insert(key);
+    }
+  });
+  HashedTree primary;
+  const double hashed_insert = Seconds([&]() {
+    for (int64_t key : keys) {
+      primary.Insert(key);
+    }
+  });
+  printf("%-10s %10s %10s\n", "insert", "plain/us", "hashed/us");
+  printf("%-10s %10.2f %10.2f\n", "", Mops(size, plain_insert),
+         Mops(size, hashed_insert));
+  printf("%-10s %9s %10s %10s\n", "diff", "diffs", "diff_ms", "merge_ms");
+  for (size_t diffs : {size_t(0), size_t(10), size_t(1000)}) {
+    HashedTree replica = primary;
+    for (size_t i = 0; i < diffs; ++i) {
+      replica.Delete(keys[i * 997 % size]);
+    }
+    size_t found = 0;
+    const double diff = Seconds([&]() {
+      found = primary.Diff(replica, [](int64_t, bool) {});
+    });
+    size_t merged = 0;
+    const double merge = Seconds([&]() {
+      auto a = primary.begin();
+      auto b = replica.begin();
+      while (a != primary.end() || b != replica.end()) {
+        if (b == replica.end() || (a != primary.end() && *a < *b)) {
+          ++merged;
+          ++a;
+        } else if (a == primary.end() || *b < *a) {
+          ++merged;
+          ++b;
+        } else {
+          ++a;
+          ++b;
+        }
+      }
+    });
+    printf("%-10s %9zu %10.3f %10.3f %s\n", "", diffs, diff * 1e3,
+           merge * 1e3, found == diffs && merged == diffs ? "" : "MISMATCH");
+  }
+}
+
+// Inserts into a JournaledRBTree committing every N records, a plain RBTree
+// for reference, then checkpoint and recovery times.
+void BenchJournal() {
+  const string checkpoint = "/tmp/rbtree_bench_journal.ckpt";
+  const string log = "/tmp/rbtree_bench_journal.log";
+  using JournaledTree = trilib::JournaledRBTree<int64_t, less<int64_t>>;
+  const vector<int64_t> keys = RandomKeys(size_t(1) << 20, 1);
+  trilib::RBTree<int64_t, less<int64_t>> plain;
+  const double plain_insert = Seconds([&]() {
+    for (int64_t key : keys) {
+      plain.Insert(key);
+    }
+  });
+  printf("%-10s %10s %10s %10s\n", "insert", "commit_n", "ops", "Kops/s");
+  printf("%-10s %10s %10zu %10.1f\n", "", "no log", keys.size(),
+         Mops(keys.size(), plain_insert) * 1e3);
+  for (size_t commit : {size_t(1), size_t(16), size_t(256), size_t(4096),
+                        size_t(0)}) {
+    unlink(checkpoint.c_str());
+    unlink(log.c_str());
+    trilib::JournalOptions options;
+    options.commit_records = commit;
+    options.checkpoint_bytes = 0;
+    JournaledTree tree;
+    tree.Recover(checkpoint, log, options);
+    // Every fsync is a round trip to the disk, fewer ops for small groups.
+    const size_t ops = commit == 0 ? keys.size()
+                                   : min(keys.size(), commit * 2000);
+    const double seconds = Seconds([&]() {
+      for (size_t i = 0; i < ops; ++i) {
+        tree.Insert(keys[i]);
+      }
+      tree.Commit();
+    });
+    printf("%-10s %10zu %10zu %10.1f\n", "", commit, ops,
+           Mops(ops, seconds) * 1e3);
+  }
+
+  JournaledTree tree;
+  tree.Recover(checkpoint, log);
+  const double checkpoint_seconds = Seconds([&]() { tree.Checkpoint(); });
+  for (size_t i = 0; i < keys.size() / 8; ++i) {
+    tree.Insert(keys[i] ^ 1);
+  }
+  tree.Close();
+  JournaledTree recovered;
+  const double recover_seconds =
+      Seconds([&]() { recovered.Recover(checkpoint, log); });
+  printf("%-10s %10s %10s %10s\n", "recover", "size", "replayed", "ms");
+  printf("%-10s %10zu %10s %10.1f\n", "", keys.size(), "ckpt",
+         checkpoint_seconds * 1e3);
+  printf("%-10s %10zu %10llu %10.1f\n", "", recovered.tree().size(),
+         static_cast<unsigned long long>(recovered.stats().replayed),
+         recover_seconds * 1e3);
+  recovered.Close();
+  unlink(checkpoint.c_str());
+  unlink(log.c_str());
+}
+
+// Sorted 64-bit ids exported to a PackedSet: memory per key, membership
+// tests of random ids, half of them present, and a full scan, next to the
+// RBTree they came from. Ids are random below 2^bits.
+void BenchPackedSetBits(int bits) {
+  const size_t size = size_t(1) << 20;
+  mt19937_64 gen(1);
+  vector<int64_t> keys(size);
+  for (int64_t& key : keys) {
+    key = static_cast<int64_t>(gen() >> (64 - bits));
+  }
+  trilib::RBTree<int64_t, less<int64_t>> tree;
+  for (int64_t key : keys) {
+    tree.Insert(key);
+  }
+  const auto packed = trilib::MakePackedSet(tree);
+  vector<int64_t> probes(keys.begin(), keys.begin() + size / 2);
+  for (size_t i = 0; i < size / 2; ++i) {
+    probes.push_back(static_cast<int64_t>(gen() >> (64 - bits)));
+  }
+  shuffle(probes.begin(), probes.end(), gen);
+  size_t tree_found = 0;
+  const double tree_search = Seconds([&]() {
+    for (int64_t probe : probes) {
+      tree_found += tree.HasValue(probe);
+    }
+  });
+  size_t packed_found = 0;
+  const double packed_search = Seconds([&]() {
+    for (int64_t probe : probes) {
+      packed_found += packed.HasValue(probe);
+    }
+  });
+  int64_t tree_sum = 0;
+  const double tree_scan = Seconds([&]() {
+    for (int64_t key : tree) {
+      tree_sum += key;
+    }
+  });
+  int64_t packed_sum = 0;
+  const double packed_scan = Seconds([&]() {
+    for (int64_t key : packed) {
+      packed_sum += key;
+    }
+  });
+  printf("%-10d %8.2f %8.1f %8.2f %8.2f %8.1f %8.1f %s\n", bits,
+         double(packed.bytes()) / size,
+         double(sizeof(trilib::RBTreeNode<int64_t>)), Mops(size, tree_search),
+         Mops(size, packed_search), Mops(size, tree_scan),
+         Mops(size, packed_scan),
+         tree_found == packed_found && tree_sum == packed_sum ? ""
+                                                              : "MISMATCH");
+}
+
+void BenchPackedSet() {
+  printf("%-10s %8s %8s %8s %8s %8s %8s\n", "id_bits", "B/key", "node_B",
+         "tree/us", "pack/us", "tscan/us", "pscan/us");
+  for (int bits : {24, 32, 40, 48}) {
+    BenchPackedSetBits(bits);
+  }
+}
+
+// URL-like keys: a few thousand hosts, paths of random words.
+vector<string> UrlKeys(size_t size) {
+  static const char* const kWords[] = {
+      "images", "static", "api", "v2", "users", "item", "search", "assets",
+      "css", "js", "thumb", "product", "blog", "2024", "index", "page"};
+  mt19937_64 gen(1);
+  vector<string> keys(size);
+  for (string& key : keys) {
+    key = "https://";
+    key += kWords[gen() % 16];
+    key += to_string(gen() % 4000);
+    key += ".example.com";
+    for (int depth = 1 + gen() % 4; depth > 0; --depth) {
+      key += '/';
+      key += kWords[gen() % 16];
+    }
+    key += '/';
+    key += to_string(gen() % 100000);
+  }
+  return keys;
+}
+
+vector<string> UuidKeys(size_t size) {
+  mt19937_64 gen(1);
+  vector<string> keys(size);
+  for (string& key : keys) {
+    char buf[40];
+    const uint64_t a = gen();
+    const uint64_t b = gen();
+    snprintf(buf, sizeof(buf), "%08x-%04x-4%03x-%04x-%012llx",
+             static_cast<unsigned>(a >> 32), static_cast<unsigned>(a >> 16) &
+             0xffff, static_cast<unsigned>(a) & 0xfff,
+             static_cast<unsigned>(b >> 48),
+             static_cast<unsigned long long>(b) & 0xffffffffffffULL);
+    key = buf;
+  }
+  return keys;
+}
+
+// Inserts and looks up string keys in RBTree<std::string> and in
+// StringRBTree, queries of the latter use views, nothing is copied. Keys
+// are moved in like ones parsed elsewhere, so heap buffers of std::string
+// don't sit next to their nodes.
+void BenchStringKeys(const char* name, const vector<string>& keys) {
+  vector<string> probes = keys;
+  shuffle(probes.begin(), probes.end(), mt19937_64(2));
+  vector<string> moved = keys;
+  trilib::RBTree<string, less<string>> plain;
+  const double plain_insert = Seconds([&]() {
+    for (string& key : moved) {
+      plain.Insert(move(key));
+    }
+  });
+  size_t plain_found = 0;
+  const double plain_search = Seconds([&]() {
+    for (const string& probe : probes) {
+      plain_found += plain.HasValue(probe);
+    }
+  });
+  trilib::StringRBTree<> inlined;
+  const double inline_insert = Seconds([&]() {
+    for (const string& key : keys) {
+      inlined.Insert(key);
+    }
+  });
+  size_t inline_found = 0;
+  const double inline_search = Seconds([&]() {
+    for (const string& probe : probes) {
+      inline_found += inlined.HasValue(trilib::InlineString::View(probe));
+    }
+  });
+  printf("%-10s %10.2f %10.2f %10.2f %10.2f %s\n", name,
+         Mops(keys.size(), plain_insert), Mops(keys.size(), inline_insert),
+         Mops(keys.size(), plain_search), Mops(keys.size(), inline_search),
+         plain_found == inline_found ? "" : "MISMATCH");
+}
+
+void BenchStringTree() {
+  const size_t size = size_t(1) << 20;
+  printf("%-10s %10s %10s %10s %10s\n", "keys", "str_ins", "inl_ins",
+         "str_find", "inl_find");
+  BenchStringKeys("url", UrlKeys(size));
+  BenchStringKeys("uuid", UuidKeys(size));
+}
+
+// Shifts of all deadlines from a random one on: lazy ShiftFrom against
+// extracting the shifted nodes and inserting them back. Then lookups of
+// random bounds in both trees, the lazy one pays for checking offsets.
+void BenchShift() {
+  using ShiftTree =
+      trilib::RBTree<int64_t, less<int64_t>, trilib::RedBlackBalance,
+                     trilib::NoLookupCache, trilib::KeyOffset<int64_t>>;
+  using PlainTree = trilib::RBTree<int64_t, less<int64_t>>;
+  printf("%-8s %9s %10s %10s %10s %10s\n", "shift", "size", "lazy_us",
+         "reins_us", "find/us", "plain/us");
+  for (size_t size : {size_t(1) << 10, size_t(1) << 16, size_t(1) << 20}) {
+    const vector<int64_t> keys = RandomKeys(size, 1);
+    ShiftTree lazy;
+    PlainTree plain;
+    for (int64_t key : keys) {
+      lazy.Insert(key);
+      plain.Insert(key);
+    }
+    const size_t shifts = size_t(1) << 16;
+    const size_t reinserts = max<size_t>(4, (size_t(1) << 22) / size);
+    const vector<int64_t> picks = RandomKeys(shifts, 2);
+    const double reinsert_time = Seconds([&]() {
+      vector<PlainTree::iterator> shifted;
+      for (size_t i = 0; i < reinserts; ++i) {
+        const int64_t key = keys[picks[i] % size];
+        const int64_t delta = picks[i] % 1000 + 1;
+        auto iter = plain.UpperBound(key);
+        iter = iter == plain.end() ? plain.begin() : ++iter;
+        shifted.clear();
+        for (; iter != plain.end(); ++iter) {
+          shifted.push_back(iter);
+        }
+        for (PlainTree::iterator node : shifted) {
+          PlainTree::node_type handle = plain.Extract(node);
+          handle.value() += delta;
+          plain.Insert(move(handle));
+        }
+      }
+    });
+    for (size_t i = 0; i < reinserts; ++i) {
+      lazy.ShiftFrom(keys[picks[i] % size], picks[i] % 1000 + 1);
+    }
+    const bool same = equal(lazy.begin(), lazy.end(), plain.begin());
+    const double lazy_time = Seconds([&]() {
+      for (size_t i = 0; i < shifts; ++i) {
+        lazy.ShiftFrom(keys[picks[i] % size], picks[i] % 1000 + 1);
+      }
+    });
+    const size_t lookups = size_t(1) << 20;
+    const vector<int64_t> probes = RandomKeys(lookups, 3);
+    int64_t sums[2] = {0, 0};
+    const double find_times[2] = {
+        Seconds([&]() {
+          for (int64_t probe : probes) {
+            auto iter = lazy.LowerBound(probe);
+            sums[0] += iter == lazy.end() ? 0 : *iter;
+          }
+        }),
+        Seconds([&]() {
+          for (int64_t probe : probes) {
+            auto iter = plain.LowerBound(probe);
+            sums[1] += iter == plain.end() ? 0 : *iter;
+          }
+        })};
+    printf("%-8s %9zu %10.2f %10.1f %10.2f %10.2f %s\n", "", size,
+           lazy_time / shifts * 1e6, reinsert_time / reinserts * 1e6,
+           Mops(lookups, find_times[0]), Mops(lookups, find_times[1]),
+           same && sums[0] != 0 && sums[1] != 0 ? "" : "MISMATCH");
+  }
+}
+
+// Bytes allocated by malloc and not freed yet, 0 where it can't be told.
+size_t HeapBytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+}
+
+// Footprint, inserts, a full scan, lookups and deletes of size random
+// values, in random order.
+template <typename TreeT, typename ValueT>
+void BenchTopDownTree(const char* name, size_t node_size, size_t size) {
+  vector<ValueT> values;
+  for (int64_t key : RandomKeys(size, 1)) {
+    values.push_back(static_cast<ValueT>(key));
+  }
+  vector<ValueT> order = values;
+  shuffle(order.begin(), order.end(), mt19937_64(2));
+  const size_t heap = HeapBytes();
+  TreeT tree;
+  const double insert_time = Seconds([&]() {
+    for (const ValueT& value : values) {
+      tree.Insert(value);
+    }
+  });
+  const double heap_per_node = double(HeapBytes() - heap) / size;
+  int64_t sum = 0;
+  const double scan_time = Seconds([&]() {
+    for (const ValueT& value : tree) {
+      sum += value;
+    }
+  });
+  size_t found = 0;
+  const double find_time = Seconds([&]() {
+    for (const ValueT& value : order) {
+      found += tree.HasValue(value);
+    }
+  });
+  const double delete_time = Seconds([&]() {
+    for (const ValueT& value : order) {
+      tree.Delete(value);
+    }
+  });
+  printf("%-8s %8zu %6zu %6.1f %10.2f %10.1f %10.2f %10.2f %s\n", name,
+         size, node_size, heap_per_node, Mops(size, insert_time),
+         Mops(size, scan_time), Mops(size, find_time),
+         Mops(size, delete_time),
+         found == size && tree.empty() && sum != 0 ? "" : "MISMATCH");
+}
+
+template <typename ValueT>
+void BenchTopDownSize(size_t size) {
+  BenchTopDownTree<trilib::RBTree<ValueT, less<ValueT>>, ValueT>(
+      "rbtree", sizeof(trilib::RBTreeNode<ValueT>), size);
+  BenchTopDownTree<trilib::TopDownRBTree<ValueT>, ValueT>(
+      "topdown", sizeof(trilib::TopDownRBTreeNode<ValueT>), size);
+}
+
+// RBTree against TopDownRBTree, which has no parent links. Node bytes and
+// heap bytes per node, then millions of inserts, scanned values, lookups
+// and deletes per second.
+void BenchTopDown() {
+  printf("%-8s %8s %6s %6s %10s %10s %10s %10s\n", "topdown", "size",
+         "node", "heap", "insert", "scan", "find", "delete");
+  BenchTopDownSize<int64_t>(size_t(1) << 16);
+  BenchTopDownSize<int64_t>(size_t(1) << 20);
+  printf("int32\n");
+  BenchTopDownSize<int32_t>(size_t(1) << 20);
+}
+
+// Membership tests of random values, half of them present, in a set of N
+// values: StaticSet, binary search of a sorted vector and RBTree.
+template <size_t N>
+void BenchStaticSetSize() {
+  const vector<int64_t> keys = RandomKeys(N, 1);
+  int64_t values[N];
+  copy(keys.begin(), keys.end(), values);
+  const trilib::StaticSet<int64_t, N> static_set(values);
+  vector<int64_t> sorted = keys;
+  sort(sorted.begin(), sorted.end());
+  trilib::RBTree<int64_t, less<int64_t>> tree;
+  for (int64_t key : keys) {
+    tree.Insert(key);
+  }
+  const size_t lookups = size_t(1) << 22;
+  vector<int64_t> probes = RandomKeys(lookups, 2);
+  for (size_t i = 0; i < lookups; i += 2) {
+    probes[i] = keys[probes[i] % N];
+  }
+  size_t found[3] = {0, 0, 0};
+  const double times[3] = {
+      Seconds([&]() {
+        for (int64_t probe : probes) {
+          found[0] += static_set.HasValue(probe);
+        }
+      }),
+      Seconds([&]() {
+        for (int64_t probe : probes) {
+          found[1] += binary_search(sorted.begin(), sorted.end(), probe);
+        }
+      }),
+      Seconds([&]() {
+        for (int64_t probe : probes) {
+          found[2] += tree.HasValue(probe);
+        }
+      })};
+  printf("%-8s %7zu %10.2f %10.2f %10.2f %s\n", "lookup", N,
+         Mops(lookups, times[0]), Mops(lookups, times[1]),
+         Mops(lookups, times[2]),
+         found[0] == found[1] && found[1] == found[2] ? "" : "MISMATCH");
+}
+
+void BenchStaticSet() {
+  printf("%-8s %7s %10s %10s %10s\n", "static", "size", "static/us",
+         "sorted/us", "rbtree/us");
+  BenchStaticSetSize<64>();
+  BenchStaticSetSize<1024>();
+}
+
+struct Benchmark {
+  const char* name;
+  void (*func)();
+};
+
+const Benchmark kBenchmarks[] = {
+    {"balance", BenchBalancePolicies},
+    {"cache", BenchLookupCache},
+    {"finger", BenchFingerSearch},
+    {"compact", BenchCompact},
+    {"parallel", BenchParallelScan},
+    {"pqueue", BenchPriorityQueue},
+    {"update", BenchUpdateKey},
+    {"relaxed", BenchRelaxedBalance},
+    {"quantile", BenchSlidingQuantile},
+    {"static", BenchStaticSet},
+    {"diff", BenchDiff},
+    {"journal", BenchJournal},
+    {"packed", BenchPackedSet},
+    {"string", BenchStringTree},
+    {"shift", BenchShift},
+    {"topdown", BenchTopDown},
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const string filter = argc > 1 ? argv[1] : "";
+  for (const Benchmark& bench : kBenchmarks) {
+    if (string(bench.name).find(filter) != string::npos) {
+      printf("== %s\n", bench.name);
+      bench.func();
+    }
+  }
+  return 0;
+}
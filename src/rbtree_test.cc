@@ -5,8 +5,15 @@
 #include "gtest/gtest.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <iostream>
+#include <memory>
+#include <set>
 #include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
 
 using namespace std;
 
@@ -395,3 +402,1023 @@ TEST_FULL_TREE_DELETE(11);
 TEST_FULL_TREE_DELETE(12);
 TEST_FULL_TREE_DELETE(13);
 TEST_FULL_TREE_DELETE(14);
+
+TEST(RBTreeSerialization, SaveLoadRoundTrip) {
+  for (int size : {0, 1, 2, 3, 7, 8, 100, 1023, 1024, 1025}) {
+    trilib::RBTree<int, less<int>> rbtree;
+    for (int i = 0; i < size; ++i) {
+      rbtree.Insert((i * 7919) % size);
+    }
+    stringstream stream;
+    ASSERT_TRUE(rbtree.SaveTo(stream));
+
+    trilib::RBTree<int, less<int>> loaded;
+    loaded.Insert(-1);
+    ASSERT_TRUE(loaded.LoadFrom(stream)) << "size == " << size;
+    ASSERT_EQ(rbtree.size(), loaded.size());
+    ASSERT_TRUE(loaded.IsBinarySearchTree());
+    ASSERT_TRUE(loaded.IsBlackProperty()) << "size == " << size;
+    ASSERT_TRUE(loaded.IsRedHasTwoBlacks()) << "size == " << size;
+    ASSERT_TRUE(std::equal(rbtree.begin(), rbtree.end(), loaded.begin()));
+
+    // Loaded tree must be fully functional.
+    loaded.Insert(size);
+    loaded.Delete(0);
+    ASSERT_TRUE(loaded.IsBlackProperty());
+    ASSERT_TRUE(loaded.IsRedHasTwoBlacks());
+  }
+}
+
+TEST(RBTreeSerialization, StringCodec) {
+  trilib::RBTree<string, less<string>> rbtree;
+  for (const char* word : {"delta", "alpha", "", "charlie", "bravo"}) {
+    rbtree.Insert(word);
+  }
+  stringstream stream;
+  ASSERT_TRUE(rbtree.SaveTo<trilib::StringCodec>(stream));
+
+  trilib::RBTree<string, less<string>> loaded;
+  ASSERT_TRUE(loaded.LoadFrom<trilib::StringCodec>(stream));
+  ASSERT_EQ(5u, loaded.size());
+  ASSERT_TRUE(std::equal(rbtree.begin(), rbtree.end(), loaded.begin()));
+}
+
+TEST(RBTreeSerialization, DetectsCorruption) {
+  trilib::RBTree<int, less<int>> rbtree;
+  for (int i = 0; i < 100; ++i) {
+    rbtree.Insert(i);
+  }
+  stringstream stream;
+  ASSERT_TRUE(rbtree.SaveTo(stream));
+  const string data = stream.str();
+
+  trilib::RBTree<int, less<int>> loaded;
+  string corrupted = data;
+  corrupted[data.size() / 2] ^= 0x10;
+  stringstream corrupted_stream(corrupted);
+  EXPECT_FALSE(loaded.LoadFrom(corrupted_stream));
+  EXPECT_TRUE(loaded.empty());
+
+  stringstream truncated_stream(data.substr(0, data.size() - 9));
+  EXPECT_FALSE(loaded.LoadFrom(truncated_stream));
+  EXPECT_TRUE(loaded.empty());
+
+  stringstream garbage_stream("definitely not a tree");
+  EXPECT_FALSE(loaded.LoadFrom(garbage_stream));
+  EXPECT_TRUE(loaded.empty());
+}
+
+TEST(RBTreeSerialization, FileDescriptor) {
+  trilib::RBTree<int, less<int>> rbtree;
+  for (int i = 0; i < 100000; ++i) {
+    rbtree.Insert(i * 3);
+  }
+  FILE* file = tmpfile();
+  ASSERT_NE(nullptr, file);
+  ASSERT_TRUE(rbtree.SaveTo(fileno(file)));
+  rewind(file);
+
+  trilib::RBTree<int, less<int>> loaded;
+  ASSERT_TRUE(loaded.LoadFrom(fileno(file)));
+  fclose(file);
+  ASSERT_EQ(rbtree.size(), loaded.size());
+  ASSERT_TRUE(loaded.IsBlackProperty());
+  ASSERT_TRUE(std::equal(rbtree.begin(), rbtree.end(), loaded.begin()));
+}
+
+TEST_F(FullTreeFixture, CopyConstructor) {
+  trilib::RBTree<int, less<int>> copy(rbtree);
+  ASSERT_EQ(rbtree.size(), copy.size());
+  ASSERT_TRUE(std::equal(rbtree.begin(), rbtree.end(), copy.begin()));
+  ASSERT_TRUE(copy.IsBinarySearchTree());
+  ASSERT_TRUE(copy.IsBlackProperty());
+  ASSERT_TRUE(copy.IsRedHasTwoBlacks());
+
+  // Both are independent.
+  copy.Delete(8);
+  rbtree.Delete(1);
+  EXPECT_TRUE(rbtree.HasValue(8));
+  EXPECT_TRUE(copy.HasValue(1));
+  EXPECT_EQ(14u, copy.size());
+  EXPECT_EQ(14u, rbtree.size());
+}
+
+TEST_F(FullTreeFixture, CopyAssignment) {
+  trilib::RBTree<int, less<int>> copy;
+  copy.Insert(100);
+  copy = rbtree;
+  ASSERT_EQ(rbtree.size(), copy.size());
+  ASSERT_FALSE(copy.HasValue(100));
+  ASSERT_TRUE(std::equal(rbtree.begin(), rbtree.end(), copy.begin()));
+  copy = copy;
+  ASSERT_EQ(rbtree.size(), copy.size());
+}
+
+TEST_F(FullTreeFixture, Move) {
+  trilib::RBTree<int, less<int>> moved(std::move(rbtree));
+  EXPECT_EQ(15u, moved.size());
+  EXPECT_TRUE(rbtree.empty());
+  EXPECT_EQ(rbtree.begin(), rbtree.end());
+
+  trilib::RBTree<int, less<int>> assigned;
+  assigned.Insert(100);
+  assigned = std::move(moved);
+  EXPECT_EQ(15u, assigned.size());
+  EXPECT_FALSE(assigned.HasValue(100));
+  EXPECT_TRUE(moved.empty());
+  ASSERT_TRUE(assigned.IsBlackProperty());
+
+  // Moved from tree is usable.
+  moved.Insert(1);
+  EXPECT_TRUE(moved.HasValue(1));
+}
+
+TEST(RBTreeInt, ParallelClone) {
+  trilib::RBTree<int, less<int>> rbtree;
+  for (int i = 0; i < 100000; ++i) {
+    rbtree.Insert((i * 7919) % 100000);
+  }
+  for (unsigned threads : {0u, 1u, 2u, 3u, 8u}) {
+    trilib::RBTree<int, less<int>> copy = rbtree.Clone(threads);
+    ASSERT_EQ(rbtree.size(), copy.size());
+    ASSERT_TRUE(std::equal(rbtree.begin(), rbtree.end(), copy.begin()));
+    ASSERT_TRUE(copy.IsBinarySearchTree());
+    ASSERT_TRUE(copy.IsBlackProperty());
+    ASSERT_TRUE(copy.IsRedHasTwoBlacks());
+  }
+}
+
+TEST_F(FullTreeFixture, ExtractInsert) {
+  const int* address = &*rbtree.Search(8);
+  auto handle = rbtree.Extract(rbtree.Search(8));
+  ASSERT_FALSE(handle.empty());
+  EXPECT_EQ(8, handle.value());
+  EXPECT_EQ(14u, rbtree.size());
+  EXPECT_FALSE(rbtree.HasValue(8));
+  ASSERT_TRUE(rbtree.IsBinarySearchTree());
+  ASSERT_TRUE(rbtree.IsBlackProperty());
+  ASSERT_TRUE(rbtree.IsRedHasTwoBlacks());
+
+  handle.value() = 20;
+  auto iter = rbtree.Insert(std::move(handle));
+  EXPECT_TRUE(handle.empty());
+  EXPECT_EQ(20, *iter);
+  EXPECT_EQ(address, &*iter);  // the same node
+  EXPECT_EQ(15u, rbtree.size());
+  ASSERT_TRUE(rbtree.IsBinarySearchTree());
+  ASSERT_TRUE(rbtree.IsBlackProperty());
+  ASSERT_TRUE(rbtree.IsRedHasTwoBlacks());
+
+  EXPECT_TRUE(rbtree.Extract(100).empty());
+  EXPECT_EQ(rbtree.end(), rbtree.Insert(decltype(handle)()));
+}
+
+TEST_F(FullTreeFixture, ExtractToOtherTree) {
+  trilib::RBTree<int, less<int>> other;
+  for (int i = 1; i < 16; i += 2) {
+    other.Insert(rbtree.Extract(i));
+  }
+  EXPECT_EQ(7u, rbtree.size());
+  EXPECT_EQ(8u, other.size());
+  int expected = 1;
+  for (int x : other) {
+    EXPECT_EQ(expected, x);
+    expected += 2;
+  }
+  ASSERT_TRUE(other.IsBlackProperty());
+  ASSERT_TRUE(other.IsRedHasTwoBlacks());
+  ASSERT_TRUE(rbtree.IsBlackProperty());
+  ASSERT_TRUE(rbtree.IsRedHasTwoBlacks());
+}
+
+TEST(RBTreeInt, Merge) {
+  trilib::RBTree<int, less<int>> rbtree;
+  trilib::RBTree<int, less<int>> other;
+  for (int i = 0; i < 1000; ++i) {
+    (i % 3 == 0 ? other : rbtree).Insert(i);
+  }
+  rbtree.Merge(other);
+  EXPECT_TRUE(other.empty());
+  EXPECT_EQ(other.begin(), other.end());
+  ASSERT_EQ(1000u, rbtree.size());
+  int expected = 0;
+  for (int x : rbtree) {
+    ASSERT_EQ(expected++, x);
+  }
+  ASSERT_TRUE(rbtree.IsBlackProperty());
+  ASSERT_TRUE(rbtree.IsRedHasTwoBlacks());
+  rbtree.Merge(rbtree);
+  EXPECT_EQ(1000u, rbtree.size());
+}
+
+template <typename BalanceT>
+class BalancePolicyTest : public ::testing::Test {
+ protected:
+  using Tree = trilib::RBTree<int, less<int>, BalanceT>;
+};
+
+using BalancePolicies =
+    ::testing::Types<trilib::RedBlackBalance, trilib::AvlBalance,
+                     trilib::WavlBalance, trilib::RelaxedRedBlackBalance>;
+TYPED_TEST_SUITE(BalancePolicyTest, BalancePolicies, );
+
+TYPED_TEST(BalancePolicyTest, InsertDeletePerm) {
+  typename TestFixture::Tree tree;
+  constexpr int my_prime = 10007;
+  constexpr int iter_val = 5678;
+  int val = 0;
+  for (int i = 0; i < 5000; ++i) {
+    val = (val + iter_val) % my_prime;
+    tree.Insert(val);
+    ASSERT_TRUE(tree.IsBalanced()) << "after inserting " << val;
+  }
+  ASSERT_TRUE(tree.IsBinarySearchTree());
+  val = 0;
+  for (int i = 0; i < 5000; ++i) {
+    val = (val + 2 * iter_val) % my_prime;
+    tree.Delete(val);
+    ASSERT_TRUE(tree.IsBalanced()) << "after deleting " << val;
+  }
+  ASSERT_TRUE(tree.IsBinarySearchTree());
+}
+
+TYPED_TEST(BalancePolicyTest, IncreasingAndDuplicates) {
+  typename TestFixture::Tree tree;
+  for (int i = 0; i < 2000; ++i) {
+    tree.Insert(i / 3);
+    ASSERT_TRUE(tree.IsBalanced()) << "after inserting " << i;
+  }
+  for (int i = 0; i < 2000; ++i) {
+    tree.Delete(tree.begin());
+    ASSERT_TRUE(tree.IsBalanced()) << "after deleting " << i;
+  }
+  ASSERT_TRUE(tree.empty());
+}
+
+TYPED_TEST(BalancePolicyTest, AllPermInsertDelete) {
+  constexpr int size = 6;
+  int values[size];
+  int del_values[size];
+  for (int i = 0; i < size; ++i) {
+    values[i] = i;
+    del_values[i] = i;
+  }
+  const int perm_num = factorial(size);
+  for (int perm_ins = 0; perm_ins < perm_num; ++perm_ins) {
+    for (int perm_del = 0; perm_del < perm_num; ++perm_del) {
+      typename TestFixture::Tree tree;
+      for (int i = 0; i < size; ++i) {
+        tree.Insert(values[i]);
+        ASSERT_TRUE(tree.IsBalanced());
+      }
+      for (int i = 0; i < size; ++i) {
+        tree.Delete(del_values[i]);
+        ASSERT_TRUE(tree.IsBalanced()) << "perm_ins == " << perm_ins
+                                       << " && perm_del == " << perm_del
+                                       << " && i == " << i;
+      }
+      std::next_permutation(del_values, del_values + size);
+    }
+    std::next_permutation(values, values + size);
+  }
+}
+
+TYPED_TEST(BalancePolicyTest, LoadAndClone) {
+  for (int size : {0, 1, 2, 5, 100, 1023, 1025}) {
+    typename TestFixture::Tree tree;
+    for (int i = 0; i < size; ++i) {
+      tree.Insert(i);
+    }
+    stringstream stream;
+    ASSERT_TRUE(tree.SaveTo(stream));
+    typename TestFixture::Tree loaded;
+    ASSERT_TRUE(loaded.LoadFrom(stream));
+    ASSERT_TRUE(loaded.IsBalanced()) << "size == " << size;
+    typename TestFixture::Tree copy(loaded);
+    ASSERT_TRUE(copy.IsBalanced());
+    for (int i = 0; i < size; i += 2) {
+      copy.Delete(i);
+      ASSERT_TRUE(copy.IsBalanced());
+    }
+    ASSERT_EQ(static_cast<size_t>(size / 2), copy.size());
+  }
+}
+
+TEST(RBTreeLookupCache, HitsAndInvalidation) {
+  trilib::RBTree<int, less<int>, trilib::RedBlackBalance,
+                 trilib::LookupCache<4, 2>>
+      tree;
+  for (int i = 0; i < 100; ++i) {
+    tree.Insert(i);
+  }
+  for (int round = 0; round < 10; ++round) {
+    ASSERT_TRUE(tree.HasValue(7));
+    ASSERT_EQ(42, *tree.Search(42));
+  }
+  EXPECT_EQ(18u, tree.cache_stats().hits);
+  EXPECT_EQ(2u, tree.cache_stats().misses);
+  EXPECT_DOUBLE_EQ(0.9, tree.cache_stats().hit_rate());
+
+  // The cached node is freed, a stale entry would be a use after free.
+  tree.Delete(42);
+  ASSERT_FALSE(tree.HasValue(42));
+  ASSERT_TRUE(tree.HasValue(7));
+  // Deleting other nodes moves values between nodes of a two-child delete,
+  // cached nodes must still hold the looked up values.
+  for (int i = 0; i < 100; i += 3) {
+    tree.Delete(i);
+    for (int j = 0; j < 100; ++j) {
+      ASSERT_EQ((j % 3 != 0 || j > i) && j != 42, tree.HasValue(j));
+    }
+  }
+  trilib::RBTree<int, less<int>, trilib::RedBlackBalance,
+                 trilib::LookupCache<4, 2>>
+      other;
+  other.Insert(1000);
+  other.HasValue(1000);
+  ASSERT_EQ(1, tree.Extract(tree.Search(1)).value());
+  tree = std::move(other);
+  ASSERT_TRUE(tree.HasValue(1000));
+  ASSERT_FALSE(tree.HasValue(7));
+  ASSERT_FALSE(other.HasValue(1000));
+}
+
+TEST(RBTreeLookupCache, IteratorsStayValid) {
+  trilib::RBTree<int, less<int>, trilib::AvlBalance, trilib::LookupCache<16>>
+      tree;
+  for (int i = 0; i < 50; ++i) {
+    tree.Insert(i);
+  }
+  auto iter = tree.Search(10);
+  ASSERT_EQ(10, *tree.Search(10));
+  tree.Delete(11);
+  ++iter;
+  ASSERT_EQ(12, *iter);
+  ASSERT_EQ(iter, tree.Search(12));
+  tree.Clear();
+  ASSERT_FALSE(tree.HasValue(10));
+}
+
+TEST(RBTreeInt, FingerSearch) {
+  trilib::RBTree<int, less<int>> tree;
+  for (int i = 0; i < 300; ++i) {
+    tree.Insert(2 * i);
+  }
+  tree.Insert(100);
+  tree.Insert(100);
+  for (int from = 0; from < 300; ++from) {
+    auto start = tree.Search(2 * from);
+    for (int value = -2; value < 602; ++value) {
+      auto found = tree.Search(start, value);
+      if (value % 2 == 0 && value >= 0 && value < 600) {
+        ASSERT_NE(tree.end(), found) << from << " " << value;
+        ASSERT_EQ(value, *found);
+      } else {
+        ASSERT_EQ(tree.end(), found) << from << " " << value;
+      }
+      ASSERT_EQ(tree.LowerBound(value), tree.LowerBound(start, value))
+          << from << " " << value;
+    }
+  }
+  ASSERT_EQ(tree.Search(8), tree.Search(tree.end(), 8));
+  ASSERT_EQ(tree.LowerBound(8), tree.LowerBound(tree.end(), 8));
+
+  const trilib::RBTree<int, less<int>>& const_tree = tree;
+  auto iter = const_tree.begin();
+  for (int value = 1; value < 598; value += 2) {
+    iter = const_tree.LowerBound(iter, value);
+    ASSERT_EQ(value + 1, *iter);
+  }
+}
+
+TEST(RBTreeCompact, Layouts) {
+  using Node = trilib::RBTreeNode<int>;
+  for (trilib::NodeLayout layout :
+       {trilib::NodeLayout::kInOrder, trilib::NodeLayout::kBreadthFirst,
+        trilib::NodeLayout::kVanEmdeBoas}) {
+    trilib::RBTree<int, less<int>> tree;
+    for (int i = 0; i < 1000; ++i) {
+      tree.Insert((i * 7919) % 1000);
+    }
+    for (int i = 0; i < 1000; i += 2) {
+      tree.Delete(i);
+    }
+    tree.Compact(layout);
+    ASSERT_FALSE(tree.compacting());
+    ASSERT_EQ(500u, tree.size());
+    ASSERT_TRUE(tree.IsBinarySearchTree());
+    ASSERT_TRUE(tree.IsBalanced());
+    // All nodes are in one block of 500 nodes.
+    const char* first = reinterpret_cast<const char*>(&*tree.begin());
+    const char* low = first;
+    const char* high = first;
+    int expected = 1;
+    for (const int& value : tree) {
+      ASSERT_EQ(expected, value);
+      expected += 2;
+      low = min(low, reinterpret_cast<const char*>(&value));
+      high = max(high, reinterpret_cast<const char*>(&value));
+    }
+    ASSERT_EQ(499 * sizeof(Node), static_cast<size_t>(high - low));
+    if (layout == trilib::NodeLayout::kInOrder) {
+      ASSERT_EQ(first, low);
+    }
+
+    // Freed slots are reused by inserts.
+    tree.Delete(11);
+    tree.Insert(10);
+    const char* reused = reinterpret_cast<const char*>(&*tree.Search(10));
+    ASSERT_TRUE(reused >= low && reused <= high);
+    ASSERT_EQ(10, tree.Extract(tree.Search(10)).value());
+    tree.Insert(10);
+    ASSERT_TRUE(tree.HasValue(10));
+  }
+}
+
+TEST(RBTreeCompact, IncrementalWithChanges) {
+  trilib::RBTree<string, less<string>, trilib::AvlBalance,
+                 trilib::LookupCache<64>>
+      tree;
+  for (int i = 0; i < 2000; ++i) {
+    tree.Insert(to_string(i * 37 % 2000));
+  }
+  tree.Compact(trilib::NodeLayout::kBreadthFirst);
+  tree.StartCompaction(trilib::NodeLayout::kVanEmdeBoas);
+  ASSERT_TRUE(tree.compacting());
+  set<string> expected;
+  for (int i = 0; i < 2000; ++i) {
+    expected.insert(to_string(i));
+  }
+  auto extracted = tree.Extract(tree.Search("5"));
+  expected.erase("5");
+  int step = 0;
+  while (!tree.CompactStep(50)) {
+    ++step;
+    const string deleted = to_string(step * 13 % 2000);
+    tree.Delete(deleted);
+    expected.erase(deleted);
+    ASSERT_TRUE(tree.HasValue(to_string(step * 29 % 2000)) ==
+                (expected.count(to_string(step * 29 % 2000)) > 0));
+    const string added = "x" + to_string(step);
+    tree.Insert(added);
+    expected.insert(added);
+    ASSERT_TRUE(tree.IsBalanced());
+  }
+  ASSERT_EQ("5", extracted.value());
+  ASSERT_EQ(expected.size(), tree.size());
+  ASSERT_TRUE(equal(expected.begin(), expected.end(), tree.begin()));
+
+  tree.StartCompaction(trilib::NodeLayout::kInOrder);
+  tree.CompactStep(10);
+  tree.Delete(*tree.begin());
+  trilib::RBTree<string, less<string>, trilib::AvlBalance,
+                 trilib::LookupCache<64>>
+      copy(tree);
+  ASSERT_TRUE(equal(copy.begin(), copy.end(), tree.begin()));
+  trilib::RBTree<string, less<string>, trilib::AvlBalance,
+                 trilib::LookupCache<64>>
+      other;
+  other.Insert("y");
+  other.Compact();
+  other.Merge(tree);
+  ASSERT_FALSE(tree.compacting());
+  ASSERT_EQ(copy.size() + 1, other.size());
+  tree = std::move(other);
+  ASSERT_EQ(copy.size() + 1, tree.size());
+  // Destroyed in the middle, with some nodes deleted and not moved yet.
+  tree.StartCompaction(trilib::NodeLayout::kInOrder);
+  tree.CompactStep(100);
+  tree.Delete(to_string(1999));
+}
+
+TEST(RBTreeParallel, ForEachAndReduce) {
+  trilib::RBTree<int, less<int>> tree;
+  ASSERT_EQ(0, tree.ParallelReduce(0, [](int v) { return v; },
+                                   [](int a, int b) { return a + b; }, 4));
+  for (int i = 0; i < 5000; ++i) {
+    tree.Insert((i * 7919) % 5000);
+  }
+  tree.Insert(42);
+  for (unsigned threads : {1u, 2u, 3u, 8u, 0u}) {
+    atomic<long> sum(0);
+    atomic<int> count(0);
+    tree.ParallelForEach(
+        [&](int v) {
+          sum += v;
+          ++count;
+        },
+        threads);
+    ASSERT_EQ(5001, count.load());
+    ASSERT_EQ(4999L * 5000 / 2 + 42, sum.load());
+
+    // Non-commutative combine sees values in order.
+    const vector<int> ordered = tree.ParallelReduce(
+        vector<int>(), [](int v) { return vector<int>(1, v); },
+        [](vector<int> a, const vector<int>& b) {
+          a.insert(a.end(), b.begin(), b.end());
+          return a;
+        },
+        threads);
+    ASSERT_TRUE(equal(ordered.begin(), ordered.end(), tree.begin()));
+    ASSERT_EQ(tree.size(), ordered.size());
+
+    const string digits = tree.ParallelReduce(
+        40, 60, string(), [](int v) { return to_string(v % 10); },
+        [](const string& a, const string& b) { return a + b; }, threads);
+    ASSERT_EQ("012234567890123456789", digits);
+
+    count = 0;
+    tree.ParallelForEach(100, 200, [&](int v) { count += v >= 100 && v < 200; },
+                         threads);
+    ASSERT_EQ(100, count.load());
+    ASSERT_TRUE(tree.ParallelReduce(
+        -1, -1, true, [](int) { return false; },
+        [](bool a, bool b) { return a && b; }, threads));
+  }
+}
+
+TEST(RBTreeInt, PriorityQueue) {
+  trilib::RBTree<int, less<int>, trilib::RedBlackBalance,
+                 trilib::LookupCache<16>>
+      tree;
+  multiset<int> expected;
+  ASSERT_EQ(tree.end(), tree.begin());
+  ASSERT_EQ(tree.end(), --tree.end());
+  unsigned seed = 1;
+  for (int i = 0; i < 20000; ++i) {
+    seed = seed * 1103515245 + 12345;
+    const int value = (seed >> 16) % 1000;
+    switch ((seed >> 8) % 5) {
+      case 0:
+        if (!expected.empty()) {
+          ASSERT_EQ(*expected.begin(), tree.PopMin());
+          expected.erase(expected.begin());
+        }
+        break;
+      case 1:
+        if (!expected.empty()) {
+          ASSERT_EQ(*expected.rbegin(), tree.PopMax());
+          expected.erase(prev(expected.end()));
+        }
+        break;
+      case 2:
+        if (expected.count(value) > 0) {
+          ASSERT_TRUE(tree.HasValue(value));
+          tree.Delete(value);
+          expected.erase(expected.find(value));
+        }
+        break;
+      default:
+        tree.Insert(value);
+        expected.insert(value);
+    }
+    if (i % 5000 == 0) {
+      tree.Compact();
+    }
+    ASSERT_EQ(expected.size(), tree.size());
+    if (!expected.empty()) {
+      ASSERT_EQ(*expected.begin(), tree.Min());
+      ASSERT_EQ(*expected.rbegin(), tree.Max());
+      ASSERT_EQ(&tree.Min(), &*tree.begin());
+      ASSERT_EQ(&tree.Max(), &*--tree.end());
+    }
+  }
+  trilib::RBTree<int, less<int>, trilib::RedBlackBalance,
+                 trilib::LookupCache<16>>
+      copy(tree);
+  ASSERT_EQ(tree.Min(), copy.Min());
+  ASSERT_EQ(tree.Max(), copy.Max());
+}
+
+struct PtrLess {
+  bool operator()(const unique_ptr<int>& a, const unique_ptr<int>& b) const {
+    return *a < *b;
+  }
+};
+
+TEST(RBTreeInt, PopMovesValueOut) {
+  trilib::RBTree<unique_ptr<int>, PtrLess> tree;
+  for (int i = 0; i < 10; ++i) {
+    tree.Insert(unique_ptr<int>(new int(i)));
+  }
+  unique_ptr<int> min = tree.PopMin();
+  unique_ptr<int> max = tree.PopMax();
+  EXPECT_EQ(0, *min);
+  EXPECT_EQ(9, *max);
+  EXPECT_EQ(1, *tree.Min());
+  EXPECT_EQ(8, *tree.Max());
+  EXPECT_EQ(8u, tree.size());
+}
+
+TYPED_TEST(BalancePolicyTest, UpdateKey) {
+  typename TestFixture::Tree tree;
+  multiset<int> expected;
+  for (int i = 0; i < 500; ++i) {
+    tree.Insert(i * 2);
+    expected.insert(i * 2);
+  }
+  unsigned seed = 7;
+  for (int i = 0; i < 5000; ++i) {
+    seed = seed * 1103515245 + 12345;
+    const int old_value = *next(expected.begin(), (seed >> 8) % 500);
+    seed = seed * 1103515245 + 12345;
+    // Mostly small moves, like deadline updates, sometimes far ones.
+    const int delta = i % 10 == 0 ? int(seed >> 16) % 2000 - 1000
+                                  : int(seed >> 16) % 7 - 3;
+    auto iter = tree.Search(old_value);
+    const int* address = &*iter;
+    auto updated = tree.UpdateKey(iter, old_value + delta);
+    ASSERT_EQ(address, &*updated);
+    ASSERT_EQ(old_value + delta, *updated);
+    expected.erase(expected.find(old_value));
+    expected.insert(old_value + delta);
+    ASSERT_TRUE(tree.IsBalanced()) << "i == " << i;
+    ASSERT_EQ(expected.size(), tree.size());
+    ASSERT_EQ(*expected.begin(), tree.Min());
+    ASSERT_EQ(*expected.rbegin(), tree.Max());
+  }
+  ASSERT_TRUE(equal(expected.begin(), expected.end(), tree.begin()));
+}
+
+TYPED_TEST(BalancePolicyTest, SelectAndRank) {
+  using Tree = trilib::RBTree<int, less<int>, TypeParam, trilib::NoLookupCache,
+                              trilib::SubtreeSize>;
+  Tree tree;
+  multiset<int> expected;
+  auto check = [&expected](const Tree& checked) {
+    ASSERT_EQ(expected.size(), checked.size());
+    ASSERT_TRUE(checked.Select(expected.size()) == checked.end());
+    size_t k = 0;
+    for (int value : expected) {
+      ASSERT_EQ(value, *checked.Select(k)) << "k == " << k;
+      ASSERT_EQ(static_cast<size_t>(distance(
+                    expected.begin(), expected.lower_bound(value))),
+                checked.Rank(value));
+      ++k;
+    }
+  };
+  unsigned seed = 11;
+  for (int i = 0; i < 3000; ++i) {
+    seed = seed * 1103515245 + 12345;
+    const int value = (seed >> 16) % 1000;
+    if (i % 3 == 2) {
+      auto victim = expected.lower_bound(value);
+      if (victim != expected.end()) {
+        tree.Delete(*victim);
+        expected.erase(victim);
+      }
+    } else if (i % 7 == 6 && !expected.empty()) {
+      tree.UpdateKey(tree.begin(), value);
+      expected.erase(expected.begin());
+      expected.insert(value);
+    } else {
+      tree.Insert(value);
+      expected.insert(value);
+    }
+    if (i % 100 == 0) {
+      check(tree);
+    }
+  }
+  check(tree);
+  check(Tree(tree));
+  stringstream stream;
+  ASSERT_TRUE(tree.SaveTo(stream));
+  Tree loaded;
+  ASSERT_TRUE(loaded.LoadFrom(stream));
+  check(loaded);
+  tree.Compact(trilib::NodeLayout::kVanEmdeBoas);
+  check(tree);
+  tree.PopMin();
+  expected.erase(expected.begin());
+  check(tree);
+}
+
+TEST(RBTreeHash, RootHashAndDiff) {
+  using Tree = trilib::RBTree<int, less<int>, trilib::RedBlackBalance,
+                              trilib::NoLookupCache, trilib::SubtreeHash>;
+  Tree replica;
+  Tree primary;
+  EXPECT_EQ(primary.RootHash(), replica.RootHash());
+  for (int i = 0; i < 3000; ++i) {
+    primary.Insert(i);
+    replica.Insert(2999 - i);  // different shape
+  }
+  EXPECT_EQ(primary.RootHash(), replica.RootHash());
+  EXPECT_EQ(0u, primary.Diff(replica, [](int, bool) { FAIL(); }));
+  // Few changes on both sides, a duplicate and a value updated in place.
+  primary.Delete(17);
+  primary.Insert(5000);
+  primary.Insert(1200);
+  replica.Delete(2998);
+  replica.Insert(-1);
+  replica.UpdateKey(replica.Search(700), 700);
+  replica.UpdateKey(replica.Search(701), 1500);
+  EXPECT_NE(primary.RootHash(), replica.RootHash());
+  vector<pair<int, bool>> diffs;
+  const size_t count = primary.Diff(replica, [&diffs](int value, bool mine) {
+    diffs.emplace_back(value, mine);
+  });
+  const vector<pair<int, bool>> expected = {
+      {-1, false}, {17, false}, {701, true}, {1200, true},
+      {1500, false}, {2998, true}, {5000, true}};
+  EXPECT_EQ(expected, diffs);
+  EXPECT_EQ(expected.size(), count);
+  // Applying the diff makes hashes equal again.
+  for (const auto& diff : diffs) {
+    if (diff.second) {
+      replica.Insert(diff.first);
+    } else {
+      replica.Delete(diff.first);
+    }
+  }
+  EXPECT_EQ(primary.RootHash(), replica.RootHash());
+  EXPECT_EQ(0u, replica.Diff(primary, [](int, bool) { FAIL(); }));
+  // Long runs of duplicates, one side empty.
+  Tree dups;
+  for (int i = 0; i < 100; ++i) {
+    dups.Insert(i < 60 ? 1 : 2);
+  }
+  Tree fewer_dups = dups;
+  fewer_dups.Delete(1);
+  fewer_dups.Delete(2);
+  EXPECT_EQ(2u, dups.Diff(fewer_dups, [](int, bool mine) {
+    EXPECT_TRUE(mine);
+  }));
+  EXPECT_EQ(100u, dups.Diff(Tree(), [](int, bool) {}));
+  EXPECT_EQ(2, *dups.Select(60));
+}
+
+TEST(RBTreeHash, RandomDiffs) {
+  using Tree = trilib::RBTree<int, less<int>, trilib::AvlBalance,
+                              trilib::NoLookupCache, trilib::SubtreeHash>;
+  unsigned seed = 5;
+  for (unsigned round = 0; round < 20; ++round) {
+    Tree first;
+    Tree second;
+    multiset<int> first_values;
+    multiset<int> second_values;
+    for (int i = 0; i < 2000; ++i) {
+      seed = seed * 1103515245 + 12345;
+      const int value = (seed >> 16) % 1500;
+      // Up to few percent of values go to only one of the trees.
+      const unsigned side = (seed >> 4) % 100;
+      if (side != round) {
+        first.Insert(value);
+        first_values.insert(value);
+      }
+      if (side != round + 1) {
+        second.Insert(value);
+        second_values.insert(value);
+      }
+    }
+    // Extra copies of a value on one side.
+    vector<pair<int, bool>> expected;
+    for (int value = 0; value < 1500; ++value) {
+      const size_t in_first = first_values.count(value);
+      const size_t in_second = second_values.count(value);
+      for (size_t i = in_second; i < in_first; ++i) {
+        expected.emplace_back(value, true);
+      }
+      for (size_t i = in_first; i < in_second; ++i) {
+        expected.emplace_back(value, false);
+      }
+    }
+    vector<pair<int, bool>> diffs;
+    first.Diff(second, [&diffs](int value, bool mine) {
+      diffs.emplace_back(value, mine);
+    });
+    ASSERT_EQ(expected, diffs) << "round == " << round;
+  }
+}
+
+TEST(RBTreeRelaxed, DeferredRebalancing) {
+  trilib::RBTree<int, less<int>, trilib::RelaxedRedBlackBalance> tree;
+  multiset<int> expected;
+  unsigned seed = 3;
+  for (int burst = 0; burst < 50; ++burst) {
+    for (int i = 0; i < 200; ++i) {
+      seed = seed * 1103515245 + 12345;
+      const int value = burst % 3 == 0 ? burst * 200 + i : (seed >> 16) % 5000;
+      tree.Insert(value);
+      expected.insert(value);
+    }
+    // Not rebalanced yet, but still searchable and in order.
+    ASSERT_TRUE(tree.IsBalanced());
+    ASSERT_TRUE(tree.IsBlackProperty());
+    ASSERT_TRUE(equal(expected.begin(), expected.end(), tree.begin()));
+    for (int value : expected) {
+      ASSERT_TRUE(tree.HasValue(value));
+    }
+    if (burst % 5 == 4) {
+      trilib::RBTree<int, less<int>, trilib::RelaxedRedBlackBalance> copy =
+          tree;
+      ASSERT_TRUE(copy.IsBalanced());
+      ASSERT_TRUE(copy.Rebalance());
+      ASSERT_TRUE(copy.IsRedHasTwoBlacks());
+    }
+    while (!tree.Rebalance(10)) {
+      ASSERT_TRUE(tree.IsBalanced());
+    }
+    ASSERT_TRUE(tree.IsRedHasTwoBlacks());
+    for (int i = 0; i < 20; ++i) {
+      tree.Insert(i);
+      expected.insert(i);
+      seed = seed * 1103515245 + 12345;
+      auto victim = next(expected.begin(), (seed >> 16) % expected.size());
+      tree.Delete(*victim);
+      expected.erase(victim);
+      ASSERT_TRUE(tree.IsBalanced());
+    }
+    ASSERT_EQ(expected.size(), tree.size());
+  }
+  tree.Compact();
+  ASSERT_TRUE(tree.IsBalanced());
+  ASSERT_TRUE(equal(expected.begin(), expected.end(), tree.begin()));
+}
+
+template <typename TreeT>
+void ExpectShifted(const TreeT& tree, const multiset<int64_t>& expected) {
+  ASSERT_EQ(expected.size(), tree.size());
+  ASSERT_TRUE(equal(expected.begin(), expected.end(), tree.begin()));
+  typename TreeT::const_iterator it = tree.end();
+  for (auto value = expected.rbegin(); value != expected.rend(); ++value) {
+    ASSERT_EQ(*value, *--it);
+  }
+  ASSERT_TRUE(tree.IsBalanced());
+  if (!expected.empty()) {
+    ASSERT_EQ(*expected.begin(), tree.Min());
+    ASSERT_EQ(*expected.rbegin(), tree.Max());
+  }
+}
+
+TEST(RBTreeShift, MatchesMultiset) {
+  using Tree = trilib::RBTree<int64_t, less<int64_t>, trilib::AvlBalance,
+                              trilib::NoLookupCache,
+                              trilib::KeyOffset<int64_t>>;
+  Tree tree;
+  multiset<int64_t> expected;
+  unsigned seed = 7;
+  for (int round = 0; round < 300; ++round) {
+    for (int i = 0; i < 20; ++i) {
+      seed = seed * 1103515245 + 12345;
+      const int64_t value = (seed >> 16) % 10000;
+      tree.Insert(value);
+      expected.insert(value);
+    }
+    seed = seed * 1103515245 + 12345;
+    const int64_t key = (seed >> 16) % 10000;
+    const int64_t delta = int64_t((seed >> 4) % 2001) - 1000;
+    if (round % 10 == 9) {
+      tree.ShiftAll(delta);
+      multiset<int64_t> shifted;
+      for (int64_t value : expected) {
+        shifted.insert(value + delta);
+      }
+      expected.swap(shifted);
+    } else {
+      tree.ShiftFrom(key, delta);
+      multiset<int64_t> shifted;
+      for (int64_t value : expected) {
+        shifted.insert(value < key ? value : value + delta);
+      }
+      expected.swap(shifted);
+    }
+    // Lookups descend through pending offsets.
+    for (int i = 0; i < 10; ++i) {
+      seed = seed * 1103515245 + 12345;
+      const int64_t probe = (seed >> 16) % 12000 - 1000;
+      const auto upper = expected.upper_bound(probe);
+      const auto lower = expected.lower_bound(probe);
+      ASSERT_EQ(expected.count(probe) > 0, tree.HasValue(probe));
+      if (upper == expected.end()) {
+        ASSERT_TRUE(tree.LowerBound(probe) == tree.end());
+      } else {
+        ASSERT_EQ(*upper, *tree.LowerBound(probe));
+      }
+      if (lower == expected.begin()) {
+        ASSERT_TRUE(tree.UpperBound(probe) == tree.end());
+      } else {
+        ASSERT_EQ(*prev(lower), *tree.UpperBound(probe));
+      }
+    }
+    for (int i = 0; i < 10 && !expected.empty(); ++i) {
+      seed = seed * 1103515245 + 12345;
+      auto victim = next(expected.begin(), (seed >> 16) % expected.size());
+      tree.Delete(*victim);
+      expected.erase(victim);
+    }
+    ExpectShifted(tree, expected);
+  }
+}
+
+TEST(RBTreeShift, ConstReadsDontWrite) {
+  using Tree = trilib::RBTree<int64_t, less<int64_t>, trilib::RedBlackBalance,
+                              trilib::LookupCache<64, 2>,
+                              trilib::KeyOffset<int64_t>>;
+  Tree tree;
+  vector<Tree::iterator> iters;
+  for (int64_t value = 0; value < 1000; ++value) {
+    iters.push_back(tree.Insert(value * 10));
+  }
+  tree.ShiftFrom(3000, 7);
+  tree.ShiftAll(5);
+  multiset<int64_t> expected;
+  for (int64_t value = 0; value < 10000; value += 10) {
+    expected.insert(value < 3000 ? value + 5 : value + 12);
+  }
+  // Iterators taken before the shifts read nodes directly, one which still
+  // sees its old value shows whether offsets above it were pushed down.
+  size_t stale = 0;
+  while (stale < iters.size() && *iters[stale] != int64_t(stale) * 10) {
+    ++stale;
+  }
+  ASSERT_LT(stale, iters.size());
+  const int64_t shifted = stale < 300 ? stale * 10 + 5 : stale * 10 + 12;
+
+  const Tree& reader = tree;
+  auto read_all = [&]() {
+    for (int64_t value : expected) {
+      EXPECT_TRUE(reader.HasValue(value));
+      EXPECT_EQ(value, *reader.Search(value));
+      EXPECT_EQ(value, *reader.LowerBound(value - 1));
+      EXPECT_EQ(value, *reader.UpperBound(value + 1));
+    }
+    EXPECT_TRUE(equal(expected.begin(), expected.end(), reader.begin()));
+    EXPECT_EQ(shifted, *reader.Search(reader.begin(), shifted));
+  };
+  vector<thread> threads;
+  for (int i = 0; i < 3; ++i) {
+    threads.emplace_back(read_all);
+  }
+  read_all();
+  for (thread& t : threads) {
+    t.join();
+  }
+  ExpectShifted(reader, expected);
+  EXPECT_TRUE(reader.IsBinarySearchTree());
+  atomic<int64_t> sum(0);
+  reader.ParallelForEach([&](int64_t value) { sum += value; }, 4);
+  int64_t expected_sum = 0;
+  for (int64_t value : expected) {
+    expected_sum += value;
+  }
+  EXPECT_EQ(expected_sum, sum.load());
+  EXPECT_EQ(int64_t(stale) * 10, *iters[stale]);
+
+  // A non-const lookup pushes offsets on its path.
+  EXPECT_EQ(shifted, *tree.Search(shifted));
+  EXPECT_EQ(shifted, *iters[stale]);
+}
+
+TEST(RBTreeShift, StaleIterators) {
+  using Tree = trilib::RBTree<int64_t, less<int64_t>, trilib::RedBlackBalance,
+                              trilib::LookupCache<64, 2>,
+                              trilib::KeyOffset<int64_t>>;
+  Tree tree;
+  multiset<int64_t> expected;
+  vector<Tree::iterator> iters;
+  for (int64_t value = 0; value < 1000; ++value) {
+    iters.push_back(tree.Insert(value * 10));
+    expected.insert(value * 10);
+  }
+  ASSERT_TRUE(tree.HasValue(5000));
+  tree.ShiftFrom(5000, 3);
+  tree.ShiftAll(-100);
+  multiset<int64_t> shifted;
+  for (int64_t value : expected) {
+    shifted.insert((value < 5000 ? value : value + 3) - 100);
+  }
+  expected.swap(shifted);
+  ASSERT_FALSE(tree.HasValue(4900));
+  ASSERT_TRUE(tree.HasValue(4903));
+
+  // Iterators taken before the shifts delete and move the right nodes.
+  for (int64_t i = 0; i < 1000; i += 7) {
+    const int64_t value = (i < 500 ? i * 10 : i * 10 + 3) - 100;
+    if (i % 2 == 0) {
+      tree.Delete(iters[i]);
+      expected.erase(expected.find(value));
+    } else {
+      tree.UpdateKey(iters[i], value + 1);
+      expected.erase(expected.find(value));
+      expected.insert(value + 1);
+    }
+    ExpectShifted(tree, expected);
+  }
+  ASSERT_TRUE(tree.IsBinarySearchTree());
+
+  Tree copy = tree;
+  Tree other;
+  other.Insert(-1000);
+  other.ShiftAll(1);
+  other.Merge(copy);
+  expected.insert(-999);
+  ExpectShifted(other, expected);
+  int64_t sum = 0;
+  for (int64_t value : expected) {
+    sum += value;
+  }
+  ASSERT_EQ(sum, other.ParallelReduce(
+                     int64_t(0), [](int64_t value) { return value; },
+                     [](int64_t a, int64_t b) { return a + b; }, 4));
+}
@@ -0,0 +1,145 @@
+#ifndef SLIDING_QUANTILE_H_
+#define SLIDING_QUANTILE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "rbtree.h"
+
+namespace trilib {
+
+// Exact quantiles of a sliding window of samples, e.g. latencies of the last
+// N requests or of the last T seconds. Samples are kept both in a FIFO, in
+// arrival order, and in an RBTree counting nodes of each subtree, so adding,
+// expiring and any quantile query are O(log n). Nodes of expired samples
+// are reused by new ones, so once the window is full nothing is allocated.
+//
+//   trilib::SlidingQuantile<int64_t> latency(100000);  // last 100k samples
+//   latency.Add(micros);
+//   int64_t p99 = latency.Quantile(0.99);
+//
+// For time windows pass timestamps to Add and call ExpireBefore, they must
+// not decrease.
+template <typename ValueT, typename CompT = std::less<ValueT>>
+class SlidingQuantile {
+ public:
+  using TreeT = RBTree<ValueT, CompT, RedBlackBalance, NoLookupCache,
+                       SubtreeSize>;
+
+  // Keeps at most max_samples newest samples, 0 means no limit.
+  explicit SlidingQuantile(size_t max_samples = 0)
+      : max_samples_(max_samples), head_(0), size_(0) {
+    if (max_samples_ > 0) {
+      samples_.resize(max_samples_);
+    }
+  }
+
+  SlidingQuantile(const SlidingQuantile&) = delete;
+  SlidingQuantile& operator=(const SlidingQuantile&) = delete;
+
+  // Adds a sample, dropping the oldest one if the window is full.
+  void Add(ValueT value, uint64_t timestamp = 0) {
+    if (max_samples_ > 0 && size_ == max_samples_) {
+      // The oldest node takes the new value and slot, nothing is freed.
+      Sample& oldest = samples_[head_];
+      oldest.iter = tree_.UpdateKey(oldest.iter, std::move(value));
+      oldest.timestamp = timestamp;
+      head_ = Next(head_);
+      return;
+    }
+    if (size_ == samples_.size()) {
+      Grow();
+    }
+    typename TreeT::iterator iter;
+    if (spare_.empty()) {
+      iter = tree_.Insert(std::move(value));
+    } else {
+      spare_.back().value() = std::move(value);
+      iter = tree_.Insert(std::move(spare_.back()));
+      spare_.pop_back();
+    }
+    samples_[Slot(size_)] = Sample{iter, timestamp};
+    ++size_;
+  }
+
+  // Drops samples added with a timestamp smaller than timestamp.
+  void ExpireBefore(uint64_t timestamp) {
+    while (size_ > 0 && samples_[head_].timestamp < timestamp) {
+      PopOldest();
+    }
+  }
+
+  // Drops the oldest sample, the window must not be empty.
+  void PopOldest() {
+    spare_.push_back(tree_.Extract(samples_[head_].iter));
+    head_ = Next(head_);
+    --size_;
+  }
+
+  // Returns the sample of rank ceil(q * size()) (nearest-rank method), so
+  // Quantile(0.5) is the lower median and Quantile(1) the maximum. q is
+  // clamped to [0, 1]. The window must not be empty.
+  const ValueT& Quantile(double q) const {
+    q = q > 0 ? std::min(q, 1.0) : 0;
+    size_t rank = static_cast<size_t>(std::ceil(q * size_));
+    rank = rank == 0 ? 0 : std::min(rank, size_) - 1;
+    return *tree_.Select(rank);
+  }
+
+  // Returns the number of samples smaller than value.
+  size_t Rank(const ValueT& value) const { return tree_.Rank(value); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  void Clear() {
+    while (size_ > 0) {
+      PopOldest();
+    }
+  }
+
+  // Samples in sorted order.
+  const TreeT& tree() const { return tree_; }
+
+ private:
+  struct Sample {
+    typename TreeT::iterator iter;
+    uint64_t timestamp;
+  };
+
+  size_t Slot(size_t i) const {
+    const size_t slot = head_ + i;
+    return slot < samples_.size() ? slot : slot - samples_.size();
+  }
+
+  size_t Next(size_t slot) const {
+    return slot + 1 == samples_.size() ? 0 : slot + 1;
+  }
+
+  // Doubles the ring buffer of a window without a size limit, the oldest
+  // sample moves to the front.
+  void Grow() {
+    std::vector<Sample> samples(std::max<size_t>(16, 2 * samples_.size()));
+    for (size_t i = 0; i < size_; ++i) {
+      samples[i] = samples_[Slot(i)];
+    }
+    samples_.swap(samples);
+    head_ = 0;
+  }
+
+  TreeT tree_;
+  const size_t max_samples_;
+  std::vector<Sample> samples_;  // ring buffer, oldest at head_
+  size_t head_;
+  size_t size_;
+  // Nodes of expired samples, reused by new ones.
+  std::vector<typename TreeT::node_type> spare_;
+};
+
+}  // trilib
+
+#endif  // SLIDING_QUANTILE_H_
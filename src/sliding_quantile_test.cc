@@ -0,0 +1,80 @@
+#include "sliding_quantile.h"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+using Quantiles = trilib::SlidingQuantile<int64_t>;
+
+// Nearest-rank quantile of samples computed by sorting them.
+int64_t SortedQuantile(const deque<int64_t>& window, double q) {
+  vector<int64_t> sorted(window.begin(), window.end());
+  sort(sorted.begin(), sorted.end());
+  size_t rank = static_cast<size_t>(ceil(q * sorted.size()));
+  rank = rank == 0 ? 0 : min(rank, sorted.size()) - 1;
+  return sorted[rank];
+}
+
+TEST(SlidingQuantile, CountWindow) {
+  Quantiles quantiles(100);
+  deque<int64_t> window;
+  int64_t val = 0;
+  for (int i = 0; i < 1000; ++i) {
+    val = (val + 7919) % 1009;
+    quantiles.Add(val);
+    window.push_back(val);
+    if (window.size() > 100) {
+      window.pop_front();
+    }
+    ASSERT_EQ(window.size(), quantiles.size());
+    for (double q : {0.0, 0.01, 0.5, 0.9, 0.99, 1.0}) {
+      ASSERT_EQ(SortedQuantile(window, q), quantiles.Quantile(q)) << i;
+    }
+  }
+  EXPECT_TRUE(quantiles.tree().IsBalanced());
+  EXPECT_EQ(quantiles.Quantile(0), quantiles.Quantile(-1));
+  EXPECT_EQ(quantiles.Quantile(1), quantiles.Quantile(2));
+  EXPECT_EQ(static_cast<size_t>(count_if(window.begin(), window.end(),
+                                          [](int64_t v) { return v < 500; })),
+            quantiles.Rank(500));
+}
+
+TEST(SlidingQuantile, TimeWindow) {
+  Quantiles quantiles;
+  deque<pair<int64_t, uint64_t>> samples;
+  int64_t val = 0;
+  for (uint64_t now = 0; now < 2000; ++now) {
+    // Bursts of few samples at the same time, the window grows and shrinks.
+    for (int i = 0; i < static_cast<int>(now % 7); ++i) {
+      val = (val + 7919) % 1009;
+      quantiles.Add(val, now);
+      samples.emplace_back(val, now);
+    }
+    const uint64_t horizon = now < 50 + now % 100 ? 0 : now - 50 - now % 100;
+    quantiles.ExpireBefore(horizon);
+    while (!samples.empty() && samples.front().second < horizon) {
+      samples.pop_front();
+    }
+    ASSERT_EQ(samples.size(), quantiles.size());
+    if (samples.empty()) {
+      continue;
+    }
+    deque<int64_t> window;
+    for (const auto& sample : samples) {
+      window.push_back(sample.first);
+    }
+    for (double q : {0.0, 0.5, 0.99, 1.0}) {
+      ASSERT_EQ(SortedQuantile(window, q), quantiles.Quantile(q)) << now;
+    }
+  }
+  EXPECT_TRUE(quantiles.tree().IsBalanced());
+  quantiles.Clear();
+  EXPECT_TRUE(quantiles.empty());
+  EXPECT_TRUE(quantiles.tree().empty());
+}
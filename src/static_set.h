@@ -0,0 +1,315 @@
+#ifndef STATIC_SET_H_
+#define STATIC_SET_H_
+
+#include <cstddef>
+#include <iterator>
+
+namespace trilib {
+
+namespace {
+
+template <size_t... I>
+struct IndexSeq {};
+
+template <typename A, typename B>
+struct ConcatSeq;
+
+template <size_t... I, size_t... J>
+struct ConcatSeq<IndexSeq<I...>, IndexSeq<J...>> {
+  using type = IndexSeq<I..., (sizeof...(I) + J)...>;
+};
+
+// IndexSeq<0, ..., N - 1>, built in halves so the instantiation depth is
+// only log N.
+template <size_t N>
+struct MakeIndexSeq
+    : ConcatSeq<typename MakeIndexSeq<N / 2>::type,
+                typename MakeIndexSeq<N - N / 2>::type> {};
+
+template <>
+struct MakeIndexSeq<0> {
+  using type = IndexSeq<>;
+};
+
+template <>
+struct MakeIndexSeq<1> {
+  using type = IndexSeq<0>;
+};
+
+template <typename ValueT, size_t N>
+struct ConstArray {
+  ValueT data[N];
+};
+
+}  // namespace
+
+// std::less isn't constexpr before C++14.
+template <typename ValueT>
+struct StaticLess {
+  constexpr bool operator()(const ValueT& a, const ValueT& b) const {
+    return a < b;
+  }
+};
+
+// Immutable ordered set of N values, sorted and laid out at compile time.
+// Values are kept in a single array in breadth-first (Eytzinger) order of
+// an implicit balanced tree, so top levels of every search share few cache
+// lines and descending is branch free. A constexpr set lives in read-only
+// data: no startup cost, no allocation. Queries have the same meaning as
+// RBTree ones and are constexpr as well.
+//
+//   constexpr int kCodes[] = {404, 200, 500, 301};
+//   constexpr auto kKnownCodes = trilib::MakeStaticSet(kCodes);
+//   static_assert(kKnownCodes.HasValue(404), "");
+//
+// CompT must be constexpr callable when the set is built at compile time.
+// Sorting takes O(N log^2 N) comparisons, big tables may need a higher
+// -fconstexpr-ops-limit (gcc) or -fconstexpr-steps (clang).
+template <typename ValueT, size_t N, typename CompT = StaticLess<ValueT>>
+class StaticSet {
+  static_assert(N > 0, "static set can't be empty");
+
+ public:
+  using value_type = ValueT;
+
+  class const_iterator
+      : public std::iterator<std::bidirectional_iterator_tag, ValueT,
+                             std::ptrdiff_t, const ValueT*, const ValueT&> {
+   public:
+    constexpr const_iterator() : set_(nullptr), k_(0) {}
+
+    constexpr const ValueT& operator*() const { return set_->At(k_); }
+    constexpr const ValueT* operator->() const { return &set_->At(k_); }
+
+    const_iterator& operator++() {
+      k_ = set_->Successor(k_);
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      const_iterator old = *this;
+      ++*this;
+      return old;
+    }
+
+    const_iterator& operator--() {
+      k_ = set_->Predecessor(k_);
+      return *this;
+    }
+
+    const_iterator operator--(int) {
+      const_iterator old = *this;
+      --*this;
+      return old;
+    }
+
+    constexpr bool operator==(const const_iterator& other) const {
+      return k_ == other.k_;
+    }
+    constexpr bool operator!=(const const_iterator& other) const {
+      return k_ != other.k_;
+    }
+
+   private:
+    constexpr const_iterator(const StaticSet* set, size_t k)
+        : set_(set), k_(k) {}
+
+    const StaticSet* set_;
+    size_t k_;  // index in the implicit tree counted from 1, 0 is end()
+
+    friend class StaticSet;
+  };
+  using iterator = const_iterator;
+
+  // Values don't have to be sorted, duplicates are kept.
+  constexpr explicit StaticSet(const ValueT (&values)[N])
+      : StaticSet(values, typename MakeIndexSeq<N>::type()) {}
+
+  constexpr size_t size() const { return N; }
+  constexpr bool empty() const { return false; }
+
+  constexpr const_iterator begin() const {
+    return const_iterator(this, Leftmost(1));
+  }
+  constexpr const_iterator end() const { return const_iterator(this, 0); }
+
+  // Returns iterator to an element equal to value or end().
+  constexpr const_iterator Search(const ValueT& value) const {
+    return const_iterator(this, SearchIndex(value, 1));
+  }
+
+  constexpr bool HasValue(const ValueT& value) const {
+    return SearchIndex(value, 1) != 0;
+  }
+
+  // Returns iterator to the first element greater than value or end().
+  constexpr const_iterator LowerBound(const ValueT& value) const {
+    return const_iterator(this, LastLeftTurn(DescendAbove(value, 1)));
+  }
+
+  // Returns iterator to the last element smaller than value or end().
+  constexpr const_iterator UpperBound(const ValueT& value) const {
+    return const_iterator(this, LastRightTurn(DescendBelow(value, 1)));
+  }
+
+ private:
+  using Array = ConstArray<ValueT, N>;
+
+  template <size_t... I>
+  constexpr StaticSet(const ValueT (&values)[N], IndexSeq<I...> seq)
+      : StaticSet(SortRuns(Array{{values[I]...}}, 1, seq), seq) {}
+
+  template <size_t... I>
+  constexpr StaticSet(const Array& sorted, IndexSeq<I...>)
+      : values_{sorted.data[InOrderRank(I + 1)]...} {}
+
+  static constexpr bool Less(const ValueT& a, const ValueT& b) {
+    return CompT()(a, b);
+  }
+
+  // Bottom-up merge sort, runs of width values are merged in pairs until
+  // a single run is left. Every value of a merged run is found with a binary
+  // search, so it takes O(N log^2 N) comparisons and recursion is only
+  // O(log N) deep, which keeps it within limits of constexpr evaluation.
+  template <size_t... I>
+  static constexpr Array SortRuns(const Array& runs, size_t width,
+                                  IndexSeq<I...> seq) {
+    return width >= N ? runs
+                      : SortRuns(Array{{MergedAt(runs, width, I)...}},
+                                 2 * width, seq);
+  }
+
+  // Value at position p after merging the pair of runs p belongs to.
+  static constexpr ValueT MergedAt(const Array& runs, size_t width,
+                                   size_t p) {
+    return MergedAt(runs.data, p / (2 * width) * (2 * width),
+                    Min(p / (2 * width) * (2 * width) + width, N),
+                    Min(p / (2 * width) * (2 * width) + 2 * width, N),
+                    p - p / (2 * width) * (2 * width));
+  }
+
+  // Merges [left, right) with [right, end) up to position q of the result.
+  static constexpr ValueT MergedAt(const ValueT* runs, size_t left,
+                                   size_t right, size_t end, size_t q) {
+    return TakeNext(runs, left, right, end, q,
+                    TakenFromLeft(runs, left, right, q,
+                                  q > end - right ? q - (end - right) : 0,
+                                  Min(q, right - left)));
+  }
+
+  // Number of left run values among the first q values of the merge, the
+  // largest i in [lo, hi] for which left value i - 1 doesn't come after
+  // right value q - i. Ties go to the left run, so the sort is stable.
+  static constexpr size_t TakenFromLeft(const ValueT* runs, size_t left,
+                                        size_t right, size_t q, size_t lo,
+                                        size_t hi) {
+    return lo == hi ? lo
+           : !Less(runs[right + q - (lo + hi + 1) / 2],
+                   runs[left + (lo + hi + 1) / 2 - 1])
+               ? TakenFromLeft(runs, left, right, q, (lo + hi + 1) / 2, hi)
+               : TakenFromLeft(runs, left, right, q, lo,
+                               (lo + hi + 1) / 2 - 1);
+  }
+
+  static constexpr ValueT TakeNext(const ValueT* runs, size_t left,
+                                   size_t right, size_t end, size_t q,
+                                   size_t i) {
+    return left + i < right &&
+                   (right + q - i >= end ||
+                    !Less(runs[right + q - i], runs[left + i]))
+               ? runs[left + i]
+               : runs[right + q - i];
+  }
+
+  static constexpr size_t Min(size_t a, size_t b) { return a < b ? a : b; }
+
+  // Number of nodes of a subtree, counted level by level. A level starts at
+  // node first and has width nodes if the tree is deep enough. Node k has
+  // children 2k and 2k + 1.
+  static constexpr size_t SubtreeSize(size_t first, size_t width) {
+    return first > N ? 0
+                     : Min(width, N - first + 1) +
+                           SubtreeSize(2 * first, 2 * width);
+  }
+
+  // Number of nodes before node k in order.
+  static constexpr size_t InOrderRank(size_t k) {
+    return SubtreeSize(2 * k, 1) + Before(k);
+  }
+
+  // Number of nodes in order before the subtree of node k.
+  static constexpr size_t Before(size_t k) {
+    return k == 1 ? 0 : k % 2 == 0 ? Before(k / 2) : InOrderRank(k / 2) + 1;
+  }
+
+  constexpr const ValueT& At(size_t k) const { return values_[k - 1]; }
+
+  constexpr size_t SearchIndex(const ValueT& value, size_t k) const {
+    return k > N ? 0
+                 : !(value != At(k))
+                       ? k
+                       : SearchIndex(value, 2 * k + !Less(value, At(k)));
+  }
+
+  // Descends to a leaf, turning right at nodes not greater than value.
+  constexpr size_t DescendAbove(const ValueT& value, size_t k) const {
+    return k > N ? k : DescendAbove(value, 2 * k + !Less(value, At(k)));
+  }
+
+  // Descends to a leaf, turning right at nodes smaller than value.
+  constexpr size_t DescendBelow(const ValueT& value, size_t k) const {
+    return k > N ? k : DescendBelow(value, 2 * k + Less(At(k), value));
+  }
+
+  // Bits of k below the root are turns of the path, 0 for left. Returns
+  // the node where the path turned left (right) for the last time, 0 if it
+  // never did.
+  static constexpr size_t LastLeftTurn(size_t k) {
+    return k % 2 == 1 ? LastLeftTurn(k / 2) : k / 2;
+  }
+  static constexpr size_t LastRightTurn(size_t k) {
+    return k == 0 ? 0 : k % 2 == 0 ? LastRightTurn(k / 2) : k / 2;
+  }
+
+  static constexpr size_t Leftmost(size_t k) {
+    return 2 * k > N ? k : Leftmost(2 * k);
+  }
+  static constexpr size_t Rightmost(size_t k) {
+    return 2 * k + 1 > N ? k : Rightmost(2 * k + 1);
+  }
+
+  size_t Successor(size_t k) const {
+    if (2 * k + 1 <= N) {
+      return Leftmost(2 * k + 1);
+    }
+    return LastLeftTurn(k);
+  }
+
+  // The predecessor of end() is the maximum.
+  size_t Predecessor(size_t k) const {
+    if (k == 0) {
+      return Rightmost(1);
+    }
+    if (2 * k <= N) {
+      return Rightmost(2 * k);
+    }
+    return LastRightTurn(k);
+  }
+
+  ValueT values_[N];  // Eytzinger order, node k at index k - 1
+};
+
+// Builds a StaticSet of a constexpr array, deducing its size.
+template <typename CompT, typename ValueT, size_t N>
+constexpr StaticSet<ValueT, N, CompT> MakeStaticSet(const ValueT (&values)[N]) {
+  return StaticSet<ValueT, N, CompT>(values);
+}
+
+template <typename ValueT, size_t N>
+constexpr StaticSet<ValueT, N> MakeStaticSet(const ValueT (&values)[N]) {
+  return StaticSet<ValueT, N>(values);
+}
+
+}  // trilib
+
+#endif  // STATIC_SET_H_
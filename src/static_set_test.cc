@@ -0,0 +1,98 @@
+#include "static_set.h"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+constexpr int kCodes[] = {404, 200, 500, 301, 302, 418, 503, 201, 204};
+constexpr auto kKnownCodes = trilib::MakeStaticSet(kCodes);
+
+static_assert(kKnownCodes.size() == 9, "");
+static_assert(kKnownCodes.HasValue(404), "");
+static_assert(!kKnownCodes.HasValue(405), "");
+static_assert(*kKnownCodes.begin() == 200, "");
+static_assert(*kKnownCodes.LowerBound(302) == 404, "");
+static_assert(*kKnownCodes.UpperBound(302) == 301, "");
+static_assert(kKnownCodes.LowerBound(503) == kKnownCodes.end(), "");
+static_assert(kKnownCodes.UpperBound(200) == kKnownCodes.end(), "");
+
+struct Greater {
+  constexpr bool operator()(int a, int b) const { return a > b; }
+};
+
+constexpr auto kDescending = trilib::MakeStaticSet<Greater>(kCodes);
+static_assert(*kDescending.begin() == 503, "");
+static_assert(*kDescending.LowerBound(404) == 302, "");
+
+// Compares all queries with std::multiset for a set of size N built at run
+// time, then goes on with N - 1.
+template <size_t N>
+void CheckSizes(const vector<int>& source) {
+  int values[N];
+  copy(source.begin(), source.begin() + N, values);
+  const trilib::StaticSet<int, N> static_set(values);
+  const multiset<int> expected(values, values + N);
+  ASSERT_TRUE(equal(expected.begin(), expected.end(), static_set.begin()))
+      << "N == " << N;
+  ASSERT_TRUE(equal(expected.rbegin(), expected.rend(),
+                    reverse_iterator<decltype(static_set.end())>(
+                        static_set.end())))
+      << "N == " << N;
+  for (int value = -1; value <= 2 * static_cast<int>(N) + 1; ++value) {
+    ASSERT_EQ(expected.count(value) > 0, static_set.HasValue(value));
+    if (expected.count(value) > 0) {
+      ASSERT_EQ(value, *static_set.Search(value));
+    } else {
+      ASSERT_TRUE(static_set.Search(value) == static_set.end());
+    }
+    auto above = expected.upper_bound(value);
+    if (above == expected.end()) {
+      ASSERT_TRUE(static_set.LowerBound(value) == static_set.end());
+    } else {
+      ASSERT_EQ(*above, *static_set.LowerBound(value)) << value;
+    }
+    auto below = expected.lower_bound(value);
+    if (below == expected.begin()) {
+      ASSERT_TRUE(static_set.UpperBound(value) == static_set.end());
+    } else {
+      ASSERT_EQ(*prev(below), *static_set.UpperBound(value)) << value;
+    }
+  }
+  CheckSizes<N - 1>(source);
+}
+
+template <>
+void CheckSizes<0>(const vector<int>&) {}
+
+}  // namespace
+
+TEST(StaticSet, AllSizes) {
+  vector<int> source;
+  int val = 0;
+  for (int i = 0; i < 70; ++i) {
+    val = (val + 37) % 71;
+    // Every fourth value duplicated.
+    source.push_back(i % 4 == 3 ? source.back() : val);
+  }
+  CheckSizes<70>(source);
+}
+
+TEST(StaticSet, Strings) {
+  const string words[] = {"pear", "apple", "fig", "kiwi", "banana"};
+  const trilib::StaticSet<string, 5, less<string>> fruits(words);
+  EXPECT_TRUE(fruits.HasValue("fig"));
+  EXPECT_FALSE(fruits.HasValue("plum"));
+  EXPECT_EQ("kiwi", *fruits.LowerBound("grape"));
+  EXPECT_EQ("fig", *fruits.UpperBound("grape"));
+  vector<string> sorted(fruits.begin(), fruits.end());
+  EXPECT_TRUE(is_sorted(sorted.begin(), sorted.end()));
+}
@@ -0,0 +1,245 @@
+#ifndef STRING_RBTREE_H_
+#define STRING_RBTREE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include "rbtree.h"
+
+namespace trilib {
+
+// String key for trees, see StringRBTree. The first kPrefixSize bytes are
+// cached as two big-endian integers, so comparing them is two integer
+// comparisons, and the rest of a key up to kInlineSize bytes lives inside
+// the object, so a node holds the whole key. Longer keys keep the rest on
+// the heap, it's touched only when prefixes tie.
+//
+// View makes a key which borrows a long string instead of copying it, for
+// allocation-free queries. Copies and moves of a view own their bytes.
+class InlineString {
+ public:
+  static constexpr size_t kPrefixSize = 16;
+  static constexpr size_t kInlineSize = 40;
+
+  InlineString() : prefix_{0, 0}, size_(0), borrowed_(false) {}
+
+  InlineString(const char* data, size_t size) { Assign(data, size, false); }
+  InlineString(const char* str) { Assign(str, std::strlen(str), false); }
+  InlineString(const std::string& str) {
+    Assign(str.data(), str.size(), false);
+  }
+
+  InlineString(const InlineString& other) { CopyFrom(other); }
+
+  InlineString(InlineString&& other) {
+    if (other.IsLong() && !other.borrowed_) {
+      std::memcpy(static_cast<void*>(this), &other, sizeof(InlineString));
+      other.size_ = 0;
+      other.prefix_[0] = other.prefix_[1] = 0;
+    } else {
+      CopyFrom(other);
+    }
+  }
+
+  InlineString& operator=(InlineString other) {
+    // Nothing points inside the object, bytes can be swapped.
+    char tmp[sizeof(InlineString)];
+    std::memcpy(tmp, static_cast<void*>(this), sizeof(InlineString));
+    std::memcpy(static_cast<void*>(this), &other, sizeof(InlineString));
+    std::memcpy(static_cast<void*>(&other), tmp, sizeof(InlineString));
+    return *this;
+  }
+
+  ~InlineString() {
+    if (IsLong() && !borrowed_) {
+      delete[] heap_;
+    }
+  }
+
+  // Key pointing to data, which must outlive it, if it's longer than
+  // kInlineSize.
+  static InlineString View(const char* data, size_t size) {
+    InlineString view;
+    view.Assign(data, size, true);
+    return view;
+  }
+  static InlineString View(const std::string& str) {
+    return View(str.data(), str.size());
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  std::string str() const {
+    std::string str(size_, '\0');
+    for (size_t i = 0; i < PrefixBytes(size_); ++i) {
+      str[i] = static_cast<char>(prefix_[i / 8] >> (56 - 8 * (i % 8)));
+    }
+    if (size_ > kPrefixSize) {
+      std::memcpy(&str[kPrefixSize], tail(), size_ - kPrefixSize);
+    }
+    return str;
+  }
+
+  // Orders like std::string, i.e. by unsigned bytes.
+  bool operator<(const InlineString& other) const {
+    if (prefix_[0] != other.prefix_[0]) {
+      return prefix_[0] < other.prefix_[0];
+    }
+    if (prefix_[1] != other.prefix_[1]) {
+      return prefix_[1] < other.prefix_[1];
+    }
+    return CompareTail(other) < 0;
+  }
+
+  bool operator==(const InlineString& other) const {
+    return prefix_[0] == other.prefix_[0] &&
+           prefix_[1] == other.prefix_[1] && size_ == other.size_ &&
+           (size_ <= kPrefixSize ||
+            std::memcmp(tail(), other.tail(), size_ - kPrefixSize) == 0);
+  }
+  bool operator!=(const InlineString& other) const {
+    return !(*this == other);
+  }
+
+  // Hash of the prefix, the size and the tail, for std::hash.
+  size_t hash() const {
+    uint64_t hash = Mix(size_ + 0x9e3779b97f4a7c15ULL);
+    hash = Mix(Mix(hash ^ prefix_[0]) ^ prefix_[1]);
+    if (size_ > kPrefixSize) {
+      // FNV-1a over the tail.
+      const char* bytes = tail();
+      for (size_t i = 0; i < size_ - kPrefixSize; ++i) {
+        hash ^= static_cast<unsigned char>(bytes[i]);
+        hash *= 0x100000001b3ULL;
+      }
+    }
+    return static_cast<size_t>(Mix(hash));
+  }
+
+ private:
+  static constexpr size_t kTailSize = kInlineSize - kPrefixSize;
+
+  bool IsLong() const { return size_ > kInlineSize; }
+
+  static uint64_t Mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    return x ^ (x >> 31);
+  }
+
+  static size_t PrefixBytes(size_t size) {
+    return size < kPrefixSize ? size : kPrefixSize;
+  }
+
+  // Bytes after the prefix.
+  const char* tail() const { return IsLong() ? heap_ : inline_; }
+
+  void Assign(const char* data, size_t size, bool borrow) {
+    prefix_[0] = prefix_[1] = 0;
+    for (size_t i = 0; i < PrefixBytes(size); ++i) {
+      prefix_[i / 8] |= uint64_t(static_cast<unsigned char>(data[i]))
+                        << (56 - 8 * (i % 8));
+    }
+    size_ = static_cast<uint32_t>(size);
+    borrowed_ = borrow && IsLong();
+    if (borrowed_) {
+      heap_ = data + kPrefixSize;
+    } else {
+      SetTail(data + PrefixBytes(size));
+    }
+  }
+
+  void CopyFrom(const InlineString& other) {
+    prefix_[0] = other.prefix_[0];
+    prefix_[1] = other.prefix_[1];
+    size_ = other.size_;
+    borrowed_ = false;
+    SetTail(other.tail());
+  }
+
+  void SetTail(const char* bytes) {
+    if (size_ <= kPrefixSize) {
+      return;
+    }
+    char* dst = IsLong() ? new char[size_ - kPrefixSize] : inline_;
+    std::memcpy(dst, bytes, size_ - kPrefixSize);
+    if (IsLong()) {
+      heap_ = dst;
+    }
+  }
+
+  // Compares keys with equal prefixes.
+  int CompareTail(const InlineString& other) const {
+    if (size_ > kPrefixSize && other.size_ > kPrefixSize) {
+      const int cmp =
+          std::memcmp(tail(), other.tail(),
+                      std::min(size_, other.size_) - kPrefixSize);
+      if (cmp != 0) {
+        return cmp;
+      }
+    }
+    // The shorter key is a prefix of the longer one, padding of the
+    // prefix with zeros doesn't matter.
+    return size_ < other.size_ ? -1 : size_ > other.size_ ? 1 : 0;
+  }
+
+  uint64_t prefix_[2];  // first kPrefixSize bytes, zero padded
+  uint32_t size_;
+  bool borrowed_;  // heap_ points to bytes of someone else
+  union {
+    char inline_[kTailSize];
+    const char* heap_;
+  };
+};
+
+inline std::ostream& operator<<(std::ostream& out, const InlineString& str) {
+  return out << str.str();
+}
+
+// Codec of InlineString for RBTree::SaveTo and RBTree::LoadFrom, stream
+// format is the same as of StringCodec.
+struct InlineStringCodec {
+  static bool Write(std::ostream& out, const InlineString& value) {
+    return StringCodec::Write(out, value.str());
+  }
+
+  static bool Read(std::istream& in, InlineString* value) {
+    std::string str;
+    if (!StringCodec::Read(in, &str)) {
+      return false;
+    }
+    *value = InlineString(str);
+    return true;
+  }
+};
+
+// Tree of string keys which compares cached prefixes first and keeps short
+// keys in nodes. A lookup of a key that differs from others within the
+// prefix, like a UUID or a URL of a different host, never leaves the nodes.
+//
+//   trilib::StringRBTree<> urls;
+//   urls.Insert("https://example.com/");
+//   urls.HasValue(trilib::InlineString::View(url));  // doesn't copy url
+template <typename BalanceT = RedBlackBalance,
+          typename CacheT = NoLookupCache, typename AugmentT = NoAugment>
+using StringRBTree =
+    RBTree<InlineString, std::less<InlineString>, BalanceT, CacheT, AugmentT>;
+
+}  // trilib
+
+namespace std {
+
+template <>
+struct hash<trilib::InlineString> {
+  size_t operator()(const trilib::InlineString& str) const {
+    return str.hash();
+  }
+};
+
+}  // std
+
+#endif  // STRING_RBTREE_H_
@@ -0,0 +1,171 @@
+#include "string_rbtree.h"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+using trilib::InlineString;
+
+namespace {
+
+// Keys of all sizes around kPrefixSize and kInlineSize, with long shared
+// prefixes, zero and high bytes.
+vector<string> MakeKeys(size_t count) {
+  mt19937_64 gen(1);
+  const string alphabet("\0\1az\x7f\x80\xff", 7);
+  vector<string> keys;
+  for (size_t i = 0; i < count; ++i) {
+    string key = i % 3 == 0 ? string("https://example.com/") : string();
+    const size_t size = gen() % 60;
+    for (size_t j = 0; j < size; ++j) {
+      key.push_back(alphabet[gen() % alphabet.size()]);
+    }
+    keys.push_back(key);
+  }
+  return keys;
+}
+
+}  // namespace
+
+TEST(InlineString, OrdersLikeString) {
+  const vector<string> keys = MakeKeys(300);
+  for (const string& a : keys) {
+    const InlineString inline_a(a);
+    ASSERT_EQ(a, inline_a.str());
+    ASSERT_EQ(a.size(), inline_a.size());
+    for (const string& b : keys) {
+      const InlineString inline_b = InlineString::View(b);
+      ASSERT_EQ(a < b, inline_a < inline_b) << a << " " << b;
+      ASSERT_EQ(a == b, inline_a == inline_b) << a << " " << b;
+    }
+  }
+}
+
+TEST(InlineString, CopyAndMove) {
+  for (size_t size : {0, 5, 16, 17, 40, 41, 100}) {
+    const string str(size, 'q');
+    InlineString a(str);
+    InlineString b(a);
+    InlineString c(move(a));
+    EXPECT_EQ(str, b.str());
+    EXPECT_EQ(str, c.str());
+    a = c;
+    EXPECT_EQ(str, a.str());
+    b = InlineString("other");
+    EXPECT_EQ("other", b.str());
+
+    // A view copied or moved into a tree owns its bytes.
+    string source = str;
+    trilib::StringRBTree<> tree;
+    tree.Insert(InlineString::View(source));
+    InlineString view = InlineString::View(source);
+    tree.Insert(view);
+    source.assign(size, 'x');
+    for (const InlineString& key : tree) {
+      EXPECT_EQ(str, key.str());
+    }
+  }
+}
+
+TEST(StringRBTree, MatchesStdSet) {
+  const vector<string> keys = MakeKeys(3000);
+  trilib::StringRBTree<> tree;
+  multiset<string> expected;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    tree.Insert(keys[i]);
+    expected.insert(keys[i]);
+    if (i % 4 == 3) {
+      tree.Delete(keys[i / 2]);
+      expected.erase(expected.find(keys[i / 2]));
+    }
+  }
+  ASSERT_EQ(expected.size(), tree.size());
+  auto iter = tree.begin();
+  for (const string& key : expected) {
+    ASSERT_EQ(key, (*iter).str());
+    ++iter;
+  }
+  for (const string& key : MakeKeys(6000)) {
+    ASSERT_EQ(expected.count(key) > 0,
+              tree.HasValue(InlineString::View(key)));
+    auto above = expected.upper_bound(key);
+    auto tree_above = tree.LowerBound(InlineString::View(key));
+    if (above == expected.end()) {
+      ASSERT_TRUE(tree_above == tree.end());
+    } else {
+      ASSERT_EQ(*above, (*tree_above).str());
+    }
+  }
+
+  stringstream stream;
+  ASSERT_TRUE(tree.SaveTo<trilib::InlineStringCodec>(stream));
+  trilib::RBTree<string, less<string>> plain;
+  ASSERT_TRUE(plain.LoadFrom<trilib::StringCodec>(stream));
+  EXPECT_TRUE(equal(expected.begin(), expected.end(), plain.begin()));
+  stream.clear();
+  stream.seekg(0);
+  trilib::StringRBTree<> loaded;
+  ASSERT_TRUE(loaded.LoadFrom<trilib::InlineStringCodec>(stream));
+  EXPECT_TRUE(equal(tree.begin(), tree.end(), loaded.begin()));
+}
+
+TEST(InlineString, Hash) {
+  const vector<string> keys = MakeKeys(300);
+  hash<InlineString> hasher;
+  set<size_t> hashes;
+  set<string> distinct;
+  for (const string& key : keys) {
+    // Views hash like owned copies, the tail counts.
+    ASSERT_EQ(hasher(InlineString(key)), hasher(InlineString::View(key)));
+    if (distinct.insert(key).second) {
+      hashes.insert(hasher(InlineString(key)));
+    }
+  }
+  EXPECT_EQ(distinct.size(), hashes.size());
+  EXPECT_NE(hasher(InlineString(string(50, 'a'))),
+            hasher(InlineString(string(49, 'a') + "b")));
+}
+
+TEST(StringRBTree, CacheAndSubtreeHash) {
+  const vector<string> keys = MakeKeys(2000);
+  trilib::StringRBTree<trilib::RedBlackBalance, trilib::LookupCache<64, 2>>
+      cached;
+  trilib::StringRBTree<trilib::RedBlackBalance, trilib::NoLookupCache,
+                       trilib::SubtreeHash>
+      forward, backward;
+  set<string> expected;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (expected.insert(keys[i]).second) {
+      cached.Insert(keys[i]);
+      forward.Insert(keys[i]);
+    }
+  }
+  for (auto key = expected.rbegin(); key != expected.rend(); ++key) {
+    backward.Insert(*key);
+  }
+  EXPECT_EQ(forward.RootHash(), backward.RootHash());
+  for (const string& key : MakeKeys(3000)) {
+    ASSERT_EQ(expected.count(key) > 0,
+              cached.HasValue(InlineString::View(key)));
+  }
+  // Few hot keys stay cached.
+  for (int round = 0; round < 2; ++round) {
+    for (size_t i = 0; i < 8; ++i) {
+      ASSERT_TRUE(cached.HasValue(InlineString::View(keys[i])));
+    }
+  }
+  EXPECT_GT(cached.cache_stats().hits, 0u);
+  cached.Delete(InlineString(*expected.begin()));
+  EXPECT_FALSE(cached.HasValue(InlineString(*expected.begin())));
+  backward.Delete(InlineString(*expected.begin()));
+  EXPECT_NE(forward.RootHash(), backward.RootHash());
+}
@@ -0,0 +1,432 @@
+#ifndef TOPDOWN_RBTREE_H_
+#define TOPDOWN_RBTREE_H_
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <utility>
+
+namespace trilib {
+
+// Node of TopDownRBTree, without a parent link.
+template <typename ValueT>
+struct TopDownRBTreeNode {
+  TopDownRBTreeNode()
+      : left_child(nullptr), right_child(nullptr), red(false) {}
+  explicit TopDownRBTreeNode(ValueT value)
+      : left_child(nullptr),
+        right_child(nullptr),
+        value_(std::move(value)),
+        red(true) {}
+
+  // Left child for dir 0, right for 1.
+  TopDownRBTreeNode*& child(int dir) {
+    return dir ? right_child : left_child;
+  }
+  TopDownRBTreeNode* child(int dir) const {
+    return dir ? right_child : left_child;
+  }
+
+  TopDownRBTreeNode* left_child;
+  TopDownRBTreeNode* right_child;
+  ValueT value_;
+  bool red;
+};
+
+// Red-black tree whose nodes don't link to their parents. Insert and Delete
+// fix colors on the way down in a single pass from the root, so they never
+// climb back, and rotations write only child links. Nodes are 8 bytes
+// smaller than those of RBTree.
+//
+// Iterators carry the path from the root instead, so they are bigger and
+// any Insert or Delete invalidates all of them. Delete moves the value of
+// a neighbour into the node of the deleted one, so ValueT must be movable,
+// and it must be default constructible for the sentinel above the root.
+// Duplicates are allowed, Search and bounds have the semantics of RBTree.
+template <typename ValueT, typename CompT = std::less<ValueT>>
+class TopDownRBTree {
+ public:
+  using NodeT = TopDownRBTreeNode<ValueT>;
+  using value_type = ValueT;
+
+  // Height of a red-black tree of n nodes is at most 2 log2(n + 1), so
+  // paths of this length cover any tree that fits in a 48-bit address space.
+  static constexpr int kMaxHeight = 96;
+
+  TopDownRBTree() : size_(0), value_cmp_() {}
+  ~TopDownRBTree() { Clear(); }
+
+  TopDownRBTree(const TopDownRBTree& other)
+      : size_(other.size_), value_cmp_(other.value_cmp_) {
+    head_.right_child = Clone(other.root());
+  }
+
+  TopDownRBTree(TopDownRBTree&& other)
+      : size_(0), value_cmp_(other.value_cmp_) {
+    Swap(other);
+  }
+
+  TopDownRBTree& operator=(TopDownRBTree other) {
+    Swap(other);
+    return *this;
+  }
+
+  void Swap(TopDownRBTree& other) {
+    std::swap(head_.right_child, other.head_.right_child);
+    std::swap(size_, other.size_);
+  }
+
+  class const_iterator
+      : public std::iterator<std::bidirectional_iterator_tag, ValueT> {
+   public:
+    const_iterator() : tree_(nullptr), depth_(0) {}
+
+    bool operator==(const const_iterator& other) const {
+      return node() == other.node();
+    }
+
+    bool operator!=(const const_iterator& other) const {
+      return !(*this == other);
+    }
+
+    const ValueT& operator*() const { return node()->value_; }
+
+    const_iterator& operator++() {
+      const NodeT* x = node();
+      if (x->right_child != nullptr) {
+        Descend(x->right_child, 0);
+        return *this;
+      }
+      // Up to the first ancestor x is on the left of.
+      do {
+        x = path_[--depth_];
+      } while (depth_ > 0 && path_[depth_ - 1]->right_child == x);
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      const const_iterator old(*this);
+      ++(*this);
+      return old;
+    }
+
+    const_iterator& operator--() {
+      const NodeT* x = node();
+      if (x == nullptr) {
+        Descend(tree_->root(), 1);
+        return *this;
+      }
+      if (x->left_child != nullptr) {
+        Descend(x->left_child, 1);
+        return *this;
+      }
+      do {
+        x = path_[--depth_];
+      } while (depth_ > 0 && path_[depth_ - 1]->left_child == x);
+      return *this;
+    }
+
+    const_iterator operator--(int) {
+      const const_iterator old(*this);
+      --(*this);
+      return old;
+    }
+
+    friend class TopDownRBTree;
+
+   private:
+    explicit const_iterator(const TopDownRBTree* tree)
+        : tree_(tree), depth_(0) {}
+
+    const NodeT* node() const {
+      return depth_ == 0 ? nullptr : path_[depth_ - 1];
+    }
+
+    // Pushes x and its descendants in direction dir.
+    void Descend(const NodeT* x, int dir) {
+      for (; x != nullptr; x = x->child(dir)) {
+        path_[depth_++] = x;
+      }
+    }
+
+    const TopDownRBTree* tree_;
+    // Path from the root to the current node, empty for end().
+    const NodeT* path_[kMaxHeight];
+    int depth_;
+  };
+
+  // Values can't be modified in place, so both are the same.
+  using iterator = const_iterator;
+
+  const_iterator begin() const {
+    const_iterator iter(this);
+    iter.Descend(root(), 0);
+    return iter;
+  }
+  const_iterator end() const { return const_iterator(this); }
+
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  void Clear() {
+    Free(root());
+    head_.right_child = nullptr;
+    size_ = 0;
+  }
+
+  // Unlike RBTree::Insert returns nothing, an iterator would have to be
+  // found by a second descent.
+  void Insert(ValueT value) {
+    NodeT* node = new NodeT(std::move(value));
+    ++size_;
+    if (root() == nullptr) {
+      head_.right_child = node;
+      node->red = false;
+      return;
+    }
+    // Great-grandparent, grandparent, parent and the current node.
+    NodeT* t = &head_;
+    NodeT* g = nullptr;
+    NodeT* p = nullptr;
+    NodeT* q = root();
+    int dir = 0;
+    int last = 0;
+    while (true) {
+      if (q == nullptr) {
+        p->child(dir) = q = node;
+      } else if (IsRed(q->left_child) && IsRed(q->right_child)) {
+        q->red = true;
+        q->left_child->red = false;
+        q->right_child->red = false;
+      }
+      // Two reds in a row after adding or flipping q.
+      if (IsRed(q) && IsRed(p)) {
+        const int dir2 = t->right_child == g;
+        t->child(dir2) = q == p->child(last) ? Single(g, !last)
+                                           : Double(g, !last);
+      }
+      if (q == node) {
+        break;
+      }
+      last = dir;
+      // Equal values go right.
+      dir = !value_cmp_(node->value_, q->value_);
+      if (g != nullptr) {
+        t = g;
+      }
+      g = p;
+      p = q;
+      q = q->child(dir);
+    }
+    root()->red = false;
+  }
+
+  // Removes one element equal to value, returns false if there is none.
+  bool Delete(const ValueT& value) {
+    if (root() == nullptr) {
+      return false;
+    }
+    NodeT* q = &head_;
+    NodeT* g = nullptr;
+    NodeT* p = nullptr;
+    NodeT* found = nullptr;
+    int dir = 1;
+    // Descends to the predecessor of the last equal node on the way,
+    // keeping the current node red so it can be removed without a fixup.
+    while (q->child(dir) != nullptr) {
+      const int last = dir;
+      g = p;
+      p = q;
+      q = q->child(dir);
+      dir = value_cmp_(q->value_, value);
+      if (!dir && !(value != q->value_)) {
+        found = q;
+      }
+      if (IsRed(q) || IsRed(q->child(dir))) {
+        continue;
+      }
+      if (IsRed(q->child(!dir))) {
+        p = p->child(last) = Single(q, dir);
+        continue;
+      }
+      NodeT* s = p->child(!last);
+      if (s == nullptr) {
+        continue;
+      }
+      if (!IsRed(s->left_child) && !IsRed(s->right_child)) {
+        p->red = false;
+        s->red = true;
+        q->red = true;
+      } else {
+        const int dir2 = g->right_child == p;
+        g->child(dir2) =
+            IsRed(s->child(last)) ? Double(p, last) : Single(p, last);
+        q->red = g->child(dir2)->red = true;
+        g->child(dir2)->left_child->red = false;
+        g->child(dir2)->right_child->red = false;
+      }
+    }
+    if (found != nullptr) {
+      if (found != q) {
+        found->value_ = std::move(q->value_);
+      }
+      p->child(p->right_child == q) = q->child(q->left_child == nullptr);
+      delete q;
+      --size_;
+    }
+    if (root() != nullptr) {
+      root()->red = false;
+    }
+    return found != nullptr;
+  }
+
+  // Returns iterator to an element equal to value, end() if there is none.
+  // Like RBTree::Search it tests equality with operator!=. Lookups branch
+  // on named children rather than indexing them by the comparison, so the
+  // CPU can load the next node before the comparison is done.
+  const_iterator Search(const ValueT& value) const {
+    const_iterator iter(this);
+    for (const NodeT* x = root(); x != nullptr;) {
+      iter.path_[iter.depth_++] = x;
+      if (!(value != x->value_)) {
+        return iter;
+      }
+      x = value_cmp_(value, x->value_) ? x->left_child : x->right_child;
+    }
+    return end();
+  }
+
+  bool HasValue(const ValueT& value) const {
+    const NodeT* x = root();
+    while (x != nullptr && value != x->value_) {
+      if (value_cmp_(value, x->value_)) {
+        x = x->left_child;
+      } else {
+        x = x->right_child;
+      }
+    }
+    return x != nullptr;
+  }
+
+  // First element greater than val, see RBTree::LowerBound.
+  const_iterator LowerBound(const ValueT& val) const {
+    const_iterator iter(this);
+    int found = 0;
+    for (const NodeT* x = root(); x != nullptr;) {
+      iter.path_[iter.depth_++] = x;
+      if (value_cmp_(val, x->value_)) {
+        found = iter.depth_;
+        x = x->left_child;
+      } else {
+        x = x->right_child;
+      }
+    }
+    // Path to the result is a prefix of the path searched.
+    iter.depth_ = found;
+    return iter;
+  }
+
+  // Last element smaller than val, see RBTree::UpperBound.
+  const_iterator UpperBound(const ValueT& val) const {
+    const_iterator iter(this);
+    int found = 0;
+    for (const NodeT* x = root(); x != nullptr;) {
+      iter.path_[iter.depth_++] = x;
+      if (value_cmp_(x->value_, val)) {
+        found = iter.depth_;
+        x = x->right_child;
+      } else {
+        x = x->left_child;
+      }
+    }
+    iter.depth_ = found;
+    return iter;
+  }
+
+  bool IsBinarySearchTree() const {
+    return CheckOrder(root(), nullptr, nullptr);
+  }
+
+  // Checks that no red node has a red child and that all paths have the
+  // same number of black nodes.
+  bool IsBalanced() const { return !IsRed(root()) && BlackHeight(root()) >= 0; }
+
+ private:
+  const NodeT* root() const { return head_.right_child; }
+  NodeT* root() { return head_.right_child; }
+
+  static bool IsRed(const NodeT* x) { return x != nullptr && x->red; }
+
+  // Rotates x in direction dir, the new subtree root is black and x red.
+  static NodeT* Single(NodeT* x, int dir) {
+    NodeT* y = x->child(!dir);
+    x->child(!dir) = y->child(dir);
+    y->child(dir) = x;
+    x->red = true;
+    y->red = false;
+    return y;
+  }
+
+  static NodeT* Double(NodeT* x, int dir) {
+    x->child(!dir) = Single(x->child(!dir), !dir);
+    return Single(x, dir);
+  }
+
+  static void Free(NodeT* x) {
+    if (x != nullptr) {
+      Free(x->left_child);
+      Free(x->right_child);
+      delete x;
+    }
+  }
+
+  static NodeT* Clone(const NodeT* x) {
+    if (x == nullptr) {
+      return nullptr;
+    }
+    NodeT* y = new NodeT(x->value_);
+    y->red = x->red;
+    y->left_child = Clone(x->left_child);
+    y->right_child = Clone(x->right_child);
+    return y;
+  }
+
+  // Values of subtree x must be within [*low, *high]. Rotations can put
+  // duplicates on either side.
+  bool CheckOrder(const NodeT* x, const ValueT* low,
+                  const ValueT* high) const {
+    return x == nullptr ||
+           ((low == nullptr || !value_cmp_(x->value_, *low)) &&
+            (high == nullptr || !value_cmp_(*high, x->value_)) &&
+            CheckOrder(x->left_child, low, &x->value_) &&
+            CheckOrder(x->right_child, &x->value_, high));
+  }
+
+  // Number of black nodes on every path down from x, -1 if they differ or
+  // a red node has a red child.
+  static int BlackHeight(const NodeT* x) {
+    if (x == nullptr) {
+      return 0;
+    }
+    if (x->red && (IsRed(x->left_child) || IsRed(x->right_child))) {
+      return -1;
+    }
+    const int left = BlackHeight(x->left_child);
+    const int right = BlackHeight(x->right_child);
+    if (left < 0 || left != right) {
+      return -1;
+    }
+    return left + (x->red ? 0 : 1);
+  }
+
+  // Sentinel above the root, which is its right child. Rotations of the
+  // root then need no special case.
+  NodeT head_;
+  size_t size_;
+  const CompT value_cmp_;
+};
+
+}  // trilib
+
+#endif  // TOPDOWN_RBTREE_H_
@@ -0,0 +1,151 @@
+#include "topdown_rbtree.h"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <set>
+#include <string>
+#include <utility>
+
+using namespace std;
+
+using Tree = trilib::TopDownRBTree<int64_t>;
+
+template <typename TreeT, typename ValueT>
+void ExpectContent(const TreeT& tree, const multiset<ValueT>& expected) {
+  ASSERT_EQ(expected.size(), tree.size());
+  ASSERT_TRUE(equal(expected.begin(), expected.end(), tree.begin()));
+  typename TreeT::const_iterator it = tree.end();
+  for (auto value = expected.rbegin(); value != expected.rend(); ++value) {
+    ASSERT_EQ(*value, *--it);
+  }
+  ASSERT_TRUE(it == tree.begin());
+  ASSERT_TRUE(tree.IsBinarySearchTree());
+  ASSERT_TRUE(tree.IsBalanced());
+}
+
+TEST(TopDownRBTree, Empty) {
+  Tree tree;
+  EXPECT_TRUE(tree.empty());
+  EXPECT_TRUE(tree.begin() == tree.end());
+  EXPECT_TRUE(tree.Search(1) == tree.end());
+  EXPECT_TRUE(tree.LowerBound(1) == tree.end());
+  EXPECT_TRUE(tree.UpperBound(1) == tree.end());
+  EXPECT_FALSE(tree.Delete(1));
+  tree.Insert(1);
+  EXPECT_TRUE(tree.Delete(1));
+  EXPECT_FALSE(tree.Delete(1));
+  EXPECT_TRUE(tree.empty());
+  EXPECT_TRUE(tree.IsBalanced());
+}
+
+TEST(TopDownRBTree, MatchesMultiset) {
+  Tree tree;
+  multiset<int64_t> expected;
+  unsigned seed = 11;
+  for (int round = 0; round < 200; ++round) {
+    // Inserts win in early rounds, deletes in late ones.
+    const unsigned inserts = round < 100 ? 60 : 20;
+    for (unsigned i = 0; i < 80; ++i) {
+      seed = seed * 1103515245 + 12345;
+      const int64_t value = (seed >> 16) % 3000;
+      if ((seed >> 8) % 80 < inserts) {
+        tree.Insert(value);
+        expected.insert(value);
+      } else {
+        const auto victim = expected.find(value);
+        ASSERT_EQ(victim != expected.end(), tree.Delete(value));
+        if (victim != expected.end()) {
+          expected.erase(victim);
+        }
+      }
+    }
+    ExpectContent(tree, expected);
+    for (int i = 0; i < 20; ++i) {
+      seed = seed * 1103515245 + 12345;
+      const int64_t probe = (seed >> 16) % 3100 - 50;
+      ASSERT_EQ(expected.count(probe) > 0, tree.HasValue(probe));
+      const auto found = tree.Search(probe);
+      ASSERT_EQ(expected.count(probe) > 0, found != tree.end());
+      if (found != tree.end()) {
+        ASSERT_EQ(probe, *found);
+      }
+      const auto upper = expected.upper_bound(probe);
+      if (upper == expected.end()) {
+        ASSERT_TRUE(tree.LowerBound(probe) == tree.end());
+      } else {
+        ASSERT_EQ(*upper, *tree.LowerBound(probe));
+      }
+      const auto lower = expected.lower_bound(probe);
+      if (lower == expected.begin()) {
+        ASSERT_TRUE(tree.UpperBound(probe) == tree.end());
+      } else {
+        ASSERT_EQ(*prev(lower), *tree.UpperBound(probe));
+      }
+    }
+  }
+}
+
+TEST(TopDownRBTree, IteratorsFromLookups) {
+  Tree tree;
+  for (int64_t value = 0; value < 1000; ++value) {
+    tree.Insert(value * 2);
+  }
+  // Iterators from lookups walk both ways from the middle of the tree.
+  auto it = tree.LowerBound(999);
+  ASSERT_EQ(1000, *it);
+  int64_t next = 1000;
+  for (; it != tree.end(); ++it, next += 2) {
+    ASSERT_EQ(next, *it);
+  }
+  ASSERT_EQ(2000, next);
+  it = tree.Search(1000);
+  for (int64_t prev = 1000; prev >= 0; prev -= 2) {
+    ASSERT_EQ(prev, *it--);
+  }
+  it = tree.UpperBound(3);
+  ASSERT_EQ(2, *it);
+  ASSERT_EQ(0, *--it);
+  ASSERT_TRUE(it == tree.begin());
+}
+
+TEST(TopDownRBTree, CopyAndMove) {
+  Tree tree;
+  multiset<int64_t> expected;
+  for (int64_t value = 0; value < 500; ++value) {
+    tree.Insert(value * 7 % 101);
+    expected.insert(value * 7 % 101);
+  }
+  Tree copy = tree;
+  ExpectContent(copy, expected);
+  copy.Delete(5);
+  ExpectContent(tree, expected);
+  Tree moved = move(tree);
+  EXPECT_TRUE(tree.empty());
+  ExpectContent(moved, expected);
+  tree = moved;
+  moved.Clear();
+  ExpectContent(tree, expected);
+}
+
+TEST(TopDownRBTree, Strings) {
+  trilib::TopDownRBTree<string> tree;
+  multiset<string> expected;
+  for (int i = 0; i < 2000; ++i) {
+    const string word = "key" + to_string(i * 37 % 501) + string(i % 40, 'x');
+    tree.Insert(word);
+    expected.insert(word);
+    if (i % 3 == 0) {
+      const string victim = "key" + to_string(i % 501);
+      const auto found = expected.find(victim);
+      ASSERT_EQ(found != expected.end(), tree.Delete(victim));
+      if (found != expected.end()) {
+        expected.erase(found);
+      }
+    }
+  }
+  ExpectContent(tree, expected);
+}